@@ -0,0 +1,174 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <future>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <eigen3/Eigen/Core>
+#include "camera.hpp"
+#include "scene.hpp"
+#include "image_encoder.hpp"
+#include "memory_tracker.hpp"
+#include "utils.hpp"
+#include "config.h"
+
+// Camera keyframes, interpolated with a Catmull-Rom spline through the positions and
+// linearly between directions, up vectors and fields of view
+class CameraPath
+{
+    using Vec3 = Eigen::Vector3d;
+
+public:
+    struct Key
+    {
+        double time;
+        Vec3 pos;
+        Vec3 dir;
+        Vec3 up = CAMERA_UP;
+        double hfov = CAMERA_HFOV;
+    };
+
+private:
+    std::vector<Key> _keys; // sorted by time
+
+    static Vec3 _catmullRom(const Vec3 &p0, const Vec3 &p1, const Vec3 &p2, const Vec3 &p3, double u)
+    {
+        double u2 = u * u, u3 = u2 * u;
+        return 0.5 * (2.0 * p1 + (p2 - p0) * u + (2.0 * p0 - 5.0 * p1 + 4.0 * p2 - p3) * u2 + (3.0 * p1 - p0 - 3.0 * p2 + p3) * u3);
+    }
+
+public:
+    CameraPath(){};
+
+public:
+    void addKey(const Key &key)
+    {
+        auto it = std::upper_bound(_keys.begin(), _keys.end(), key.time, [](double time, const Key &other)
+                                   { return time < other.time; });
+        _keys.insert(it, key);
+    }
+    // One key per line: time px py pz dx dy dz [ux uy uz [hfov]], lines starting with # are skipped
+    void load(const std::string &path)
+    {
+        std::ifstream ifs(path);
+        if (!ifs.is_open())
+            RAISE_ERROR(("Failed to open camera path " + path).c_str());
+        std::string line;
+        while (std::getline(ifs, line))
+        {
+            std::istringstream is(line);
+            Key key;
+            if (line.empty() || line[0] == '#')
+                continue;
+            if (!(is >> key.time >> key.pos[0] >> key.pos[1] >> key.pos[2] >> key.dir[0] >> key.dir[1] >> key.dir[2]))
+                RAISE_ERROR(("Bad camera key in " + path + ": " + line).c_str());
+            if (is >> key.up[0] >> key.up[1] >> key.up[2])
+                is >> key.hfov;
+            addKey(key);
+        }
+        if (_keys.empty())
+            RAISE_ERROR(("No camera keys in " + path).c_str());
+    }
+
+    inline bool empty() const
+    {
+        return _keys.empty();
+    }
+    inline double startTime() const
+    {
+        return _keys.front().time;
+    }
+    inline double endTime() const
+    {
+        return _keys.back().time;
+    }
+    // The camera at time, clamped to the first and last keys
+    Key at(double time) const
+    {
+        if (time <= _keys.front().time)
+            return _keys.front();
+        if (time >= _keys.back().time)
+            return _keys.back();
+        int k = int(std::upper_bound(_keys.begin(), _keys.end(), time, [](double t, const Key &key)
+                                     { return t < key.time; }) -
+                    _keys.begin()) -
+                1;
+        const Key &a = _keys[k], &b = _keys[k + 1];
+        double u = (time - a.time) / (b.time - a.time);
+        const Vec3 &before = _keys[std::max(k - 1, 0)].pos;
+        const Vec3 &after = _keys[std::min(k + 2, int(_keys.size()) - 1)].pos;
+        Key key;
+        key.time = time;
+        key.pos = _catmullRom(before, a.pos, b.pos, after, u);
+        key.dir = (1.0 - u) * a.dir.normalized() + u * b.dir.normalized();
+        key.up = (1.0 - u) * a.up.normalized() + u * b.up.normalized();
+        key.hfov = (1.0 - u) * a.hfov + u * b.hfov;
+        return key;
+    }
+};
+
+// Renders frames along a camera path in one process, the scene and its BVHs are built once
+// Frame i + 1 renders while frame i is tonemapped and written on another thread, two frame buffers
+// alternate between the two
+class AnimationRenderer
+{
+    using Vec3 = Eigen::Vector3d;
+
+private:
+    int _width = FILM_WIDTH;
+    int _height = FILM_HEIGHT;
+
+public:
+    AnimationRenderer(){};
+
+public: // parameter setters
+    void setFilm(int width, int height)
+    {
+        _width = width;
+        _height = height;
+    }
+
+public:
+    // nFrames frames spread evenly over the path, frame i is written to outputPattern formatted with i,
+    // e.g. "frame_%04d.ppm", in the format its extension picks
+    // Returns frames per minute
+    double render(Scene &scene, const CameraPath &path, int nFrames, const std::string &outputPattern)
+    {
+        if (path.empty() || nFrames < 1)
+            RAISE_ERROR("Animation needs a camera path and at least one frame");
+        std::size_t pixels = std::size_t(_width) * _height;
+        TrackedVector<Vec3, MemTag::Framebuffer> buffers[2] = {
+            TrackedVector<Vec3, MemTag::Framebuffer>(pixels), TrackedVector<Vec3, MemTag::Framebuffer>(pixels)};
+        std::future<void> writing;
+        auto start = std::chrono::steady_clock::now();
+        for (int f = 0; f < nFrames; f++)
+        {
+            double time = nFrames == 1 ? path.startTime() : path.startTime() + (path.endTime() - path.startTime()) * f / (nFrames - 1);
+            CameraPath::Key key = path.at(time);
+            std::shared_ptr<Camera> camera = makePerspectiveCamera(_width, _height, key.pos, key.dir, key.up, key.hfov, CAMERA_FOCAL_LENGTH);
+            if (!camera)
+                RAISE_ERROR(("Degenerate camera at time " + std::to_string(time)).c_str());
+            scene.setCamera(camera);
+            auto t0 = std::chrono::steady_clock::now();
+            // Frame f - 1 is written from the other buffer meanwhile, frame f - 2's write from this one is done
+            TrackedVector<Vec3, MemTag::Framebuffer> &image = buffers[f % 2];
+            scene.renderTile(0, 0, _width, _height, image.data());
+            auto t1 = std::chrono::steady_clock::now();
+            if (writing.valid())
+                writing.get();
+            char name[1024];
+            snprintf(name, sizeof(name), outputPattern.c_str(), f);
+            writing = std::async(std::launch::async, [this, &image, output = std::string(name)]
+                                 { ImageEncoder(_width, _height, output).write(image.data()); });
+            printf("frame %d/%d t=%.3f rendered in %.2fs\n", f + 1, nFrames, time, std::chrono::duration<double>(t1 - t0).count());
+        }
+        writing.get();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double fpm = nFrames * 60.0 / seconds;
+        printf("%d frames in %.2fs, %.2f frames per minute\n", nFrames, seconds, fpm);
+        return fpm;
+    }
+};
\ No newline at end of file
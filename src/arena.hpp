@@ -0,0 +1,126 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include "config.h"
+#include "memory_tracker.hpp"
+
+// Bump allocator owning everything created in it, freed all at once when the arena goes away
+// Objects come back as non-owning shared_ptrs so they plug into the existing ObjPtr/NodePtr
+// interfaces without a control block or reference counting, they live exactly as long as the arena
+// Allocation is locked, lazily built BVH subtrees may allocate from several threads
+class Arena
+{
+private:
+    struct Block
+    {
+        std::unique_ptr<std::byte[]> data;
+        std::size_t size;
+    };
+    struct Destructor
+    {
+        void *object;
+        void (*destroy)(void *);
+    };
+
+    MemTag _tag;
+    std::vector<Block> _blocks;
+    std::vector<Destructor> _destructors;
+    std::size_t _used = 0; // bytes used in the last block
+    std::size_t _allocated = 0;
+    mutable std::mutex _mutex;
+
+    constexpr static std::size_t FIRST_BLOCK_BYTES = 16 << 10;
+
+private:
+    void *_allocate(std::size_t bytes, std::size_t align)
+    {
+        // Aligned as an address, blocks themselves are only aligned for max_align_t
+        std::size_t offset = 0;
+        if (!_blocks.empty())
+        {
+            uintptr_t base = reinterpret_cast<uintptr_t>(_blocks.back().data.get());
+            offset = ((base + _used + align - 1) & ~uintptr_t(align - 1)) - base;
+        }
+        if (_blocks.empty() || offset + bytes > _blocks.back().size)
+        {
+            // Blocks double up to ARENA_BLOCK_KB so small meshes stay small
+            std::size_t size = _blocks.empty() ? FIRST_BLOCK_BYTES : std::min(2 * _blocks.back().size, std::size_t(ARENA_BLOCK_KB) << 10);
+            size = std::max(size, bytes + align);
+            _blocks.push_back({std::unique_ptr<std::byte[]>(new std::byte[size]), size});
+            MemoryTracker::instance().allocated(_tag, size);
+            uintptr_t base = reinterpret_cast<uintptr_t>(_blocks.back().data.get());
+            offset = ((base + align - 1) & ~uintptr_t(align - 1)) - base;
+        }
+        _used = offset + bytes;
+        _allocated += bytes;
+        return _blocks.back().data.get() + offset;
+    }
+
+public:
+    // Blocks are charged to tag
+    explicit Arena(MemTag tag = MemTag::Geometry) : _tag(tag){};
+    ~Arena()
+    {
+        clear();
+    }
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+public:
+    void *allocate(std::size_t bytes, std::size_t align = alignof(std::max_align_t))
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _allocate(bytes, align);
+    }
+    template <typename T, typename... Args>
+    std::shared_ptr<T> make(Args &&...args)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        T *object = new (_allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if constexpr (!std::is_trivially_destructible_v<T>)
+        {
+            std::size_t capacity = _destructors.capacity();
+            _destructors.push_back({object, [](void *p)
+                                    { static_cast<T *>(p)->~T(); }});
+            if (_destructors.capacity() != capacity)
+                MemoryTracker::instance().allocated(_tag, (_destructors.capacity() - capacity) * sizeof(Destructor));
+        }
+        return std::shared_ptr<T>(std::shared_ptr<T>(), object);
+    }
+    // Destroy every object in reverse creation order and release the memory
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto it = _destructors.rbegin(); it != _destructors.rend(); it++)
+            it->destroy(it->object);
+        MemoryTracker::instance().freed(_tag, _destructors.capacity() * sizeof(Destructor));
+        std::vector<Destructor>().swap(_destructors);
+        for (const Block &block : _blocks)
+            MemoryTracker::instance().freed(_tag, block.size);
+        _blocks.clear();
+        _used = 0;
+        _allocated = 0;
+    }
+
+public:
+    std::size_t allocatedBytes() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _allocated;
+    }
+    // Heap memory held, blocks and the destructor list
+    std::size_t reservedBytes() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::size_t bytes = _destructors.capacity() * sizeof(Destructor);
+        for (const Block &block : _blocks)
+            bytes += block.size;
+        return bytes;
+    }
+};
\ No newline at end of file
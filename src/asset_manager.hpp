@@ -0,0 +1,303 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <functional>
+#include <cstdint>
+#include <future>
+#include <chrono>
+#include <unordered_set>
+#include <thread>
+#include <unistd.h>
+#include "utils.hpp"
+#include "thread_pool.hpp"
+#include "config.h"
+#include "material.hpp"
+#include "texture.hpp"
+#include "mesh.hpp"
+#include "ooc_mesh.hpp"
+#include "mtl_loader.hpp"
+#include "obj_loader.hpp"
+
+// How a mesh asset's BVH is built, meshes loaded with different options are different assets
+struct MeshOptions
+{
+    bool lazyBVH = LAZY_BVH;
+    int bvhWidth = BVH_WIDTH;
+    int bvhQuantBits = BVH_QUANT_BITS;
+    BVHBuilder bvhBuilder = BVHBuilder(BVH_BUILDER);
+    double maxDuplication = SBVH_MAX_DUPLICATION;
+
+    std::string key() const
+    {
+        std::ostringstream ss;
+        ss << lazyBVH << '/' << bvhWidth << '/' << bvhQuantBits << '/' << int(bvhBuilder) << '/' << maxDuplication;
+        return ss.str();
+    }
+};
+
+// Process-wide cache of loaded meshes, materials and textures
+// Assets are found by path first and by a hash of the file content second, so the same file
+// reached through another path or copied elsewhere is still loaded once
+// Handles are immutable and shared, place meshes with Instance and copy materials before editing them
+class AssetManager
+{
+public:
+    using MeshHandle = std::shared_ptr<const Mesh>;
+    using OutOfCoreMeshHandle = std::shared_ptr<const OutOfCoreMesh>;
+    using TextureHandle = std::shared_ptr<const Texture>;
+    using MaterialHandle = std::shared_ptr<const Material>;
+    using MaterialLibrary = std::shared_ptr<const std::vector<MaterialHandle>>;
+
+private:
+    // Entries are futures so a path requested again while loading joins the running job
+    template <typename Handle>
+    struct Table
+    {
+        std::unordered_map<std::string, std::shared_future<Handle>> byPath;
+        std::unordered_map<std::string, std::shared_future<Handle>> byContent;
+    };
+
+    std::mutex _mutex;
+    Table<MeshHandle> _meshes;
+    Table<OutOfCoreMeshHandle> _oocMeshes;
+    Table<TextureHandle> _textures;
+    Table<MaterialLibrary> _materials;
+    int _loads = 0;
+    int _reuses = 0;
+    ThreadPool _pool{ASSET_LOADER_THREADS}; // declared last, joined before the tables go away
+
+private:
+    // The tracker must outlive the assets
+    AssetManager()
+    {
+        MemoryTracker::instance();
+    };
+
+    // 64-bit FNV-1a of the whole file
+    static std::string _contentHash(const std::string &path)
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        if (!ifs.is_open())
+            RAISE_ERROR(("Failed to open asset " + path).c_str());
+        uint64_t hash = 0xcbf29ce484222325ull;
+        char buffer[1 << 16];
+        while (ifs)
+        {
+            ifs.read(buffer, sizeof(buffer));
+            for (std::streamsize i = 0; i < ifs.gcount(); i++)
+                hash = (hash ^ uint8_t(buffer[i])) * 0x100000001b3ull;
+        }
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+        return hex;
+    }
+
+    // The path is claimed before the job is queued, the job then hashes the content and either
+    // joins an earlier load of the same content or loads the asset itself
+    template <typename Handle>
+    std::shared_future<Handle> _getAsync(Table<Handle> &table, const std::string &path, const std::string &options, std::function<Handle()> load)
+    {
+        std::string pathKey = std::filesystem::weakly_canonical(path).string() + '|' + options;
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = table.byPath.find(pathKey);
+        if (it != table.byPath.end())
+        {
+            _reuses++;
+            return it->second;
+        }
+
+        auto promise = std::make_shared<std::promise<Handle>>();
+        std::shared_future<Handle> future = promise->get_future().share();
+        table.byPath[pathKey] = future;
+        _pool.submit([this, &table, path, options, load, promise, future]
+                     {
+                         std::string contentKey = _contentHash(path) + '|' + options;
+                         std::shared_future<Handle> same;
+                         {
+                             std::lock_guard<std::mutex> lock(_mutex);
+                             auto it = table.byContent.find(contentKey);
+                             if (it != table.byContent.end())
+                             {
+                                 same = it->second;
+                                 _reuses++;
+                             }
+                             else
+                                 table.byContent[contentKey] = future;
+                         }
+                         // The other load was queued earlier, so it is already running or done
+                         if (same.valid())
+                         {
+                             promise->set_value(same.get());
+                             return;
+                         }
+                         Handle handle = load();
+                         {
+                             std::lock_guard<std::mutex> lock(_mutex);
+                             _loads++;
+                         }
+                         promise->set_value(handle);
+                     });
+        return future;
+    }
+
+    // Cluster file of an .obj, converted when missing or older than the .obj
+    // Conversion holds the mesh in memory once, the tmp file keeps other processes from reading a partial one
+    static std::string _outOfCoreFile(const std::string &src)
+    {
+        std::string canonical = std::filesystem::weakly_canonical(src).string();
+        char hash[17];
+        snprintf(hash, sizeof(hash), "%016zx", std::hash<std::string>()(canonical));
+        std::string dst = (std::filesystem::path(OOC_CACHE_DIR) / (std::filesystem::path(src).stem().string() + "_" + hash + ".oocm")).string();
+        std::filesystem::create_directories(OOC_CACHE_DIR);
+        if (std::filesystem::exists(dst) && std::filesystem::last_write_time(dst) >= std::filesystem::last_write_time(src))
+            return dst;
+
+        ObjLoader loader;
+        loader.setLazyBVH(true); // clusters get their own BVHs, the whole mesh's is never built
+        std::shared_ptr<Mesh> mesh = loader.load(src);
+        std::string tmp = dst + "." + std::to_string(getpid()) + "." +
+                          std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+        OutOfCoreMesh::write(*mesh, tmp);
+        std::filesystem::rename(tmp, dst);
+        return dst;
+    }
+
+public:
+    static AssetManager &instance()
+    {
+        static AssetManager manager;
+        return manager;
+    }
+
+public:
+    // Loads run on the manager's thread pool, issue every request before waiting on any of them
+    std::shared_future<MeshHandle> meshAsync(const std::string &path, const MeshOptions &options = MeshOptions())
+    {
+        return _getAsync<MeshHandle>(_meshes, path, options.key(), [path, options]
+                                     {
+                                         ObjLoader loader;
+                                         loader.setLazyBVH(options.lazyBVH);
+                                         loader.setBVHWidth(options.bvhWidth);
+                                         loader.setBVHQuantBits(options.bvhQuantBits);
+                                         loader.setBVHBuilder(options.bvhBuilder, options.maxDuplication);
+                                         return MeshHandle(loader.load(path));
+                                     });
+    }
+    // A mesh paged from disk within OOC_GEOMETRY_BUDGET_MB, from an .oocm file or an .obj converted once
+    // under OOC_CACHE_DIR, place it with Instance like other meshes
+    std::shared_future<OutOfCoreMeshHandle> outOfCoreMeshAsync(const std::string &path)
+    {
+        return _getAsync<OutOfCoreMeshHandle>(_oocMeshes, path, "", [path]
+                                              {
+                                                  bool converted = std::filesystem::path(path).extension() == ".oocm";
+                                                  return std::make_shared<const OutOfCoreMesh>(converted ? path : _outOfCoreFile(path));
+                                              });
+    }
+    std::shared_future<TextureHandle> textureAsync(const std::string &path)
+    {
+        return _getAsync<TextureHandle>(_textures, path, "", [path]
+                                        { return std::make_shared<const Texture>(path); });
+    }
+    // All materials of a .mtl file, in file order
+    std::shared_future<MaterialLibrary> materialsAsync(const std::string &path)
+    {
+        return _getAsync<MaterialLibrary>(_materials, path, "", [path]
+                                          {
+                                              MtlLoader loader(path);
+                                              auto library = std::make_shared<std::vector<MaterialHandle>>();
+                                              for (const std::shared_ptr<Material> &mtl : loader.materials())
+                                                  library->push_back(mtl);
+                                              return MaterialLibrary(library);
+                                          });
+    }
+
+    MeshHandle mesh(const std::string &path, const MeshOptions &options = MeshOptions())
+    {
+        return meshAsync(path, options).get();
+    }
+    OutOfCoreMeshHandle outOfCoreMesh(const std::string &path)
+    {
+        return outOfCoreMeshAsync(path).get();
+    }
+    TextureHandle texture(const std::string &path)
+    {
+        return textureAsync(path).get();
+    }
+    MaterialLibrary materials(const std::string &path)
+    {
+        return materialsAsync(path).get();
+    }
+
+    // Footprint of every loaded asset, an asset reached through several paths is listed once
+    void printMemoryReport()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        printf("Asset memory:\n");
+        std::unordered_set<const void *> seen;
+        auto ready = [&seen](const auto &entry, auto &handle)
+        {
+            if (entry.second.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                return false;
+            handle = entry.second.get();
+            return seen.insert(handle.get()).second;
+        };
+        auto name = [](const std::string &key)
+        {
+            return std::filesystem::path(key.substr(0, key.find('|'))).filename().string();
+        };
+        for (const auto &entry : _meshes.byPath)
+        {
+            MeshHandle mesh;
+            if (ready(entry, mesh))
+                printf("  mesh     %-28s %8zu triangles, geometry %8.1f KB, BVH %8.1f KB\n", name(entry.first).c_str(),
+                       mesh->numTriangles(), mesh->geometryMemoryBytes() / 1024.0, mesh->bvhMemoryBytes() / 1024.0);
+        }
+        for (const auto &entry : _oocMeshes.byPath)
+        {
+            OutOfCoreMeshHandle mesh;
+            if (ready(entry, mesh))
+                printf("  ooc mesh %-28s %8zu clusters,  resident %8.1f KB of %8.1f KB\n", name(entry.first).c_str(),
+                       mesh->numClusters(), mesh->stats().residentBytes / 1024.0, mesh->totalBytes() / 1024.0);
+        }
+        for (const auto &entry : _textures.byPath)
+        {
+            TextureHandle texture;
+            if (ready(entry, texture))
+                printf("  texture  %-28s %8d levels,    resident %8.1f KB of %8.1f KB\n", name(entry.first).c_str(),
+                       texture->numLevels(), texture->residentBytes() / 1024.0, texture->sizeBytes() / 1024.0);
+        }
+        for (const auto &entry : _materials.byPath)
+        {
+            MaterialLibrary library;
+            if (ready(entry, library))
+                printf("  material %-28s %8zu materials, %8.1f KB\n", name(entry.first).c_str(),
+                       library->size(), library->size() * sizeof(Material) / 1024.0);
+        }
+    }
+    // Drop the manager's references, assets still held by scenes stay alive
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _meshes = {};
+        _oocMeshes = {};
+        _textures = {};
+        _materials = {};
+    }
+    void printStats()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        printf("Assets: %d loaded, %d reused\n", _loads, _reuses);
+    }
+};
+
+// Editable copy of a shared material
+inline std::shared_ptr<Material> copyMaterial(const AssetManager::MaterialHandle &mtl)
+{
+    return std::make_shared<Material>(*mtl);
+}
\ No newline at end of file
@@ -0,0 +1,445 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <eigen3/Eigen/Core>
+#include "renderable.hpp"
+#include "arena.hpp"
+
+// How BVHNode::build partitions objects
+enum class BVHBuilder
+{
+    Midpoint, // split at the middle of the longest axis
+    SAH,      // binned surface area heuristic over object centroids
+    Spatial   // SAH that may also split straddling objects at a plane(SBVH)
+};
+
+// Nodes are created in an Arena and live as long as it, see build
+class BVHNode
+{
+    using ObjPtr = std::shared_ptr<Renderable>;
+    using NodePtr = std::shared_ptr<BVHNode>;
+    using Vec3 = Eigen::Vector3d;
+
+private:
+    // Children of a lazy node are created on first visit, so they live behind mutable
+    mutable NodePtr _left = nullptr;
+    mutable NodePtr _right = nullptr;
+    AABB _aabb;
+    ObjPtr _obj = nullptr;
+
+    // Lazy construction
+    // Objects of an unbuilt subtree wait in _pending until a ray first reaches the node
+    bool _lazy = false;
+    Arena *_arena = nullptr; // where the children of a lazy node go
+    mutable TrackedVector<ObjPtr, MemTag::BVH> _pending;
+    mutable std::once_flag _expandFlag;
+
+    // SAH construction works on references, with spatial splits one object may have several
+    // references whose boxes only cover part of it
+    struct Ref
+    {
+        ObjPtr obj;
+        AABB aabb;
+    };
+    using RefList = TrackedVector<Ref, MemTag::BVH>;
+    struct SAHBuildState
+    {
+        bool spatial;
+        double minOverlap;     // spatial splits are only tried when children overlap more than this area
+        std::size_t maxRefs;   // cap of references, bounds the memory spent on duplication
+        std::size_t nRefs;
+    };
+    struct SAHSplit
+    {
+        double cost = INF;
+        int axis = -1;
+        int bin = 0;         // object split: first bin of the right child
+        double pos = 0.0;    // spatial split: plane position
+        AABB left, right;
+        std::size_t nLeft = 0, nRight = 0;
+    };
+    constexpr static int OBJECT_BINS = 16;
+    constexpr static int SPATIAL_BINS = 32;
+
+public:
+    BVHNode(){};
+
+private:
+    // Reorder [begin,end) in place into two non-empty halves split at the middle of the longest
+    // axis of aabb, returns the start of the right half
+    template <typename ObjIt>
+    static ObjIt _partition(ObjIt begin, ObjIt end, const AABB &aabb)
+    {
+        int maxDim;
+        aabb.len().maxCoeff(&maxDim);
+        double divisionx2 = aabb.min()[maxDim] + aabb.max()[maxDim];
+
+        ObjIt mid = std::partition(begin, end, [maxDim, divisionx2](const ObjPtr &obj)
+                                   { return obj->aabb().min()[maxDim] + obj->aabb().max()[maxDim] <= divisionx2; });
+        if (mid == begin)
+            mid++;
+        else if (mid == end)
+            mid--;
+        return mid;
+    }
+    template <typename ObjIt>
+    static NodePtr _makeNode(Arena &arena, ObjIt begin, ObjIt end)
+    {
+        NodePtr root = arena.make<BVHNode>();
+        assert(end > begin);
+        if (end - begin == 1)
+        {
+            root->_aabb = (*begin)->aabb();
+            root->_obj = *begin;
+            return root;
+        }
+        root->_aabb.set(Vec3{INF, INF, INF}, Vec3{-INF, -INF, -INF});
+        for (ObjIt it = begin; it != end; it++)
+            root->_aabb.expand((*it)->aabb());
+        return root;
+    }
+    template <typename ObjIt>
+    static NodePtr _buildMidpoint(Arena &arena, ObjIt begin, ObjIt end)
+    {
+        NodePtr root = _makeNode(arena, begin, end);
+        if (root->_obj)
+            return root;
+
+        ObjIt mid = _partition(begin, end, root->_aabb);
+        root->_left = _buildMidpoint(arena, begin, mid);
+        root->_right = _buildMidpoint(arena, mid, end);
+        return root;
+    }
+    static int _objectBin(const Ref &ref, const AABB &centroidBounds, int axis)
+    {
+        double extent = centroidBounds.len()[axis];
+        int bin = OBJECT_BINS * (ref.aabb.centroid()[axis] - centroidBounds.min()[axis]) / extent;
+        return std::clamp(bin, 0, OBJECT_BINS - 1);
+    }
+    static SAHSplit _findObjectSplit(const RefList &refs, const AABB &centroidBounds)
+    {
+        SAHSplit best;
+        for (int axis : {0, 1, 2})
+        {
+            if (centroidBounds.len()[axis] <= 0.0)
+                continue;
+            AABB bins[OBJECT_BINS];
+            std::size_t counts[OBJECT_BINS] = {0};
+            for (const Ref &ref : refs)
+            {
+                int b = _objectBin(ref, centroidBounds, axis);
+                bins[b].expand(ref.aabb);
+                counts[b]++;
+            }
+            // Sweep from the right to get the cost of every right child, then from the left
+            AABB rightBounds[OBJECT_BINS];
+            std::size_t rightCounts[OBJECT_BINS];
+            AABB acc;
+            std::size_t n = 0;
+            for (int b = OBJECT_BINS - 1; b > 0; b--)
+            {
+                acc.expand(bins[b]);
+                n += counts[b];
+                rightBounds[b] = acc;
+                rightCounts[b] = n;
+            }
+            acc = AABB();
+            n = 0;
+            for (int b = 1; b < OBJECT_BINS; b++)
+            {
+                acc.expand(bins[b - 1]);
+                n += counts[b - 1];
+                if (n == 0 || rightCounts[b] == 0)
+                    continue;
+                double cost = acc.halfArea() * n + rightBounds[b].halfArea() * rightCounts[b];
+                if (cost < best.cost)
+                {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.bin = b;
+                    best.left = acc;
+                    best.right = rightBounds[b];
+                    best.nLeft = n;
+                    best.nRight = rightCounts[b];
+                }
+            }
+        }
+        return best;
+    }
+    static SAHSplit _findSpatialSplit(const RefList &refs, const AABB &bounds)
+    {
+        SAHSplit best;
+        for (int axis : {0, 1, 2})
+        {
+            double lo = bounds.min()[axis], binWidth = bounds.len()[axis] / SPATIAL_BINS;
+            if (binWidth <= 0.0)
+                continue;
+            auto binOf = [&](double x)
+            { return std::clamp(int((x - lo) / binWidth), 0, SPATIAL_BINS - 1); };
+
+            // Every reference is clipped into each bin it spans, entering at its first bin and exiting at its last
+            AABB bins[SPATIAL_BINS];
+            std::size_t entry[SPATIAL_BINS] = {0}, exit[SPATIAL_BINS] = {0};
+            for (const Ref &ref : refs)
+            {
+                int first = binOf(ref.aabb.min()[axis]), last = binOf(ref.aabb.max()[axis]);
+                for (int b = first; b <= last; b++)
+                {
+                    double planeLo = lo + b * binWidth;
+                    double planeHi = b == SPATIAL_BINS - 1 ? bounds.max()[axis] : planeLo + binWidth;
+                    AABB part = ref.obj->clippedAABB(axis, planeLo, planeHi).intersection(ref.aabb);
+                    if (!part.empty())
+                        bins[b].expand(part);
+                }
+                entry[first]++;
+                exit[last]++;
+            }
+
+            AABB rightBounds[SPATIAL_BINS];
+            std::size_t rightCounts[SPATIAL_BINS];
+            AABB acc;
+            std::size_t n = 0;
+            for (int b = SPATIAL_BINS - 1; b > 0; b--)
+            {
+                acc.expand(bins[b]);
+                n += exit[b];
+                rightBounds[b] = acc;
+                rightCounts[b] = n;
+            }
+            acc = AABB();
+            n = 0;
+            for (int b = 1; b < SPATIAL_BINS; b++)
+            {
+                acc.expand(bins[b - 1]);
+                n += entry[b - 1];
+                if (n == 0 || rightCounts[b] == 0)
+                    continue;
+                double cost = acc.halfArea() * n + rightBounds[b].halfArea() * rightCounts[b];
+                if (cost < best.cost)
+                {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.pos = lo + b * binWidth;
+                    best.left = acc;
+                    best.right = rightBounds[b];
+                    best.nLeft = n;
+                    best.nRight = rightCounts[b];
+                }
+            }
+        }
+        return best;
+    }
+    // Distribute refs at a spatial split plane, straddling refs are either clipped into both
+    // children or kept whole on one side, whichever is cheaper against the child bounds of the split
+    // (reference unsplitting)
+    static void _spatialPartition(const RefList &refs, const SAHSplit &split, SAHBuildState &state,
+                                  RefList &leftRefs, RefList &rightRefs)
+    {
+        int axis = split.axis;
+        AABB leftBounds = split.left, rightBounds = split.right;
+        std::size_t nL = split.nLeft, nR = split.nRight;
+        for (const Ref &ref : refs)
+        {
+            if (ref.aabb.max()[axis] <= split.pos)
+            {
+                leftRefs.push_back(ref);
+                continue;
+            }
+            if (ref.aabb.min()[axis] >= split.pos)
+            {
+                rightRefs.push_back(ref);
+                continue;
+            }
+            AABB leftPart = ref.obj->clippedAABB(axis, -INF, split.pos).intersection(ref.aabb);
+            AABB rightPart = ref.obj->clippedAABB(axis, split.pos, INF).intersection(ref.aabb);
+            AABB wholeL = leftBounds, wholeR = rightBounds;
+            wholeL.expand(ref.aabb);
+            wholeR.expand(ref.aabb);
+            double costSplit = leftBounds.halfArea() * nL + rightBounds.halfArea() * nR;
+            double costLeft = wholeL.halfArea() * nL + rightBounds.halfArea() * (nR - 1);
+            double costRight = leftBounds.halfArea() * (nL - 1) + wholeR.halfArea() * nR;
+
+            bool canSplit = state.nRefs < state.maxRefs && !leftPart.empty() && !rightPart.empty();
+            if (canSplit && costSplit < costLeft && costSplit < costRight)
+            {
+                leftRefs.push_back({ref.obj, leftPart});
+                rightRefs.push_back({ref.obj, rightPart});
+                state.nRefs++;
+            }
+            else if (costLeft <= costRight)
+            {
+                leftRefs.push_back(ref);
+                leftBounds = wholeL;
+                nR--;
+            }
+            else
+            {
+                rightRefs.push_back(ref);
+                rightBounds = wholeR;
+                nL--;
+            }
+        }
+    }
+    static NodePtr _buildSAH(Arena &arena, RefList refs, SAHBuildState &state)
+    {
+        NodePtr root = arena.make<BVHNode>();
+        assert(refs.size() > 0);
+        if (refs.size() == 1)
+        {
+            root->_aabb = refs[0].aabb;
+            root->_obj = refs[0].obj;
+            return root;
+        }
+        AABB centroidBounds;
+        for (const Ref &ref : refs)
+        {
+            root->_aabb.expand(ref.aabb);
+            centroidBounds.expand(ref.aabb.centroid());
+        }
+
+        RefList leftRefs, rightRefs;
+        SAHSplit objectSplit = _findObjectSplit(refs, centroidBounds);
+        bool spatial = false;
+        if (state.spatial && state.nRefs < state.maxRefs &&
+            (objectSplit.axis < 0 || objectSplit.left.intersection(objectSplit.right).halfArea() > state.minOverlap))
+        {
+            SAHSplit spatialSplit = _findSpatialSplit(refs, root->_aabb);
+            if (spatialSplit.cost < objectSplit.cost)
+            {
+                _spatialPartition(refs, spatialSplit, state, leftRefs, rightRefs);
+                // Unsplitting may leave a side with everything, then fall back to the object split
+                spatial = !leftRefs.empty() && !rightRefs.empty() && leftRefs.size() < refs.size() && rightRefs.size() < refs.size();
+                if (!spatial)
+                {
+                    state.nRefs -= leftRefs.size() + rightRefs.size() - refs.size();
+                    leftRefs.clear();
+                    rightRefs.clear();
+                }
+            }
+        }
+        if (!spatial)
+        {
+            if (objectSplit.axis >= 0)
+            {
+                for (Ref &ref : refs)
+                    (_objectBin(ref, centroidBounds, objectSplit.axis) < objectSplit.bin ? leftRefs : rightRefs).push_back(std::move(ref));
+            }
+            else // All centroids coincide, split in half
+            {
+                std::size_t half = refs.size() / 2;
+                leftRefs.assign(refs.begin(), refs.begin() + half);
+                rightRefs.assign(refs.begin() + half, refs.end());
+            }
+        }
+        RefList().swap(refs);
+        root->_left = _buildSAH(arena, std::move(leftRefs), state);
+        root->_right = _buildSAH(arena, std::move(rightRefs), state);
+        return root;
+    }
+
+    // Build the two children of a lazy node, may be called concurrently only through _expandFlag
+    void _expand() const
+    {
+        auto mid = _partition(_pending.begin(), _pending.end(), _aabb);
+        std::vector<ObjPtr> leftObj(std::make_move_iterator(_pending.begin()), std::make_move_iterator(mid));
+        std::vector<ObjPtr> rightObj(std::make_move_iterator(mid), std::make_move_iterator(_pending.end()));
+        TrackedVector<ObjPtr, MemTag::BVH>().swap(_pending);
+        _right = buildLazy(*_arena, std::move(rightObj));
+        _left = buildLazy(*_arena, std::move(leftObj));
+    }
+
+    inline void _ensureExpanded() const
+    {
+        if (_lazy)
+            std::call_once(_expandFlag, &BVHNode::_expand, this);
+    }
+
+public:
+    Intersection intersect(const Ray &ray) const
+    {
+        if (!_aabb.intersect(ray))
+            return Intersection();
+        _ensureExpanded();
+        if (!_left)
+            return _obj->intersect(ray);
+        Intersection i1 = _left->intersect(ray);
+        Intersection i2 = _right->intersect(ray);
+        return i1.t < i2.t ? i1 : i2;
+    }
+
+public:
+    // Nodes are allocated in arena and only valid while it is alive
+    // maxDuplication caps the extra references created by spatial splits, relative to the object count
+    static NodePtr build(Arena &arena, std::vector<ObjPtr> objs, BVHBuilder builder, double maxDuplication = 0.3)
+    {
+        if (builder == BVHBuilder::Midpoint)
+            return build(arena, std::move(objs));
+
+        assert(objs.size() > 0);
+        RefList refs;
+        refs.reserve(objs.size());
+        AABB bounds;
+        for (const ObjPtr &obj : objs)
+        {
+            refs.push_back({obj, obj->aabb()});
+            bounds.expand(obj->aabb());
+        }
+        SAHBuildState state;
+        state.spatial = builder == BVHBuilder::Spatial;
+        state.minOverlap = 1e-5 * bounds.halfArea();
+        state.nRefs = refs.size();
+        state.maxRefs = refs.size() * (1.0 + maxDuplication);
+        return _buildSAH(arena, std::move(refs), state);
+    }
+    // Midpoint splits partition objs in place, no level copies the object list
+    static NodePtr build(Arena &arena, std::vector<ObjPtr> objs)
+    {
+        assert(objs.size() > 0);
+        return _buildMidpoint(arena, objs.begin(), objs.end());
+    }
+    // Only compute the bounding box of the root, subtrees are built when a ray first reaches them.
+    // Untouched geometry never pays for a build, and traversal stays thread-safe.
+    // Lazy subtrees always use midpoint splits.
+    static NodePtr buildLazy(Arena &arena, std::vector<ObjPtr> objs)
+    {
+        NodePtr root = _makeNode(arena, objs.begin(), objs.end());
+        if (root->_obj)
+            return root;
+
+        root->_lazy = true;
+        root->_arena = &arena;
+        root->_pending.assign(std::make_move_iterator(objs.begin()), std::make_move_iterator(objs.end()));
+        return root;
+    }
+
+public:
+    inline const AABB &aabb() const
+    {
+        return _aabb;
+    }
+    // Children are null for leaf nodes, accessing them expands a lazy node
+    inline const NodePtr &left() const
+    {
+        _ensureExpanded();
+        return _left;
+    }
+    inline const NodePtr &right() const
+    {
+        _ensureExpanded();
+        return _right;
+    }
+    inline const ObjPtr &obj() const
+    {
+        return _obj;
+    }
+    // Memory of the built part of the subtree
+    std::size_t memoryBytes() const
+    {
+        std::size_t bytes = sizeof(BVHNode) + _pending.capacity() * sizeof(ObjPtr);
+        if (_left)
+            bytes += _left->memoryBytes() + _right->memoryBytes();
+        return bytes;
+    }
+};
\ No newline at end of file
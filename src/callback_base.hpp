@@ -2,6 +2,7 @@
 #include "ray.hpp"
 #include "intersection.hpp"
 #include "light.hpp"
+#include "material_table.hpp"
 
 class SceneBase
 {
@@ -9,5 +10,10 @@ class SceneBase
 
 public:
     virtual Intersection intersect(const Ray &ray) const = 0;
+    // Rays towards a light, only what they hit first is used
+    virtual Intersection intersectShadow(const Ray &ray) const { return intersect(ray); }
     virtual const std::vector<LightPtr> &lights() const = 0;
+    virtual const MaterialTable &materials() const = 0;
+    // Called before the shader traces the rays of a sample, sample as in Shader::shadeBatch
+    virtual void enterSample(uint64_t sample) const {}
 };
\ No newline at end of file
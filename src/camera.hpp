@@ -1,6 +1,7 @@
 #pragma once
 #include <eigen3/Eigen/Core>
 #include <eigen3/Eigen/Dense>
+#include <memory>
 #include "ray.hpp"
 #include "utils.hpp"
 
@@ -53,6 +54,13 @@ public:
 
 public:
     virtual Ray rayThroughFilm(double row, double col) = 0;
+    // Ray through the film carrying the rays of the neighbouring pixels as differentials
+    Ray rayWithDifferentials(double row, double col)
+    {
+        Ray ray = rayThroughFilm(row, col);
+        ray.setDifferentials(rayThroughFilm(row, col + 1.0), rayThroughFilm(row + 1.0, col));
+        return ray;
+    }
 
     // parameter setters
 public:
@@ -98,6 +106,10 @@ public:
     }
 
     // parameter getters
+    inline const Vec3 &position() const
+    {
+        return _pos;
+    }
     inline int nHorzPix() const
     {
         return _nHrozPix;
@@ -140,4 +152,25 @@ public:
         Vec3 pixCenter = _firstPixelCenter + col * _wPix * _rightHand - row * _hPix * _up;
         return Ray(pixCenter - _focal * _lookAt, _lookAt);
     }
-};
\ No newline at end of file
+};
+
+// Perspective camera at pos looking along dir with a width x height film, up is made perpendicular to dir
+// Returns nullptr if dir is zero or parallel to up
+inline std::shared_ptr<Camera> makePerspectiveCamera(int width, int height, const Eigen::Vector3d &pos, Eigen::Vector3d dir,
+                                                     Eigen::Vector3d up, double hfov, double focal = 1.0)
+{
+    if (dir.norm() < EPS)
+        return nullptr;
+    dir.normalize();
+    up -= dir * up.dot(dir);
+    if (up.norm() < EPS)
+        return nullptr;
+    std::shared_ptr<Camera> camera = std::make_shared<PerspectiveCamera>();
+    camera->setFilm(width, height);
+    camera->setFocal(focal);
+    camera->setPosition(pos);
+    camera->setPose(up, dir);
+    camera->setHFOV(hfov);
+    camera->setAspectRatio(double(width) / height);
+    return camera;
+}
\ No newline at end of file
@@ -0,0 +1,92 @@
+#pragma once
+#include <string>
+#include <fstream>
+#include <filesystem>
+#include <cstdint>
+#include <eigen3/Eigen/Core>
+#include "utils.hpp"
+#include "config.h"
+#include "denoiser.hpp"
+
+// Progress of a render on disk, so a killed job continues where it stopped
+// Rows finish in order, so only the finished rows are stored: their pixel colors and sample counts
+// The random numbers of a sample derive from the seed and the sample's index alone, see RandomSequence,
+// so the seed is all the generator state there is and the resumed render draws the same numbers
+class RenderCheckpoint
+{
+    using Vec3 = Eigen::Vector3d;
+
+public:
+    int width = 0;
+    int height = 0;
+    int spp = 0;
+    uint64_t seed = 0;
+    int rowsDone = 0;
+
+public:
+    // rowsDone rows of colors, counts and AOVs if there are any, written to a temporary file first
+    // and renamed over path so a kill while saving leaves the previous checkpoint intact
+    void save(const std::string &path, const Vec3 *colors, const uint16_t *counts, const AOVBuffers *aovs = nullptr) const
+    {
+        std::string tmp = path + ".tmp";
+        std::ofstream ofs(tmp, std::ios::binary);
+        if (!ofs.is_open())
+            RAISE_ERROR(("Failed to create checkpoint file " + tmp).c_str());
+        uint32_t header[2] = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION};
+        int32_t dims[5] = {width, height, spp, rowsDone, aovs != nullptr};
+        ofs.write((const char *)header, sizeof(header));
+        ofs.write((const char *)dims, sizeof(dims));
+        ofs.write((const char *)&seed, sizeof(seed));
+        std::size_t pixels = std::size_t(rowsDone) * width;
+        ofs.write((const char *)counts, pixels * sizeof(uint16_t));
+        ofs.write((const char *)colors, pixels * sizeof(Vec3));
+        if (aovs)
+        {
+            ofs.write((const char *)aovs->albedo.data(), pixels * sizeof(Vec3));
+            ofs.write((const char *)aovs->normal.data(), pixels * sizeof(Vec3));
+            ofs.write((const char *)aovs->depth.data(), pixels * sizeof(double));
+            ofs.write((const char *)aovs->moment1.data(), pixels * sizeof(double));
+            ofs.write((const char *)aovs->moment2.data(), pixels * sizeof(double));
+        }
+        ofs.close();
+        if (!ofs)
+            RAISE_ERROR(("Failed to write checkpoint file " + tmp).c_str());
+        std::filesystem::rename(tmp, path);
+    }
+
+    // Checks the file against width, height, spp and RENDER_SEED, then reads the finished rows into
+    // colors, counts and aovs, which hold width * height pixels
+    // Returns false if there is no checkpoint at path
+    bool load(const std::string &path, Vec3 *colors, uint16_t *counts, AOVBuffers *aovs = nullptr)
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        if (!ifs.is_open())
+            return false;
+        uint32_t header[2];
+        int32_t dims[5];
+        ifs.read((char *)header, sizeof(header));
+        ifs.read((char *)dims, sizeof(dims));
+        ifs.read((char *)&seed, sizeof(seed));
+        if (!ifs || header[0] != CHECKPOINT_MAGIC || header[1] != CHECKPOINT_VERSION)
+            RAISE_ERROR(("Invalid checkpoint file " + path).c_str());
+        if (dims[0] != width || dims[1] != height || dims[2] != spp || seed != RENDER_SEED)
+            RAISE_ERROR(("Checkpoint " + path + " was made with a different resolution, sample count or seed").c_str());
+        if (bool(dims[4]) != (aovs != nullptr))
+            RAISE_ERROR(("Checkpoint " + path + (dims[4] ? " has AOVs, enable them to resume" : " has no AOVs, disable them to resume")).c_str());
+        rowsDone = std::clamp(dims[3], 0, height);
+        std::size_t pixels = std::size_t(rowsDone) * width;
+        ifs.read((char *)counts, pixels * sizeof(uint16_t));
+        ifs.read((char *)colors, pixels * sizeof(Vec3));
+        if (aovs)
+        {
+            ifs.read((char *)aovs->albedo.data(), pixels * sizeof(Vec3));
+            ifs.read((char *)aovs->normal.data(), pixels * sizeof(Vec3));
+            ifs.read((char *)aovs->depth.data(), pixels * sizeof(double));
+            ifs.read((char *)aovs->moment1.data(), pixels * sizeof(double));
+            ifs.read((char *)aovs->moment2.data(), pixels * sizeof(double));
+        }
+        if (!ifs)
+            RAISE_ERROR(("Truncated checkpoint file " + path).c_str());
+        return true;
+    }
+};
\ No newline at end of file
@@ -0,0 +1,221 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include "wide_bvh.hpp"
+
+// A wide BVH node with child bounds quantized relative to the node's own frame
+// Bounds decode as origin + q * 2^exponent, inner children and leaf primitives are stored
+// consecutively so a single base index replaces the per-child indices
+template <int N, typename Q>
+struct CompressedWideBVHNode
+{
+    float origin[3];
+    int nodeBase;       // index of the first inner child
+    int primBase;       // index of the first primitive of the first leaf child
+    int8_t exponent[3]; // per-axis quantization step 2^exponent
+    uint8_t meta[N];    // 0: empty slot, 0x80: inner child, otherwise number of primitives in leaf
+    Q qBounds[6][N];    // minX, maxX, minY, maxY, minZ, maxZ of each child
+};
+
+// Compressed layout of WideBVH<N>, Q is uint8_t or uint16_t
+// Decoding is conservative, a decoded box always contains the exact one, so only
+// traversal efficiency and never correctness depends on the quantization
+template <int N, typename Q = uint8_t>
+class CompressedWideBVH
+{
+    using ObjPtr = std::shared_ptr<Renderable>;
+    using Node = CompressedWideBVHNode<N, Q>;
+    using DecodedNode = WideBVHNode<N>;
+
+private:
+    TrackedVector<Node, MemTag::BVH> _nodes;   // breadth-first, _nodes[0] is the root
+    TrackedVector<ObjPtr, MemTag::BVH> _prims; // primitives in leaf order
+    int _stackSize = 1;
+    bool _useAVX = false;
+
+    constexpr static int QMAX = std::numeric_limits<Q>::max();
+
+private:
+    // 2^e built from the exponent bits, e is kept in the normal float range
+    static inline float _scale(int e)
+    {
+        uint32_t bits = uint32_t(e + 127) << 23;
+        float scale;
+        std::memcpy(&scale, &bits, sizeof(float));
+        return scale;
+    }
+    static inline float _decode(float origin, Q q, float scale)
+    {
+        return origin + float(q) * scale;
+    }
+    // Quantize [lo,hi] outwards so the decoded interval still contains it
+    static void _quantize(float lo, float hi, float origin, float scale, Q &qLo, Q &qHi)
+    {
+        int a = std::clamp<int>(std::floor((lo - origin) / scale), 0, QMAX);
+        int b = std::clamp<int>(std::ceil((hi - origin) / scale), 0, QMAX);
+        while (a > 0 && _decode(origin, a, scale) > lo)
+            a--;
+        while (b < QMAX && _decode(origin, b, scale) < hi)
+            b++;
+        qLo = a;
+        qHi = b;
+    }
+    void _compress(const WideBVH<N> &src)
+    {
+        const auto &srcNodes = src.nodes();
+        const auto &srcPrims = src.prims();
+
+        // (source index, destination index) in breadth-first order
+        std::vector<std::pair<int, int>> todo = {{0, 0}};
+        _nodes.resize(1);
+        for (std::size_t q = 0; q < todo.size(); q++)
+        {
+            const DecodedNode &s = srcNodes[todo[q].first];
+            Node node;
+            std::memset(&node, 0, sizeof(Node));
+
+            // The node frame spans all its children
+            constexpr float inf = std::numeric_limits<float>::infinity();
+            float lo[3] = {inf, inf, inf}, hi[3] = {-inf, -inf, -inf};
+            for (int i = 0; i < N; i++)
+                if (s.count[i] >= 0)
+                    for (int k = 0; k < 3; k++)
+                    {
+                        lo[k] = std::min(lo[k], s.bounds[2 * k][i]);
+                        hi[k] = std::max(hi[k], s.bounds[2 * k + 1][i]);
+                    }
+            float scale[3];
+            for (int k = 0; k < 3; k++)
+            {
+                double extent = double(hi[k]) - lo[k];
+                int e = extent > 0.0 ? std::clamp<int>(std::ceil(std::log2(extent / QMAX)), -126, 127) : -126;
+                // The top of the frame must stay representable after rounding
+                while (e < 127 && _decode(lo[k], QMAX, _scale(e)) < hi[k])
+                    e++;
+                node.origin[k] = lo[k];
+                node.exponent[k] = e;
+                scale[k] = _scale(e);
+            }
+
+            node.nodeBase = _nodes.size();
+            node.primBase = _prims.size();
+            for (int i = 0; i < N; i++)
+            {
+                if (s.count[i] < 0)
+                {
+                    node.meta[i] = 0;
+                    for (int k = 0; k < 3; k++)
+                    {
+                        node.qBounds[2 * k][i] = QMAX;
+                        node.qBounds[2 * k + 1][i] = 0;
+                    }
+                    continue;
+                }
+                if (s.count[i] == 0)
+                {
+                    node.meta[i] = 0x80;
+                    todo.push_back({s.child[i], int(_nodes.size())});
+                    _nodes.emplace_back();
+                }
+                else
+                {
+                    if (s.count[i] >= 0x80)
+                        RAISE_ERROR("Too many primitives in a compressed BVH leaf");
+                    node.meta[i] = s.count[i];
+                    for (int k = s.child[i]; k < s.child[i] + s.count[i]; k++)
+                        _prims.push_back(srcPrims[k]);
+                }
+                for (int k = 0; k < 3; k++)
+                    _quantize(s.bounds[2 * k][i], s.bounds[2 * k + 1][i], node.origin[k], scale[k],
+                              node.qBounds[2 * k][i], node.qBounds[2 * k + 1][i]);
+            }
+            _nodes[todo[q].second] = node;
+        }
+    }
+
+    inline const DecodedNode &_fetch(int index, DecodedNode &scratch) const
+    {
+        const Node &node = _nodes[index];
+        for (int k = 0; k < 3; k++)
+        {
+            float origin = node.origin[k], scale = _scale(node.exponent[k]);
+            for (int i = 0; i < N; i++)
+            {
+                scratch.bounds[2 * k][i] = _decode(origin, node.qBounds[2 * k][i], scale);
+                scratch.bounds[2 * k + 1][i] = _decode(origin, node.qBounds[2 * k + 1][i], scale);
+            }
+        }
+        int inner = node.nodeBase, prim = node.primBase;
+        for (int i = 0; i < N; i++)
+        {
+            if (node.meta[i] == 0)
+                scratch.count[i] = -1;
+            else if (node.meta[i] == 0x80)
+            {
+                scratch.child[i] = inner++;
+                scratch.count[i] = 0;
+            }
+            else
+            {
+                scratch.child[i] = prim;
+                scratch.count[i] = node.meta[i];
+                prim += node.meta[i];
+            }
+        }
+        return scratch;
+    }
+
+public:
+    CompressedWideBVH(){};
+
+public:
+    static std::shared_ptr<CompressedWideBVH> build(std::vector<ObjPtr> objs, BVHBuilder builder = BVHBuilder::Midpoint, double maxDuplication = 0.3)
+    {
+        static_assert(std::is_same_v<Q, uint8_t> || std::is_same_v<Q, uint16_t>, "Only 8-bit and 16-bit quantization are supported");
+        std::shared_ptr<WideBVH<N>> wide = WideBVH<N>::build(std::move(objs), builder, maxDuplication);
+        std::shared_ptr<CompressedWideBVH> ret = std::make_shared<CompressedWideBVH>();
+        ret->_useAVX = cpuHasAVX();
+        ret->_stackSize = wide->stackSize();
+        ret->_compress(*wide);
+        ret->_nodes.shrink_to_fit();
+        ret->_prims.shrink_to_fit();
+        return ret;
+    }
+
+    Intersection intersect(const Ray &ray) const
+    {
+        return wideBVHIntersect<N>(ray, _prims, _stackSize, _useAVX,
+                                   [this](int index, DecodedNode &scratch) -> const DecodedNode & { return _fetch(index, scratch); });
+    }
+
+    // Traverse with a caller supplied leaf kernel, see wideBVHTraverse
+    template <typename Leaf>
+    void traverse(const Ray &ray, double &tMax, Leaf leaf) const
+    {
+        wideBVHTraverse<N>(ray, _stackSize, _useAVX, tMax,
+                           [this](int index, DecodedNode &scratch) -> const DecodedNode & { return _fetch(index, scratch); }, leaf);
+    }
+
+public:
+    inline std::size_t numNodes() const
+    {
+        return _nodes.size();
+    }
+    inline const TrackedVector<ObjPtr, MemTag::BVH> &prims() const
+    {
+        return _prims;
+    }
+    inline std::size_t nodeBytes() const
+    {
+        return _nodes.size() * sizeof(Node);
+    }
+    inline std::size_t memoryBytes() const
+    {
+        return nodeBytes() + _prims.size() * sizeof(ObjPtr);
+    }
+};
\ No newline at end of file
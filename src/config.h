@@ -1,5 +1,6 @@
 #pragma once
 #include <eigen3/Eigen/Core>
+#include <cstdint>
 
 #define MULTI_THREAD
 #define NUM_THREADS 16
@@ -23,7 +24,105 @@ const int FILM_WIDTH = 2048;
 const double CAMERA_FOCAL_LENGTH = 1.0f;
 const double CAMERA_HFOV = 60.0f;
 const double CAMERA_ASPECT_RATIO = (double)FILM_WIDTH / FILM_HEIGHT;
+// Rendered image, the extension picks the format: .ppm or .png(8-bit), .pfm or .exr(float)
+const char *const OUTPUT_FILE = "../imout.ppm";
+// Write finished bands of rows to OUTPUT_FILE while rendering instead of keeping the full frame,
+// for resolutions whose framebuffer would not fit in memory(PPM, PFM and EXR only)
+const bool STREAM_OUTPUT = false;
+const int STREAM_BAND_ROWS = 16;
+// Finished rows are saved here periodically, run with --resume to continue a killed render
+const char *const CHECKPOINT_FILE = "../cache/render.ckpt";
+const double CHECKPOINT_INTERVAL_SECONDS = 60.0;
+const uint32_t CHECKPOINT_MAGIC = 0x54504b43; // "CKPT"
+const uint32_t CHECKPOINT_VERSION = 3;
+
+// Render albedo, normal and depth of the first hits and filter the image guided by them
+const bool DENOISE = false;
+// A-trous passes, the filter reaches 2^(DENOISE_ITERATIONS+1) pixels out
+const int DENOISE_ITERATIONS = 4;
+
+// Square tiles the coordinator hands to worker processes with --workers N
+const int DISTRIBUTED_TILE_SIZE = 64;
+// Workers restarted after dying, per coordinator, before their tiles go to the remaining ones
+const int DISTRIBUTED_MAX_RESTARTS = 4;
+// Seconds a worker may spend on one tile, after its scene is set up, before it counts as failed
+const double DISTRIBUTED_TILE_TIMEOUT = 120.0;
+// Unix domain socket the render server started with --serve listens on
+const char *const SERVER_SOCKET = "../cache/render.sock";
+// Longest request line a server client may send, longer ones close its connection
+const int SERVER_MAX_LINE = 4096;
+// Largest film a server job may use and the most samples(cropped pixels times spp) it may trace
+const int64_t SERVER_MAX_PIXELS = int64_t(16384) * 16384;
+const int64_t SERVER_MAX_SAMPLES = int64_t(1) << 30;
+// Second image of --relight, shaded from the cached primary hits with every light at half intensity
+const char *const RELIGHT_OUTPUT = "../imout_relit.ppm";
+// Second image of --edit, the tiles the moved sphere changed rendered again
+const char *const EDIT_OUTPUT = "../imout_edited.ppm";
+// Edge length of the screen tiles Scene::objectChanged marks for rendering again
+const int DIRTY_TILE_SIZE = 32;
+// Cells per axis of the grid over the scene the rays of each tile are recorded in
+const int DIRTY_GRID_RESOLUTION = 32;
+// Cells per axis of the coarser grid shadow rays are recorded in, they outnumber the other rays by the number of lights
+const int DIRTY_SHADOW_GRID_RESOLUTION = 16;
+// Images of --preview, the first pass renders PREVIEW_FIRST_WIDTH pixels wide whatever the film,
+// every following pass doubles the width up to the film's
+const char *const PREVIEW_OUTPUT = "../imout_preview.ppm";
+const int PREVIEW_FIRST_WIDTH = 128;
+// Frames rendered with --animate, written to ANIMATION_OUTPUT formatted with the frame number
+const int ANIMATION_FRAMES = 24;
+const char *const ANIMATION_OUTPUT = "../anim/frame_%04d.ppm";
 
 int MULTI_SHADOW_RAY = 1;
 
-const int MAX_BOUNCE = 10;
\ No newline at end of file
+const int MAX_BOUNCE = 10;
+
+// Every random number of a render derives from this, the same seed gives the same image
+const uint64_t RENDER_SEED = 2023;
+
+// Primary hits shaded together by the SIMD Phong kernel
+const int SHADE_BATCH_SIZE = 64;
+
+// Build BVHs only when a ray first reaches them, subtree by subtree for the binary BVH,
+// whole meshes for wide BVHs
+const bool LAZY_BVH = true;
+// 2 for the binary BVH, 4 or 8 for a collapsed wide BVH with SIMD node tests
+const int BVH_WIDTH = 8;
+// 0 keeps float child bounds, 8 or 16 quantizes them relative to each node to save memory bandwidth
+const int BVH_QUANT_BITS = 0;
+// 0: midpoint split, 1: binned SAH, 2: SAH with spatial splits(SBVH) for meshes with large overlapping triangles
+const int BVH_BUILDER = 1;
+// Extra references spatial splits may create, relative to the triangle count
+const double SBVH_MAX_DUPLICATION = 0.3;
+
+// Samples per pixel along each film axis, textures are filtered by ray differentials
+// so this only needs to cover geometric edges
+const int PIXEL_SAMPLES_SQRT = 2;
+// Probes along the major axis of a stretched texture footprint, 1 for plain trilinear filtering
+const int TEXTURE_MAX_ANISOTROPY = 8;
+// Edge length of the square texel tiles textures are stored in
+const int TEXTURE_TILE = 8;
+// Edge length of the square pages textures are loaded from disk in, a multiple of TEXTURE_TILE
+const int TEXTURE_PAGE = 32;
+// Memory the texture cache may hold in pages before evicting
+const int TEXTURE_CACHE_BUDGET_MB = 256;
+// Textures are converted to the tiled format here once
+const char *const TEXTURE_CACHE_DIR = "../cache/textures";
+const uint32_t TEXTURE_FILE_MAGIC = 0x58545253; // "SRTX"
+const uint32_t TEXTURE_FILE_VERSION = 1;
+
+// Largest block arenas grab from the heap, geometry and BVH nodes are bump-allocated inside them
+const int ARENA_BLOCK_KB = 1024;
+
+// Threads loading assets in the background, 0 for one per hardware thread
+const int ASSET_LOADER_THREADS = 0;
+
+// Out-of-core meshes are paged in clusters of at most this many triangles
+const int OOC_CLUSTER_TRIANGLES = 4096;
+// Memory resident clusters of an out-of-core mesh may hold before evicting
+const int OOC_GEOMETRY_BUDGET_MB = 512;
+// Meshes loaded out-of-core are converted to the cluster format here once
+const char *const OOC_CACHE_DIR = "../cache/meshes";
+// Load the test scenes' meshes out-of-core, for meshes whose triangles would not fit in memory
+const bool OUT_OF_CORE_MESHES = false;
+const uint32_t OOC_MESH_MAGIC = 0x4d434f4f; // "OOCM"
+const uint32_t OOC_MESH_VERSION = 1;
@@ -0,0 +1,182 @@
+#pragma once
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <eigen3/Eigen/Core>
+#include "config.h"
+#include "memory_tracker.hpp"
+#include <omp.h>
+
+// First-hit guide buffers rendered next to the color, averaged over each pixel's samples
+// Misses have albedo 1, a zero normal and depth 0
+// The moments are of the luminance of each sample's color divided by the pixel's albedo, they give the
+// denoiser the noise level of every pixel
+struct AOVBuffers
+{
+    using Vec3 = Eigen::Vector3d;
+
+    TrackedVector<Vec3, MemTag::Framebuffer> albedo;
+    TrackedVector<Vec3, MemTag::Framebuffer> normal;
+    TrackedVector<double, MemTag::Framebuffer> depth; // distance along the camera ray
+    TrackedVector<double, MemTag::Framebuffer> moment1; // mean luminance of the samples
+    TrackedVector<double, MemTag::Framebuffer> moment2; // mean squared luminance of the samples
+    int spp = 1;
+
+    void resize(std::size_t pixels)
+    {
+        albedo.assign(pixels, Vec3::Ones());
+        normal.assign(pixels, Vec3::Zero());
+        depth.assign(pixels, 0.0);
+        moment1.assign(pixels, 0.0);
+        moment2.assign(pixels, 0.0);
+    }
+    inline bool empty() const
+    {
+        return albedo.empty();
+    }
+};
+
+// Edge-avoiding a-trous wavelet filter(Dammertz et al. 2010) with variance guided luminance weights(SVGF,
+// Schied et al. 2017), guided by the AOVs
+// Color is divided by albedo first so texture detail is not blurred, filtered as irradiance,
+// then multiplied back. Each iteration applies a 5x5 B3-spline kernel with holes of 2^i pixels,
+// neighbours are weighted down by their difference in normal, albedo and depth, and by their luminance
+// difference relative to the pixel's noise level. The noise level is the variance of the pixel's mean,
+// estimated from the luminance moments of its geometric neighbours so single-sample pixels have one too,
+// and filtered along with the color, so pixels whose noise has been smoothed away stop blending
+class AtrousDenoiser
+{
+    using Vec3 = Eigen::Vector3d;
+
+private:
+    int _iterations = DENOISE_ITERATIONS;
+    double _sigmaLuminance = 4.0; // luminance difference, in standard deviations of the pixel's noise
+    double _sigmaNormal = 32.0;   // exponent on the cosine between normals
+    double _sigmaAlbedo = 0.1;
+    double _sigmaDepth = 0.01; // relative to the farther pixel
+
+    inline static double _luminance(const Vec3 &c)
+    {
+        return 0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2];
+    }
+    // Weight of q as a neighbour of p from the guides alone
+    inline double _geometryWeight(const AOVBuffers &aovs, std::size_t p, std::size_t q) const
+    {
+        const Vec3 &np = aovs.normal[p], &nq = aovs.normal[q];
+        double zp = aovs.depth[p], zq = aovs.depth[q];
+        double depthDiff = std::abs(zp - zq) / (_sigmaDepth * std::max({zp, zq, 1e-6}));
+        double albedoDiff = (aovs.albedo[p] - aovs.albedo[q]).squaredNorm() / (_sigmaAlbedo * _sigmaAlbedo);
+        // pixels without a hit only blend with each other
+        double normalWeight = np.isZero() && nq.isZero() ? 1.0 : std::pow(std::max(0.0, np.dot(nq)), _sigmaNormal);
+        return normalWeight * std::exp(-depthDiff - albedoDiff);
+    }
+    // Variance of every pixel's mean luminance from the sample moments of the 7x7 pixels around it
+    void _estimateVariance(const AOVBuffers &aovs, int w, int h, double *variance) const
+    {
+#ifdef MULTI_THREAD
+#pragma omp parallel for schedule(dynamic, 4)
+#endif
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+            {
+                std::size_t p = std::size_t(y) * w + x;
+                double m1 = 0.0, m2 = 0.0, weightSum = 0.0;
+                for (int qy = std::max(0, y - 3); qy <= std::min(h - 1, y + 3); qy++)
+                    for (int qx = std::max(0, x - 3); qx <= std::min(w - 1, x + 3); qx++)
+                    {
+                        std::size_t q = std::size_t(qy) * w + qx;
+                        double weight = _geometryWeight(aovs, p, q);
+                        m1 += weight * aovs.moment1[q];
+                        m2 += weight * aovs.moment2[q];
+                        weightSum += weight;
+                    }
+                m1 /= weightSum;
+                m2 /= weightSum;
+                variance[p] = std::max(0.0, m2 - m1 * m1) / std::max(aovs.spp, 1);
+            }
+    }
+
+public:
+    AtrousDenoiser(){};
+
+public: // parameter setters
+    void setIterations(int iterations)
+    {
+        _iterations = iterations;
+    }
+    void setSigmas(double luminance, double normal, double albedo, double depth)
+    {
+        _sigmaLuminance = luminance;
+        _sigmaNormal = normal;
+        _sigmaAlbedo = albedo;
+        _sigmaDepth = depth;
+    }
+
+public:
+    // color and out hold w * h pixels in row-major order, out may be color
+    void denoise(const Vec3 *color, const AOVBuffers &aovs, int w, int h, Vec3 *out) const
+    {
+        constexpr double kernel[3] = {3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0};
+        std::size_t pixels = std::size_t(w) * h;
+        TrackedVector<Vec3, MemTag::Framebuffer> current(pixels), next(pixels);
+        TrackedVector<double, MemTag::Framebuffer> variance(pixels), nextVariance(pixels);
+        for (std::size_t p = 0; p < pixels; p++)
+            current[p] = color[p].cwiseQuotient(aovs.albedo[p].cwiseMax(0.01));
+        _estimateVariance(aovs, w, h, variance.data());
+
+        for (int it = 0; it < _iterations; it++)
+        {
+            int step = 1 << it;
+#ifdef MULTI_THREAD
+#pragma omp parallel for schedule(dynamic, 4)
+#endif
+            for (int y = 0; y < h; y++)
+                for (int x = 0; x < w; x++)
+                {
+                    std::size_t p = std::size_t(y) * w + x;
+                    // The luminance tolerance comes from the 3x3 blurred variance, a single pixel's is noisy itself
+                    double blurred = 0.0, blurWeight = 0.0;
+                    for (int dy = -1; dy <= 1; dy++)
+                        for (int dx = -1; dx <= 1; dx++)
+                        {
+                            int qy = y + dy, qx = x + dx;
+                            if (qy < 0 || qy >= h || qx < 0 || qx >= w)
+                                continue;
+                            double weight = (dx ? 0.25 : 0.5) * (dy ? 0.25 : 0.5);
+                            blurred += weight * variance[std::size_t(qy) * w + qx];
+                            blurWeight += weight;
+                        }
+                    double tolerance = _sigmaLuminance * std::sqrt(blurred / blurWeight) + 1e-4;
+                    double lp = _luminance(current[p]);
+
+                    Vec3 sum = Vec3::Zero();
+                    double weightSum = 0.0, varianceSum = 0.0;
+                    for (int dy = -2; dy <= 2; dy++)
+                    {
+                        int qy = y + dy * step;
+                        if (qy < 0 || qy >= h)
+                            continue;
+                        for (int dx = -2; dx <= 2; dx++)
+                        {
+                            int qx = x + dx * step;
+                            if (qx < 0 || qx >= w)
+                                continue;
+                            std::size_t q = std::size_t(qy) * w + qx;
+                            double weight = kernel[std::abs(dx)] * kernel[std::abs(dy)] * _geometryWeight(aovs, p, q) *
+                                            std::exp(-std::abs(lp - _luminance(current[q])) / tolerance);
+                            sum += weight * current[q];
+                            weightSum += weight;
+                            varianceSum += weight * weight * variance[q];
+                        }
+                    }
+                    next[p] = sum / weightSum;
+                    nextVariance[p] = varianceSum / (weightSum * weightSum);
+                }
+            current.swap(next);
+            variance.swap(nextVariance);
+        }
+
+        for (std::size_t p = 0; p < pixels; p++)
+            out[p] = current[p].cwiseProduct(aovs.albedo[p].cwiseMax(0.01));
+    }
+};
\ No newline at end of file
@@ -0,0 +1,354 @@
+#pragma once
+#include <functional>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <cstdio>
+#include <chrono>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <poll.h>
+#include <omp.h>
+#include <eigen3/Eigen/Core>
+#include "scene.hpp"
+#include "memory_tracker.hpp"
+#include "utils.hpp"
+#include "config.h"
+
+// Tile request from the coordinator, echoed in front of the worker's pixels
+// A worker also sends one with a negative id once its scene is set up
+struct TileMessage
+{
+    int32_t id; // negative asks the worker to exit
+    int32_t frame; // render call the tile belongs to
+    int32_t x0, y0, w, h;
+};
+
+// Whole-message socket IO, false once the other side is gone
+inline bool sendAll(int fd, const void *data, std::size_t bytes)
+{
+    const char *p = static_cast<const char *>(data);
+    while (bytes > 0)
+    {
+        ssize_t n = send(fd, p, bytes, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+inline bool recvAll(int fd, void *data, std::size_t bytes)
+{
+    char *p = static_cast<char *>(data);
+    while (bytes > 0)
+    {
+        ssize_t n = recv(fd, p, bytes, 0);
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+// Splits a frame into tiles and renders them in worker processes over local sockets
+// Each worker builds the scene once with the setup function, then renders tiles until told to stop
+// Tiles are handed out one at a time as workers become idle, so fast workers take more of them,
+// and once the queue is empty idle workers duplicate the oldest tile still in flight so one slow
+// worker cannot hold up the frame. A frame returns as soon as all its tiles are in, workers still on a
+// duplicate finish it in the background and their reply is dropped when it arrives
+// A worker that dies, or takes longer than DISTRIBUTED_TILE_TIMEOUT on a tile, has its tile requeued and
+// is restarted
+// Tiles render exactly as in Scene::render, the assembled frame matches a local render
+// Workers are forked, so the coordinator must not have started threads, e.g. by rendering, before
+class RenderCoordinator
+{
+    using Vec3 = Eigen::Vector3d;
+    using Setup = std::function<void(Scene &)>;
+
+public:
+    struct Stats
+    {
+        int tiles = 0;
+        int duplicates = 0; // tiles handed to a second worker near the end of the frame
+        int failures = 0;   // workers lost or timed out while rendering
+        int restarts = 0;
+    };
+
+private:
+    struct Worker
+    {
+        pid_t pid = -1;
+        int fd = -1;
+        bool ready = false; // set up its scene
+        int tile = -1;      // in flight, -1 when idle
+        TileMessage task;   // the tile in flight, possibly of an earlier frame
+        std::chrono::steady_clock::time_point sent;
+    };
+    struct Tile
+    {
+        TileMessage msg;
+        bool done = false;
+        int inFlight = 0;
+    };
+
+    Setup _setup;
+    int _nWorkers;
+    int _tileSize;
+    std::vector<Worker> _workers;
+    int32_t _frame = 0;
+    Stats _stats;
+
+private:
+    static void _workerMain(int fd, const Setup &setup, int nWorkers)
+    {
+        // Workers on one machine share its cores
+        omp_set_num_threads(std::max(1, omp_get_num_procs() / nWorkers));
+        Scene scene;
+        setup(scene);
+        TileMessage msg{-1, 0, 0, 0, 0, 0};
+        TrackedVector<Vec3, MemTag::Framebuffer> pixels;
+        // Ready, if the coordinator is gone the first recvAll fails as well
+        sendAll(fd, &msg, sizeof(msg));
+        while (recvAll(fd, &msg, sizeof(msg)) && msg.id >= 0)
+        {
+            pixels.resize(std::size_t(msg.w) * msg.h);
+            scene.renderTile(msg.x0, msg.y0, msg.w, msg.h, pixels.data());
+            if (!sendAll(fd, &msg, sizeof(msg)) || !sendAll(fd, pixels.data(), pixels.size() * sizeof(Vec3)))
+                break;
+        }
+        close(fd);
+    }
+    void _spawn(Worker &worker)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+            RAISE_ERROR("Failed to create worker socket");
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0)
+            RAISE_ERROR("Failed to fork worker");
+        if (pid == 0)
+        {
+            close(fds[0]);
+            for (const Worker &other : _workers)
+                if (other.fd >= 0)
+                    close(other.fd);
+            _workerMain(fds[1], _setup, _nWorkers);
+            _exit(0);
+        }
+        close(fds[1]);
+        worker.pid = pid;
+        worker.fd = fds[0];
+        worker.ready = false;
+        worker.tile = -1;
+    }
+    void _stop(Worker &worker)
+    {
+        if (worker.fd < 0)
+            return;
+        TileMessage quit{-1, 0, 0, 0, 0, 0};
+        sendAll(worker.fd, &quit, sizeof(quit));
+        close(worker.fd);
+        // Its tile's reply is no longer wanted, and a hung worker would never read the request to quit
+        if (worker.tile >= 0)
+            kill(worker.pid, SIGKILL);
+        waitpid(worker.pid, nullptr, 0);
+        worker.fd = -1;
+        worker.pid = -1;
+    }
+    // Requeue the lost tile, unless it belongs to an earlier frame, and restart the worker while restarts remain
+    void _fail(Worker &worker, std::vector<Tile> &tiles, std::deque<int> &queue)
+    {
+        _stats.failures++;
+        close(worker.fd);
+        kill(worker.pid, SIGKILL);
+        waitpid(worker.pid, nullptr, 0);
+        worker.fd = -1;
+        worker.pid = -1;
+        if (worker.tile >= 0 && worker.task.frame == _frame)
+        {
+            Tile &tile = tiles[worker.tile];
+            if (--tile.inFlight == 0 && !tile.done)
+                queue.push_front(worker.tile);
+        }
+        worker.tile = -1;
+        if (_stats.restarts < DISTRIBUTED_MAX_RESTARTS)
+        {
+            _stats.restarts++;
+            _spawn(worker);
+        }
+    }
+    // Next tile for an idle worker: queued tiles first, then a duplicate of the oldest one in flight
+    int _nextTile(std::vector<Tile> &tiles, std::deque<int> &queue)
+    {
+        while (!queue.empty())
+        {
+            int t = queue.front();
+            queue.pop_front();
+            if (!tiles[t].done)
+                return t;
+        }
+        for (int t = 0; t < tiles.size(); t++)
+            if (!tiles[t].done && tiles[t].inFlight == 1)
+            {
+                _stats.duplicates++;
+                return t;
+            }
+        return -1;
+    }
+    // Read the worker's reply to its task into pixels, false if the worker failed or answered something else
+    bool _receive(Worker &worker, TrackedVector<Vec3, MemTag::Framebuffer> &pixels)
+    {
+        TileMessage msg;
+        pixels.resize(std::size_t(worker.task.w) * worker.task.h);
+        return recvAll(worker.fd, &msg, sizeof(msg)) && !memcmp(&msg, &worker.task, sizeof(msg)) &&
+               recvAll(worker.fd, pixels.data(), pixels.size() * sizeof(Vec3));
+    }
+
+public:
+    // nWorkers processes are started right away, each runs setup on its own scene
+    RenderCoordinator(Setup setup, int nWorkers, int tileSize = DISTRIBUTED_TILE_SIZE)
+        : _setup(std::move(setup)), _nWorkers(nWorkers), _tileSize(tileSize), _workers(nWorkers)
+    {
+        if (nWorkers < 1)
+            RAISE_ERROR("Distributed rendering needs at least one worker");
+        for (Worker &worker : _workers)
+            _spawn(worker);
+    }
+    ~RenderCoordinator()
+    {
+        for (Worker &worker : _workers)
+            _stop(worker);
+    }
+    RenderCoordinator(const RenderCoordinator &) = delete;
+    RenderCoordinator &operator=(const RenderCoordinator &) = delete;
+
+public:
+    // Render the w * h frame the workers' camera sees into out, row-major
+    void render(int w, int h, Vec3 *out)
+    {
+        _frame++;
+        std::vector<Tile> tiles;
+        for (int y = 0; y < h; y += _tileSize)
+            for (int x = 0; x < w; x += _tileSize)
+            {
+                Tile tile;
+                tile.msg = {int32_t(tiles.size()), _frame, x, y, std::min(_tileSize, w - x), std::min(_tileSize, h - y)};
+                tiles.push_back(tile);
+            }
+        std::deque<int> queue;
+        for (int t = 0; t < tiles.size(); t++)
+            queue.push_back(t);
+
+        int done = 0;
+        TrackedVector<Vec3, MemTag::Framebuffer> pixels;
+        auto timeout = std::chrono::duration<double>(DISTRIBUTED_TILE_TIMEOUT);
+        while (done < tiles.size())
+        {
+            for (Worker &worker : _workers)
+                if (worker.fd >= 0 && worker.ready && worker.tile < 0)
+                {
+                    int t = _nextTile(tiles, queue);
+                    if (t < 0)
+                        break;
+                    worker.tile = t;
+                    worker.task = tiles[t].msg;
+                    worker.sent = std::chrono::steady_clock::now();
+                    tiles[t].inFlight++;
+                    if (!sendAll(worker.fd, &worker.task, sizeof(TileMessage)))
+                        _fail(worker, tiles, queue);
+                }
+
+            // Workers still setting up and workers on a tile, of this frame or an earlier one
+            std::vector<pollfd> fds;
+            std::vector<Worker *> busy;
+            auto now = std::chrono::steady_clock::now();
+            auto wait = timeout;
+            for (Worker &worker : _workers)
+                if (worker.fd >= 0 && (!worker.ready || worker.tile >= 0))
+                {
+                    fds.push_back({worker.fd, POLLIN, 0});
+                    busy.push_back(&worker);
+                    if (worker.tile >= 0)
+                        wait = std::min<decltype(wait)>(wait, worker.sent + timeout - now);
+                }
+            if (fds.empty())
+            {
+                // Every worker is gone and none may be restarted
+                if (std::none_of(_workers.begin(), _workers.end(), [](const Worker &worker)
+                                 { return worker.fd >= 0; }))
+                    RAISE_ERROR("All render workers failed");
+                continue;
+            }
+            // Until the first tile in flight runs out of time
+            if (poll(fds.data(), fds.size(), std::max(0, int(std::ceil(wait.count() * 1000.0)))) < 0)
+                continue;
+
+            now = std::chrono::steady_clock::now();
+            for (int k = 0; k < fds.size(); k++)
+            {
+                Worker &worker = *busy[k];
+                if (!fds[k].revents)
+                {
+                    if (worker.tile >= 0 && now - worker.sent >= timeout)
+                        _fail(worker, tiles, queue);
+                    continue;
+                }
+                if (!worker.ready)
+                {
+                    TileMessage ready;
+                    if (!recvAll(worker.fd, &ready, sizeof(ready)) || ready.id >= 0)
+                        _fail(worker, tiles, queue);
+                    else
+                        worker.ready = true;
+                    continue;
+                }
+                if (!_receive(worker, pixels))
+                {
+                    _fail(worker, tiles, queue);
+                    continue;
+                }
+                int t = worker.tile;
+                worker.tile = -1;
+                if (worker.task.frame != _frame) // a duplicate left running by an earlier frame
+                    continue;
+                Tile &tile = tiles[t];
+                tile.inFlight--;
+                if (tile.done) // a duplicate finished first
+                    continue;
+                tile.done = true;
+                done++;
+                _stats.tiles++;
+                for (int i = 0; i < tile.msg.h; i++)
+                    std::copy_n(pixels.data() + std::size_t(i) * tile.msg.w, tile.msg.w,
+                                out + std::size_t(tile.msg.y0 + i) * w + tile.msg.x0);
+            }
+        }
+    }
+
+    inline const Stats &stats() const
+    {
+        return _stats;
+    }
+    void printStats() const
+    {
+        printf("Distributed: %d workers, %d tiles, %d duplicated, %d worker failures, %d restarts\n",
+               _nWorkers, _stats.tiles, _stats.duplicates, _stats.failures, _stats.restarts);
+    }
+    // Process ids of the running workers
+    std::vector<pid_t> workerPids() const
+    {
+        std::vector<pid_t> pids;
+        for (const Worker &worker : _workers)
+            if (worker.pid > 0)
+                pids.push_back(worker.pid);
+        return pids;
+    }
+};
\ No newline at end of file
@@ -1,11 +1,61 @@
 #pragma once
 #include <random>
+#include <cstdint>
 
-static std::random_device _rd;
-static std::mt19937_64 _gen(_rd());
-static std::uniform_real_distribution<double> _distrib(-1.0, 1.0);
+// Per-thread splitmix64 sequence behind easyUniform
+// The renderer reseeds it from (seed, sample, stream) keys before every sample it traces or shades,
+// so an image does not depend on thread scheduling and a resumed render repeats the same numbers
+// Outside of rendering each thread starts from a random seed
+class RandomSequence
+{
+private:
+    uint64_t _state;
+
+    inline static uint64_t _mix(uint64_t z)
+    {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+public:
+    explicit RandomSequence(uint64_t seed) : _state(seed){};
+
+    static RandomSequence &local()
+    {
+        thread_local RandomSequence sequence(std::random_device{}());
+        return sequence;
+    }
+    static uint64_t key(uint64_t seed, uint64_t sample, uint64_t stream)
+    {
+        return _mix(_mix(seed ^ _mix(sample)) + stream);
+    }
+
+public:
+    inline void seed(uint64_t key)
+    {
+        _state = key;
+    }
+    inline uint64_t next()
+    {
+        return _mix(_state += 0x9e3779b97f4a7c15ull);
+    }
+    // Uniform in [-1, 1)
+    inline double uniform()
+    {
+        return double(next() >> 11) * 0x1.0p-52 - 1.0;
+    }
+};
+
+// Streams of the keys the renderer seeds with, light l of the scene uses LightStream + l
+enum RandomStream : uint64_t
+{
+    CameraStream,   // jitter of a pixel's samples, keyed by pixel
+    IndirectStream, // reflection and refraction below a sample's primary hit, keyed by sample
+    LightStream     // samples of a light at a primary hit, keyed by sample
+};
 
 inline double easyUniform()
 {
-    return _distrib(_gen);
+    return RandomSequence::local().uniform();
 }
\ No newline at end of file
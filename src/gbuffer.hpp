@@ -0,0 +1,82 @@
+#pragma once
+#include <cstdint>
+#include <eigen3/Eigen/Core>
+#include "intersection.hpp"
+#include "memory_tracker.hpp"
+
+// Primary hits of every sample of a frame, what shading and the AOVs read of them, so lights and materials
+// can be edited and the frame shaded again without tracing the primary rays, see Scene::relight
+// Texture colors are cached as looked up, texture edits need a new render
+// Samples are kept in floats, 60 bytes instead of 112, so shading them again matches the full render
+// to float precision, not bit for bit
+class GBuffer
+{
+    using Vec3 = Eigen::Vector3d;
+    using Vec3f = Eigen::Vector3f;
+
+private:
+    struct Sample
+    {
+        Vec3f pos;
+        Vec3f normal;
+        Vec3f viewDir;
+        Vec3f texColor;
+        float t;
+        uint32_t materialId;
+        bool happen;
+        bool textured;
+    };
+
+    TrackedVector<Sample, MemTag::Framebuffer> _samples;
+    int _width = 0;
+    int _height = 0;
+    int _spp = 0;
+
+public:
+    GBuffer(){};
+
+public:
+    void resize(int width, int height, int spp)
+    {
+        _width = width, _height = height, _spp = spp;
+        _samples.resize(std::size_t(width) * height * spp);
+    }
+    void clear()
+    {
+        _width = _height = _spp = 0;
+        _samples = TrackedVector<Sample, MemTag::Framebuffer>();
+    }
+    inline bool matches(int width, int height, int spp) const
+    {
+        return !_samples.empty() && width == _width && height == _height && spp == _spp;
+    }
+
+    // The width * spp hits of row i, pixel by pixel
+    void storeRow(int i, const Intersection *hits)
+    {
+        Sample *row = _samples.data() + std::size_t(i) * _width * _spp;
+        for (int k = 0; k < _width * _spp; k++)
+        {
+            const Intersection &hit = hits[k];
+            row[k] = {hit.pos.cast<float>(), hit.normal.cast<float>(), hit.viewDir.cast<float>(), hit.texColor.cast<float>(),
+                      float(hit.t), hit.materialId, hit.happen, hit.hasTexColor};
+        }
+    }
+    void loadRow(int i, Intersection *hits) const
+    {
+        const Sample *row = _samples.data() + std::size_t(i) * _width * _spp;
+        for (int k = 0; k < _width * _spp; k++)
+        {
+            const Sample &sample = row[k];
+            Intersection &hit = hits[k];
+            hit.happen = sample.happen;
+            hit.t = sample.t;
+            hit.pos = sample.pos.cast<double>();
+            hit.normal = sample.normal.cast<double>();
+            hit.viewDir = sample.viewDir.cast<double>();
+            hit.materialId = sample.materialId;
+            hit.texColor = sample.texColor.cast<double>();
+            hit.hasTexColor = sample.textured;
+        }
+    }
+};
\ No newline at end of file
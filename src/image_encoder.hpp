@@ -3,50 +3,305 @@
 #include <assert.h>
 #include <iostream>
 #include <fstream>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cstring>
 #include "utils.hpp"
+#include "config.h"
+#include "memory_tracker.hpp"
+#include "../dep/lodepng/lodepng.h"
 #include <eigen3/Eigen/Core>
 #include <omp.h>
 
+enum class ImageFormat
+{
+    PPM, // 8-bit, gamma corrected
+    PNG, // 8-bit, gamma corrected
+    PFM, // 32-bit float, linear
+    EXR  // 32-bit float, linear, uncompressed scanlines
+};
+
+// Turns a linear color buffer into an image file
+// 8-bit formats go through a tonemapping stage first, clamp and gamma into one contiguous
+// byte buffer in parallel, which is then written in a single call
+// Float formats keep the linear values for HDR delivery
 class ImageEncoder
 {
     using Vec3 = Eigen::Vector3d;
+    using ByteBuffer = TrackedVector<uint8_t, MemTag::Framebuffer>;
+    using FloatBuffer = TrackedVector<float, MemTag::Framebuffer>;
 
 private:
     std::string _filepath = "imout.ppm";
     int _width = 512;
     int _height = 512;
 
+private:
+    // Gamma curve as byte thresholds: a value maps to the number of levels whose threshold it reaches
+    // Thresholds are the smallest floats the per-value pow(value, 1/2.2) * 255.999 puts on each level,
+    // so levels match it except for values within float rounding of a threshold
+    // A fine LUT gives the level to start from, at most a couple of thresholds are checked after it
+    struct GammaLUT
+    {
+        constexpr static int SIZE = 1 << 16;
+        std::array<float, 257> threshold;
+        std::vector<uint8_t> start;
+
+        static int level(float v)
+        {
+            return int(pow(double(v), 1.0f / 2.2f) * 255.999f);
+        }
+        GammaLUT() : start(SIZE + 1)
+        {
+            // Bisect on the bit patterns, positive floats are ordered like their bits
+            threshold[0] = 0.0f;
+            for (int b = 1; b < 256; b++)
+            {
+                uint32_t lo = 0, hi = 0x3f800000; // 0 and 1
+                while (lo < hi)
+                {
+                    uint32_t mid = lo + (hi - lo) / 2;
+                    float v;
+                    memcpy(&v, &mid, sizeof(float));
+                    if (level(v) >= b)
+                        hi = mid;
+                    else
+                        lo = mid + 1;
+                }
+                memcpy(&threshold[b], &lo, sizeof(float));
+            }
+            threshold[256] = INFINITY;
+            int b = 0;
+            for (int i = 0; i <= SIZE; i++)
+            {
+                while (threshold[b + 1] <= float(i) / SIZE)
+                    b++;
+                start[i] = b;
+            }
+        }
+        inline uint8_t operator()(double value) const
+        {
+            float v = value > 0.0 ? float(std::min(value, 1.0)) : 0.0f; // NaN goes to 0 as well
+            int b = start[int(v * SIZE)];
+            while (v >= threshold[b + 1])
+                b++;
+            return b;
+        }
+    };
+    static const GammaLUT &_gammaLUT()
+    {
+        static const GammaLUT lut;
+        return lut;
+    }
+
+    // Empty if everything reached the file, otherwise the error
+    std::string _status(const std::ofstream &ofs) const
+    {
+        return ofs ? "" : "Failed to write output file " + _filepath;
+    }
+    std::string _writePPM(const ByteBuffer &bytes) const
+    {
+        std::ofstream ofs(_filepath, std::ios::binary);
+        ofs << header(ImageFormat::PPM, _width, _height);
+        ofs.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+        return _status(ofs);
+    }
+    std::string _writePNG(const ByteBuffer &bytes) const
+    {
+        unsigned error = lodepng_encode24_file(_filepath.c_str(), bytes.data(), _width, _height);
+        return error ? "Failed to encode PNG " + _filepath + ": " + lodepng_error_text(error) : "";
+    }
+    std::string _writePFM(const Vec3 *data) const
+    {
+        FloatBuffer floats(std::size_t(_width) * _height * 3);
+        pfmRows(data, _width, _height, floats.data());
+        std::ofstream ofs(_filepath, std::ios::binary);
+        ofs << header(ImageFormat::PFM, _width, _height);
+        ofs.write(reinterpret_cast<const char *>(floats.data()), floats.size() * sizeof(float));
+        return _status(ofs);
+    }
+    std::string _writeEXR(const Vec3 *data) const
+    {
+        std::size_t chunkBytes = exrChunkBytes(_width);
+        ByteBuffer chunks(chunkBytes * _height);
+#ifdef MULTI_THREAD
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < _height; i++)
+            exrChunk(data + std::size_t(i) * _width, _width, i, chunks.data() + i * chunkBytes);
+        std::ofstream ofs(_filepath, std::ios::binary);
+        ofs << header(ImageFormat::EXR, _width, _height);
+        ofs.write(reinterpret_cast<const char *>(chunks.data()), chunks.size());
+        return _status(ofs);
+    }
+
+public: // file layout, shared with ImageStream
+    // Everything before the pixels, for EXR that includes the scanline offset table
+    static std::string header(ImageFormat format, int w, int h)
+    {
+        if (format == ImageFormat::PPM)
+            return "P6\n" + std::to_string(w) + " " + std::to_string(h) + "\n255\n"; // Binary representation
+        if (format == ImageFormat::PFM)
+            return "PF\n" + std::to_string(w) + " " + std::to_string(h) + "\n-1\n"; // negative scale: little-endian
+        if (format != ImageFormat::EXR)
+            RAISE_ERROR("Format has no raw header");
+
+        // Single-part scanline OpenEXR, no compression, channels B, G, R as 32-bit floats
+        std::string header;
+        auto put = [&header](const void *p, std::size_t n)
+        { header.append(static_cast<const char *>(p), n); };
+        auto putInt = [&put](int32_t v)
+        { put(&v, 4); };
+        auto putFloat = [&put](float v)
+        { put(&v, 4); };
+        auto attribute = [&](const char *name, const char *type, int32_t size)
+        {
+            put(name, strlen(name) + 1);
+            put(type, strlen(type) + 1);
+            putInt(size);
+        };
+        putInt(20000630); // magic
+        putInt(2);        // version 2, single-part scanline
+        attribute("channels", "chlist", 3 * 18 + 1);
+        for (const char *channel : {"B", "G", "R"})
+        {
+            put(channel, 2);
+            putInt(2); // FLOAT
+            putInt(0); // pLinear and reserved
+            putInt(1); // x sampling
+            putInt(1); // y sampling
+        }
+        header.push_back('\0');
+        attribute("compression", "compression", 1);
+        header.push_back('\0'); // NO_COMPRESSION
+        for (const char *window : {"dataWindow", "displayWindow"})
+        {
+            attribute(window, "box2i", 16);
+            putInt(0);
+            putInt(0);
+            putInt(w - 1);
+            putInt(h - 1);
+        }
+        attribute("lineOrder", "lineOrder", 1);
+        header.push_back('\0'); // INCREASING_Y
+        attribute("pixelAspectRatio", "float", 4);
+        putFloat(1.0f);
+        attribute("screenWindowCenter", "v2f", 8);
+        putFloat(0.0f);
+        putFloat(0.0f);
+        attribute("screenWindowWidth", "float", 4);
+        putFloat(1.0f);
+        header.push_back('\0');
+
+        // Chunks all have the same size without compression, so their offsets are known upfront
+        std::size_t tableEnd = header.size() + h * sizeof(uint64_t);
+        for (int i = 0; i < h; i++)
+        {
+            uint64_t offset = tableEnd + i * exrChunkBytes(w);
+            put(&offset, sizeof(uint64_t));
+        }
+        return header;
+    }
+    // count rows of PFM pixels from rows top to bottom, PFM stores them bottom to top
+    static void pfmRows(const Vec3 *rows, int w, int count, float *out)
+    {
+#ifdef MULTI_THREAD
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < count; i++)
+        {
+            const Vec3 *row = rows + std::size_t(count - 1 - i) * w;
+            float *line = out + std::size_t(i) * w * 3;
+            for (int j = 0; j < w * 3; j++)
+                line[j] = float(row[j / 3][j % 3]);
+        }
+    }
+    inline static std::size_t exrChunkBytes(int w)
+    {
+        return 8 + std::size_t(w) * 3 * sizeof(float);
+    }
+    // Scanline y as one EXR chunk: y, byte count, then the B, G and R planes
+    static void exrChunk(const Vec3 *row, int w, int y, uint8_t *chunk)
+    {
+        int32_t size = int32_t(exrChunkBytes(w) - 8);
+        memcpy(chunk, &y, 4);
+        memcpy(chunk + 4, &size, 4);
+        float *planes = reinterpret_cast<float *>(chunk + 8);
+        for (int j = 0; j < w; j++)
+        {
+            planes[j] = float(row[j][2]);
+            planes[w + j] = float(row[j][1]);
+            planes[2 * w + j] = float(row[j][0]);
+        }
+    }
+
 public:
     ImageEncoder(int w, int h, const std::string &filepath = "imout.ppm") : _width(w), _height(h), _filepath(filepath){};
 
 public:
-    void write(const void *const vData) const
+    // By extension: .png, .pfm and .exr, anything else is written as PPM
+    static ImageFormat formatOf(const std::string &filepath)
     {
-        if (!vData)
-            RAISE_ERROR("No data to write.");
-        std::ofstream ofs(_filepath);
-        if (!ofs.is_open())
-            RAISE_ERROR("Failed to open output file.");
-
-        ofs << "P6\n"
-            << _width << " " << _height << '\n'
-            << 255 << '\n'; // Binary representation
+        std::string ext = filepath.substr(filepath.find_last_of('.') + 1);
+        for (char &c : ext)
+            c = tolower(c);
+        if (ext == "png")
+            return ImageFormat::PNG;
+        if (ext == "pfm")
+            return ImageFormat::PFM;
+        if (ext == "exr")
+            return ImageFormat::EXR;
+        return ImageFormat::PPM;
+    }
 
-        double *data = (double *)vData;
-        int offset = 0;
-        for (int i = 0; i < _height; i++)
-            for (int j = 0; j < _width; j++)
-                for (int k = 0; k < 3; k++)
-                {
-                    double value = std::clamp(*(data + offset), 0.0, 1.0);
-                    // gamma矫正
-                    value = pow(value, 1.0f / 2.2f);
+    // Clamp and gamma correct count rows into 8-bit RGB
+    static void tonemapRows(const Vec3 *rows, int w, int count, uint8_t *out)
+    {
+        const GammaLUT &lut = _gammaLUT();
+#ifdef MULTI_THREAD
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < count; i++)
+        {
+            const double *row = rows[std::size_t(i) * w].data();
+            uint8_t *line = out + std::size_t(i) * w * 3;
+            for (int j = 0; j < w * 3; j++)
+                line[j] = lut(row[j]);
+        }
+    }
+    // Clamp and gamma correct into 8-bit RGB, rows top to bottom
+    ByteBuffer tonemap(const Vec3 *data) const
+    {
+        ByteBuffer bytes(std::size_t(_width) * _height * 3);
+        tonemapRows(data, _width, _height, bytes.data());
+        return bytes;
+    }
 
-                    unsigned char pValue = value * 255.999f;
-                    ofs << pValue;
-                    offset++;
-                }
-        ofs.close();
+    // vData holds width * height Vec3 in row-major order
+    void write(const void *const vData) const
+    {
+        std::string error = tryWrite(vData);
+        if (!error.empty())
+            RAISE_ERROR(error);
+    }
+    // As write, but returns the error instead of exiting, empty on success
+    std::string tryWrite(const void *const vData) const
+    {
+        if (!vData)
+            return "No data to write.";
+        const Vec3 *data = static_cast<const Vec3 *>(vData);
+        switch (formatOf(_filepath))
+        {
+        case ImageFormat::PNG:
+            return _writePNG(tonemap(data));
+        case ImageFormat::PFM:
+            return _writePFM(data);
+        case ImageFormat::EXR:
+            return _writeEXR(data);
+        default:
+            return _writePPM(tonemap(data));
+        }
     }
 
     // Only for test
@@ -63,4 +318,79 @@ public:
         this->write(image);
         delete[] image;
     }
+};
+
+// Writes an image band by band while it is rendered, so only the rows in flight are held in memory
+// Rows must arrive top to bottom, each band is converted and written, then its memory can be reused
+// PPM and EXR are appended, PFM rows are placed bottom up by seeking
+// PNG needs the whole frame for lodepng and is not supported here
+class ImageStream
+{
+    using Vec3 = Eigen::Vector3d;
+
+private:
+    std::ofstream _ofs;
+    ImageFormat _format;
+    int _width;
+    int _height;
+    int _nextRow = 0;
+    std::size_t _headerBytes = 0;
+    TrackedVector<uint8_t, MemTag::Framebuffer> _band;
+
+public:
+    ImageStream(int w, int h, const std::string &filepath) : _format(ImageEncoder::formatOf(filepath)), _width(w), _height(h)
+    {
+        if (_format == ImageFormat::PNG)
+            RAISE_ERROR("PNG output cannot be streamed, use PPM, PFM or EXR");
+        _ofs.open(filepath, std::ios::binary);
+        if (!_ofs.is_open())
+            RAISE_ERROR("Failed to open output file.");
+        std::string header = ImageEncoder::header(_format, w, h);
+        _ofs.write(header.data(), header.size());
+        _headerBytes = header.size();
+    }
+    ImageStream(const ImageStream &) = delete;
+    ImageStream &operator=(const ImageStream &) = delete;
+
+public:
+    // The next count rows of the image, width * count Vec3 in row-major order
+    void writeRows(const Vec3 *rows, int count)
+    {
+        if (count <= 0 || _nextRow + count > _height)
+            RAISE_ERROR("Rows past the end of the streamed image");
+        switch (_format)
+        {
+        case ImageFormat::PFM:
+        {
+            std::size_t rowBytes = std::size_t(_width) * 3 * sizeof(float);
+            _band.resize(rowBytes * count);
+            ImageEncoder::pfmRows(rows, _width, count, reinterpret_cast<float *>(_band.data()));
+            _ofs.seekp(_headerBytes + (_height - _nextRow - count) * rowBytes);
+            break;
+        }
+        case ImageFormat::EXR:
+        {
+            std::size_t chunkBytes = ImageEncoder::exrChunkBytes(_width);
+            _band.resize(chunkBytes * count);
+            for (int i = 0; i < count; i++)
+                ImageEncoder::exrChunk(rows + std::size_t(i) * _width, _width, _nextRow + i, _band.data() + i * chunkBytes);
+            break;
+        }
+        default:
+            _band.resize(std::size_t(_width) * count * 3);
+            ImageEncoder::tonemapRows(rows, _width, count, _band.data());
+        }
+        _ofs.write(reinterpret_cast<const char *>(_band.data()), _band.size());
+        if (!_ofs)
+            RAISE_ERROR("Failed to write output file.");
+        _nextRow += count;
+    }
+    inline int rowsWritten() const
+    {
+        return _nextRow;
+    }
+    inline bool complete() const
+    {
+        return _nextRow == _height;
+    }
 };
\ No newline at end of file
@@ -6,8 +6,7 @@
 class Intersection
 {
     using Vec3 = Eigen::Vector3d;
-    using Vec3Ptr = std::shared_ptr<Vec3>;
-    using MtlPtr = std::shared_ptr<Material>;
+    using Vec2 = Eigen::Vector2d;
     using VecPtr = std::shared_ptr<Vec3>;
 
 public:
@@ -16,6 +15,13 @@ public:
     Vec3 viewDir = {0.0, 0.0, 1.0};
     Vec3 pos = {0.0, 0.0, 0.0};
     Vec3 normal = {1.0, 0.0, 0.0};
-    MtlPtr mtl = DEFAULT_MATERIAL;
-    Vec3Ptr texColor = nullptr;
+    uint32_t materialId = 0; // see MaterialTable, 0 is DEFAULT_MATERIAL
+    // Looked up texture color, held by value so hits can be kept past the span that traced them
+    Vec3 texColor = {0.0, 0.0, 0.0};
+    bool hasTexColor = false;
+    bool hasUV = false;
+    Vec2 uv = {0.0, 0.0};
+    // Change of texture coordinates to the neighbouring pixels, zero without ray differentials
+    Vec2 duvdx = {0.0, 0.0};
+    Vec2 duvdy = {0.0, 0.0};
 };
\ No newline at end of file
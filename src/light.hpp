@@ -6,9 +6,31 @@ class Light
 {
     using Vec3 = Eigen::Vector3d;
 
+protected:
+    Vec3 _intensity;
+
+public:
+    Light(const Vec3 &intensity) : _intensity(intensity){};
+
+public: // parameter setters
+    // Takes effect on the next render or relight, see Scene::relight
+    void setIntensity(const Vec3 &intensity)
+    {
+        _intensity = intensity;
+    }
+    inline const Vec3 &intensity() const
+    {
+        return _intensity;
+    }
+
 public:
     // Compute intensity and direction at a specific point
     virtual void idAt(const Vec3 &, Vec3 &, Vec3 &) const = 0;
+    // Whether shading traces shadow rays towards it
+    virtual bool castsShadows() const
+    {
+        return true;
+    }
 };
 
 class PointLight : public Light
@@ -16,11 +38,10 @@ class PointLight : public Light
     using Vec3 = Eigen::Vector3d;
 
 private:
-    Vec3 _intensity = {2.0, 2.0, 2.0};
     Vec3 _pos = {0.0, 0.0, 0.0};
 
 public:
-    PointLight(const Vec3 &intensity, const Vec3 &pos) : _intensity(intensity), _pos(pos){};
+    PointLight(const Vec3 &intensity, const Vec3 &pos) : Light(intensity), _pos(pos){};
 
 public:
     void idAt(const Vec3 &pos, Vec3 &intensity, Vec3 &dir) const override
@@ -36,11 +57,8 @@ class AmbientLight : public Light
 {
     using Vec3 = Eigen::Vector3d;
 
-private:
-    Vec3 _intensity = {2.0, 2.0, 2.0};
-
 public:
-    AmbientLight(const Vec3 &intensity) : _intensity(intensity){};
+    AmbientLight(const Vec3 &intensity) : Light(intensity){};
 
 public:
     void idAt(const Vec3 &pos, Vec3 &intensity, Vec3 &dir) const override
@@ -48,6 +66,10 @@ public:
         intensity = _intensity;
         dir = {0.0, 0.0, 0.0};
     }
+    bool castsShadows() const override
+    {
+        return false;
+    }
 };
 
 class ParallelLight : public Light
@@ -55,11 +77,10 @@ class ParallelLight : public Light
     using Vec3 = Eigen::Vector3d;
 
 private:
-    Vec3 _intensity = {2.0, 2.0, 2.0};
     Vec3 _dir = {0.0, 0.0, -1.0};
 
 public:
-    ParallelLight(const Vec3 &intensity, const Vec3 &dir) : _intensity(intensity), _dir(dir.normalized()){};
+    ParallelLight(const Vec3 &intensity, const Vec3 &dir) : Light(intensity), _dir(dir.normalized()){};
 
 public:
     void idAt(const Vec3 &pos, Vec3 &intensity, Vec3 &dir) const override
@@ -74,13 +95,12 @@ class AreaLight : public Light
     using Vec3 = Eigen::Vector3d;
 
 private:
-    Vec3 _intensity = {2.0, 2.0, 2.0};
     Vec3 _center = Vec3::Zero();
     Vec3 _a;
     Vec3 _b;
 
 public:
-    AreaLight(const Vec3 &intensity, const Vec3 &center, const Vec3 &a, const Vec3 &b) : _intensity(intensity), _center(center), _a(a), _b(b){};
+    AreaLight(const Vec3 &intensity, const Vec3 &center, const Vec3 &a, const Vec3 &b) : Light(intensity), _center(center), _a(a), _b(b){};
 
 public:
     void idAt(const Vec3 &pos, Vec3 &intensity, Vec3 &dir) const override
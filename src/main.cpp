@@ -4,13 +4,23 @@
 #include <cmath>
 #include "intersection.hpp"
 #include "renderable.hpp"
+#include "mesh.hpp"
 #include "camera.hpp"
 #include "scene.hpp"
 #include <memory>
 #include "config.h"
 #include "mtl_loader.hpp"
 #include "obj_loader.hpp"
+#include "asset_manager.hpp"
+#include "ooc_mesh.hpp"
+#include "phong_batch.hpp"
+#include "distributed.hpp"
+#include "render_server.hpp"
+#include "animation.hpp"
+#include "preview.hpp"
 #include "../dep/lodepng/lodepng.h"
+#include <chrono>
+#include <random>
 
 using Vec3 = Eigen::Vector3d;
 using Mat3 = Eigen::Matrix3d;
@@ -32,48 +42,72 @@ CameraPtr initCamera()
     return camera;
 }
 
-void setTestScene_ideal_hard(Scene &scene)
+// Starts loading a test scene's mesh, paged from disk when OUT_OF_CORE_MESHES is set, call the result to wait for it
+std::function<std::shared_ptr<const Renderable>()> sceneMeshAsync(const std::string &path)
 {
-    // load material and texture
-    MtlLoader mtlLoader("../res/model/model.mtl");
-    std::shared_ptr<Texture> tex = std::make_shared<Texture>("../res/models/rock/rock.png");
+    AssetManager &assets = AssetManager::instance();
+    if (OUT_OF_CORE_MESHES)
+    {
+        auto job = assets.outOfCoreMeshAsync(path);
+        return [job]
+        { return job.get(); };
+    }
+    auto job = assets.meshAsync(path);
+    return [job]
+    { return job.get(); };
+}
 
-    // load meshes, create primitives
-    ObjLoader loader;
-    ObjPtr rock = loader.load("../res/models/rock/rock.obj");
-    rock->transform(Vec3::Ones(),Vec3::Zero(),Vec3{-4.0,0.0,0.0});
-    ObjPtr bunny = loader.load("../res/models/bunny/bunny.obj");
+void setTestScene_ideal_hard(Scene &scene)
+{
+    // Start loading every asset in parallel, they are shared with the other scenes through the asset manager
+    AssetManager &assets = AssetManager::instance();
+    auto mtlsJob = assets.materialsAsync("../res/model/model.mtl");
+    auto texJob = assets.textureAsync("../res/models/rock/rock.png");
+    auto rockJob = sceneMeshAsync("../res/models/rock/rock.obj");
+    auto bunnyJob = sceneMeshAsync("../res/models/bunny/bunny.obj");
+    AssetManager::MaterialLibrary mtls = mtlsJob.get();
+    AssetManager::TextureHandle tex = texJob.get();
+
+    // create primitives
+    // Shared meshes are placed by instances instead of being transformed
+    ObjPtr rock = std::make_shared<Instance>(rockJob(), Vec3::Ones(), Vec3{-4.0, 0.0, 0.0});
+    ObjPtr bunny = std::make_shared<Instance>(bunnyJob());
     ObjPtr blackShpere = std::make_shared<Shpere>(Vec3{4.0, 1.0, 1.0}, 1.0);
     ObjPtr transparentShpere = std::make_shared<Shpere>(Vec3{2.5, 1.0, 3.0}, 1.0);
     ObjPtr mirrorSphere = std::make_shared<Shpere>(Vec3{-0.0, -46.0, -10.0}, 45.0);
 
+    // Edit copies, the loaded materials are shared
+    MtlPtr mirror = copyMaterial((*mtls)[3]);
+    MtlPtr glass = copyMaterial((*mtls)[1]);
+    MtlPtr greenGlass = copyMaterial((*mtls)[2]);
+
     // Set ideal mirror reflection material
-    mtlLoader.materials()[3]->setKm(mtlLoader.materials()[3]->ks()*1.52);
-    mtlLoader.materials()[3]->setNe(600.0);
-    mtlLoader.materials()[3]->setKd(Vec3{0.6,0.6,0.6});
-    mtlLoader.materials()[3]->setKa(Vec3{0.6,0.6,0.6});
-    mtlLoader.materials()[3]->setKs(Vec3{0.8,0.8,0.8});
+    mirror->setKm(mirror->ks()*1.52);
+    mirror->setNe(600.0);
+    mirror->setKd(Vec3{0.6,0.6,0.6});
+    mirror->setKa(Vec3{0.6,0.6,0.6});
+    mirror->setKs(Vec3{0.8,0.8,0.8});
 
     // Set transparent material
-    mtlLoader.materials()[1]->setKf(1.6f);
-    mtlLoader.materials()[1]->setAttenuateCoeff(Vec3{0.9f, 0.93, 0.9f});
-    mtlLoader.materials()[1]->setKa(Vec3{0.1, 0.1, 0.1});
-    mtlLoader.materials()[1]->setKd(Vec3{0.2, 0.2, 0.2});
-    mtlLoader.materials()[1]->setKs(Vec3{0.2, 0.2, 0.2f});
-
-    mtlLoader.materials()[2]->setKf(1.7);
-    mtlLoader.materials()[2]->setAttenuateCoeff(Vec3{0.2, 0.5, 0.2});
-    mtlLoader.materials()[2]->setKa(Vec3{0.1, 0.1, 0.1});
-    mtlLoader.materials()[2]->setKd(Vec3{0.1, 0.1, 0.1});
-    mtlLoader.materials()[2]->setKs(Vec3{0.5, 0.5, 0.5});
+    glass->setKf(1.6f);
+    glass->setAttenuateCoeff(Vec3{0.9f, 0.93, 0.9f});
+    glass->setKa(Vec3{0.1, 0.1, 0.1});
+    glass->setKd(Vec3{0.2, 0.2, 0.2});
+    glass->setKs(Vec3{0.2, 0.2, 0.2f});
+
+    greenGlass->setKf(1.7);
+    greenGlass->setAttenuateCoeff(Vec3{0.2, 0.5, 0.2});
+    greenGlass->setKa(Vec3{0.1, 0.1, 0.1});
+    greenGlass->setKd(Vec3{0.1, 0.1, 0.1});
+    greenGlass->setKs(Vec3{0.5, 0.5, 0.5});
 
     // Set material for objects
-    // blackShpere->setMaterial(mtlLoader.materials()[0]);
-    transparentShpere->setMaterial(mtlLoader.materials()[2]);
-    mirrorSphere->setMaterial(mtlLoader.materials()[3]);
-    rock->setMaterial(mtlLoader.materials()[0]);
+    // blackShpere->setMaterial((*mtls)[0]);
+    transparentShpere->setMaterial(greenGlass);
+    mirrorSphere->setMaterial(mirror);
+    rock->setMaterial((*mtls)[0]);
     rock->setTexture(tex);
-    bunny->setMaterial(mtlLoader.materials()[1]);
+    bunny->setMaterial(glass);
 
     // Add objects to scene
     scene.addObject(blackShpere);
@@ -97,46 +131,55 @@ void setTestScene_ideal_hard(Scene &scene)
 
 void setTestScene_ideal_soft(Scene &scene)
 {
-    // load material and texture
-    MtlLoader mtlLoader("../res/model/model.mtl");
-    std::shared_ptr<Texture> tex = std::make_shared<Texture>("../res/models/rock/rock.png");
-
-    // load meshes, create primitives
-    ObjLoader loader;
-    ObjPtr rock = loader.load("../res/models/rock/rock.obj");
-    rock->transform(Vec3::Ones(),Vec3::Zero(),Vec3{-4.0,0.0,0.0});
-    ObjPtr bunny = loader.load("../res/models/bunny/bunny.obj");
+    // Start loading every asset in parallel, they are shared with the other scenes through the asset manager
+    AssetManager &assets = AssetManager::instance();
+    auto mtlsJob = assets.materialsAsync("../res/model/model.mtl");
+    auto texJob = assets.textureAsync("../res/models/rock/rock.png");
+    auto rockJob = sceneMeshAsync("../res/models/rock/rock.obj");
+    auto bunnyJob = sceneMeshAsync("../res/models/bunny/bunny.obj");
+    AssetManager::MaterialLibrary mtls = mtlsJob.get();
+    AssetManager::TextureHandle tex = texJob.get();
+
+    // create primitives
+    // Shared meshes are placed by instances instead of being transformed
+    ObjPtr rock = std::make_shared<Instance>(rockJob(), Vec3::Ones(), Vec3{-4.0, 0.0, 0.0});
+    ObjPtr bunny = std::make_shared<Instance>(bunnyJob());
     ObjPtr blackShpere = std::make_shared<Shpere>(Vec3{4.0, 1.0, 1.0}, 1.0);
     ObjPtr transparentShpere = std::make_shared<Shpere>(Vec3{2.5, 1.0, 3.0}, 1.0);
     ObjPtr mirrorSphere = std::make_shared<Shpere>(Vec3{-0.0, -46.0, -10.0}, 45.0);
 
+    // Edit copies, the loaded materials are shared
+    MtlPtr mirror = copyMaterial((*mtls)[3]);
+    MtlPtr glass = copyMaterial((*mtls)[1]);
+    MtlPtr greenGlass = copyMaterial((*mtls)[2]);
+
     // Set ideal mirror reflection material
-    mtlLoader.materials()[3]->setKm(mtlLoader.materials()[3]->ks()*1.52);
-    mtlLoader.materials()[3]->setNe(600.0);
-    mtlLoader.materials()[3]->setKd(Vec3{0.6,0.6,0.6});
-    mtlLoader.materials()[3]->setKa(Vec3{0.6,0.6,0.6});
-    mtlLoader.materials()[3]->setKs(Vec3{0.8,0.8,0.8});
+    mirror->setKm(mirror->ks()*1.52);
+    mirror->setNe(600.0);
+    mirror->setKd(Vec3{0.6,0.6,0.6});
+    mirror->setKa(Vec3{0.6,0.6,0.6});
+    mirror->setKs(Vec3{0.8,0.8,0.8});
 
     // Set transparent material
-    mtlLoader.materials()[1]->setKf(1.6f);
-    mtlLoader.materials()[1]->setAttenuateCoeff(Vec3{0.9f, 0.93, 0.9f});
-    mtlLoader.materials()[1]->setKa(Vec3{0.1, 0.1, 0.1});
-    mtlLoader.materials()[1]->setKd(Vec3{0.2, 0.2, 0.2});
-    mtlLoader.materials()[1]->setKs(Vec3{0.2, 0.2, 0.2f});
-
-    mtlLoader.materials()[2]->setKf(1.7);
-    mtlLoader.materials()[2]->setAttenuateCoeff(Vec3{0.2, 0.5, 0.2});
-    mtlLoader.materials()[2]->setKa(Vec3{0.1, 0.1, 0.1});
-    mtlLoader.materials()[2]->setKd(Vec3{0.1, 0.1, 0.1});
-    mtlLoader.materials()[2]->setKs(Vec3{0.5, 0.5, 0.5});
+    glass->setKf(1.6f);
+    glass->setAttenuateCoeff(Vec3{0.9f, 0.93, 0.9f});
+    glass->setKa(Vec3{0.1, 0.1, 0.1});
+    glass->setKd(Vec3{0.2, 0.2, 0.2});
+    glass->setKs(Vec3{0.2, 0.2, 0.2f});
+
+    greenGlass->setKf(1.7);
+    greenGlass->setAttenuateCoeff(Vec3{0.2, 0.5, 0.2});
+    greenGlass->setKa(Vec3{0.1, 0.1, 0.1});
+    greenGlass->setKd(Vec3{0.1, 0.1, 0.1});
+    greenGlass->setKs(Vec3{0.5, 0.5, 0.5});
 
     // Set material for objects
-    // blackShpere->setMaterial(mtlLoader.materials()[0]);
-    transparentShpere->setMaterial(mtlLoader.materials()[2]);
-    mirrorSphere->setMaterial(mtlLoader.materials()[3]);
-    rock->setMaterial(mtlLoader.materials()[0]);
+    // blackShpere->setMaterial((*mtls)[0]);
+    transparentShpere->setMaterial(greenGlass);
+    mirrorSphere->setMaterial(mirror);
+    rock->setMaterial((*mtls)[0]);
     rock->setTexture(tex);
-    bunny->setMaterial(mtlLoader.materials()[1]);
+    bunny->setMaterial(glass);
 
     // Add objects to scene
     scene.addObject(blackShpere);
@@ -163,46 +206,55 @@ void setTestScene_ideal_soft(Scene &scene)
 
 void setTestScene_matte_soft(Scene &scene)
 {
-    // load material and texture
-    MtlLoader mtlLoader("../res/model/model.mtl");
-    std::shared_ptr<Texture> tex = std::make_shared<Texture>("../res/models/rock/rock.png");
-
-    // load meshes, create primitives
-    ObjLoader loader;
-    ObjPtr rock = loader.load("../res/models/rock/rock.obj");
-    rock->transform(Vec3::Ones(),Vec3::Zero(),Vec3{-4.0,0.0,0.0});
-    ObjPtr bunny = loader.load("../res/models/bunny/bunny.obj");
+    // Start loading every asset in parallel, they are shared with the other scenes through the asset manager
+    AssetManager &assets = AssetManager::instance();
+    auto mtlsJob = assets.materialsAsync("../res/model/model.mtl");
+    auto texJob = assets.textureAsync("../res/models/rock/rock.png");
+    auto rockJob = sceneMeshAsync("../res/models/rock/rock.obj");
+    auto bunnyJob = sceneMeshAsync("../res/models/bunny/bunny.obj");
+    AssetManager::MaterialLibrary mtls = mtlsJob.get();
+    AssetManager::TextureHandle tex = texJob.get();
+
+    // create primitives
+    // Shared meshes are placed by instances instead of being transformed
+    ObjPtr rock = std::make_shared<Instance>(rockJob(), Vec3::Ones(), Vec3{-4.0, 0.0, 0.0});
+    ObjPtr bunny = std::make_shared<Instance>(bunnyJob());
     ObjPtr blackShpere = std::make_shared<Shpere>(Vec3{4.0, 1.0, 1.0}, 1.0);
     ObjPtr transparentShpere = std::make_shared<Shpere>(Vec3{2.5, 1.0, 3.0}, 1.0);
     ObjPtr mirrorSphere = std::make_shared<Shpere>(Vec3{-0.0, -46.0, -10.0}, 45.0);
 
+    // Edit copies, the loaded materials are shared
+    MtlPtr mirror = copyMaterial((*mtls)[3]);
+    MtlPtr glass = copyMaterial((*mtls)[1]);
+    MtlPtr greenGlass = copyMaterial((*mtls)[2]);
+
     // Set ideal mirror reflection material
-    mtlLoader.materials()[3]->setKm(mtlLoader.materials()[3]->ks()*1.52);
-    mtlLoader.materials()[3]->setG(0.08);
-    mtlLoader.materials()[3]->setNe(600.0);
-    mtlLoader.materials()[3]->setKd(Vec3{0.6,0.6,0.6});
-    mtlLoader.materials()[3]->setKa(Vec3{0.6,0.6,0.6});
-    mtlLoader.materials()[3]->setKs(Vec3{0.8,0.8,0.8});
+    mirror->setKm(mirror->ks()*1.52);
+    mirror->setG(0.08);
+    mirror->setNe(600.0);
+    mirror->setKd(Vec3{0.6,0.6,0.6});
+    mirror->setKa(Vec3{0.6,0.6,0.6});
+    mirror->setKs(Vec3{0.8,0.8,0.8});
 
     // Set transparent material
-    mtlLoader.materials()[1]->setKf(1.6f);
-    mtlLoader.materials()[1]->setAttenuateCoeff(Vec3{0.9f, 0.93, 0.9f});
-    mtlLoader.materials()[1]->setKa(Vec3{0.1, 0.1, 0.1});
-    mtlLoader.materials()[1]->setKd(Vec3{0.2, 0.2, 0.2});
-    mtlLoader.materials()[1]->setKs(Vec3{0.2, 0.2, 0.2f});
-
-    mtlLoader.materials()[2]->setKf(1.7);
-    mtlLoader.materials()[2]->setAttenuateCoeff(Vec3{0.2, 0.5, 0.2});
-    mtlLoader.materials()[2]->setKa(Vec3{0.1, 0.1, 0.1});
-    mtlLoader.materials()[2]->setKd(Vec3{0.1, 0.1, 0.1});
-    mtlLoader.materials()[2]->setKs(Vec3{0.5, 0.5, 0.5});
+    glass->setKf(1.6f);
+    glass->setAttenuateCoeff(Vec3{0.9f, 0.93, 0.9f});
+    glass->setKa(Vec3{0.1, 0.1, 0.1});
+    glass->setKd(Vec3{0.2, 0.2, 0.2});
+    glass->setKs(Vec3{0.2, 0.2, 0.2f});
+
+    greenGlass->setKf(1.7);
+    greenGlass->setAttenuateCoeff(Vec3{0.2, 0.5, 0.2});
+    greenGlass->setKa(Vec3{0.1, 0.1, 0.1});
+    greenGlass->setKd(Vec3{0.1, 0.1, 0.1});
+    greenGlass->setKs(Vec3{0.5, 0.5, 0.5});
 
     // Set material for objects
-    transparentShpere->setMaterial(mtlLoader.materials()[2]);
-    mirrorSphere->setMaterial(mtlLoader.materials()[3]);
-    rock->setMaterial(mtlLoader.materials()[0]);
+    transparentShpere->setMaterial(greenGlass);
+    mirrorSphere->setMaterial(mirror);
+    rock->setMaterial((*mtls)[0]);
     rock->setTexture(tex);
-    bunny->setMaterial(mtlLoader.materials()[1]);
+    bunny->setMaterial(glass);
 
     // Add objects to scene
     scene.addObject(blackShpere);
@@ -227,22 +279,461 @@ void setTestScene_matte_soft(Scene &scene)
     scene.addLight(light4);
 }
 
-void renderScene(void (*setter)(Scene &))
+// resume continues from the checkpoint a killed render left behind, if there is one
+void renderScene(void (*setter)(Scene &), bool resume = false)
 {
-    ImageEncoder writer(FILM_WIDTH, FILM_HEIGHT, "../imout.ppm");
+    ImageEncoder writer(FILM_WIDTH, FILM_HEIGHT, OUTPUT_FILE);
     CameraPtr camera = initCamera();
     Scene scene;
     scene.setCamera(camera);
 
     setter(scene);
+    AssetManager::instance().printMemoryReport();
+    MemoryTracker::instance().printReport();
+
+    if (STREAM_OUTPUT)
+    {
+        ImageStream stream(FILM_WIDTH, FILM_HEIGHT, OUTPUT_FILE);
+        scene.render(&stream);
+    }
+    else
+    {
+        std::filesystem::create_directories(std::filesystem::path(CHECKPOINT_FILE).parent_path());
+        scene.setCheckpoint(CHECKPOINT_FILE, CHECKPOINT_INTERVAL_SECONDS);
+        scene.setRenderAOVs(DENOISE);
+        if (resume && !scene.resume(CHECKPOINT_FILE))
+            printf("No checkpoint at %s, rendering from the start\n", CHECKPOINT_FILE);
+        scene.render();
+        if (DENOISE)
+            AtrousDenoiser().denoise(scene.frameBuffer(), scene.aovs(), FILM_WIDTH, FILM_HEIGHT, scene.frameBuffer());
+        writer.write(scene.frameBuffer());
+    }
+    TextureCache::instance().printStats();
+    AssetManager::instance().printStats();
+    MemoryTracker::instance().printReport();
+}
+
+// Tiles are rendered by nWorkers processes that each load the scene once
+void renderSceneDistributed(void (*setter)(Scene &), int nWorkers)
+{
+    RenderCoordinator coordinator([setter](Scene &scene)
+                                  {
+                                      scene.setCamera(initCamera());
+                                      setter(scene); },
+                                  nWorkers);
+    TrackedVector<Vec3, MemTag::Framebuffer> image(std::size_t(FILM_WIDTH) * FILM_HEIGHT);
+    auto t0 = std::chrono::high_resolution_clock::now();
+    coordinator.render(FILM_WIDTH, FILM_HEIGHT, image.data());
+    auto t1 = std::chrono::high_resolution_clock::now();
+    printf("Rendered in %.2fs\n", std::chrono::duration<double>(t1 - t0).count());
+    coordinator.printStats();
+    ImageEncoder(FILM_WIDTH, FILM_HEIGHT, OUTPUT_FILE).write(image.data());
+}
+
+// Load the scene once and render the jobs clients send to SERVER_SOCKET, see RenderServer
+void serveScene(void (*setter)(Scene &))
+{
+    Scene scene;
+    scene.setCamera(initCamera());
+    setter(scene);
+    scene.compileMaterials();
+    AssetManager::instance().printMemoryReport();
+    std::filesystem::create_directories(std::filesystem::path(SERVER_SOCKET).parent_path());
+    RenderServer(scene).run(SERVER_SOCKET);
+    TextureCache::instance().printStats();
+}
+
+// Render once keeping the primary hits, then halve every light and shade the cached hits again
+void relightScene(void (*setter)(Scene &))
+{
+    Scene scene;
+    scene.setCamera(initCamera());
+    setter(scene);
+    scene.setCacheGBuffer(true);
+    auto t0 = std::chrono::high_resolution_clock::now();
+    scene.render();
+    auto t1 = std::chrono::high_resolution_clock::now();
+    ImageEncoder(FILM_WIDTH, FILM_HEIGHT, OUTPUT_FILE).write(scene.frameBuffer());
+    for (const LightPtr &light : scene.lights())
+        light->setIntensity(light->intensity() * 0.5);
+    auto t2 = std::chrono::high_resolution_clock::now();
+    scene.relight();
+    auto t3 = std::chrono::high_resolution_clock::now();
+    ImageEncoder(FILM_WIDTH, FILM_HEIGHT, RELIGHT_OUTPUT).write(scene.frameBuffer());
+    printf("Render %.2fs, relight %.2fs\n", std::chrono::duration<double>(t1 - t0).count(), std::chrono::duration<double>(t3 - t2).count());
+    MemoryTracker::instance().printReport();
+}
 
+// Render once recording which objects each tile's rays hit, then move a sphere and render
+// only the tiles it may have changed again
+void editScene(void (*setter)(Scene &))
+{
+    Scene scene;
+    scene.setCamera(initCamera());
+    setter(scene);
+    ObjPtr sphere = std::make_shared<Shpere>(Vec3{-2.0, 1.0, 3.0}, 0.6);
+    MtlPtr red = std::make_shared<Material>();
+    red->setKd(Vec3{0.8, 0.1, 0.1});
+    sphere->setMaterial(red);
+    scene.addObject(sphere);
+    scene.setTrackTiles(true);
+    auto t0 = std::chrono::high_resolution_clock::now();
     scene.render();
-    writer.write(scene.frameBuffer());
+    auto t1 = std::chrono::high_resolution_clock::now();
+    ImageEncoder(FILM_WIDTH, FILM_HEIGHT, OUTPUT_FILE).write(scene.frameBuffer());
+    sphere->transform(Vec3::Ones(), Vec3::Zero(), Vec3{0.5, 0.0, 0.0});
+    scene.objectChanged(sphere);
+    auto t2 = std::chrono::high_resolution_clock::now();
+    int nTiles = scene.renderDirty();
+    auto t3 = std::chrono::high_resolution_clock::now();
+    ImageEncoder(FILM_WIDTH, FILM_HEIGHT, EDIT_OUTPUT).write(scene.frameBuffer());
+    printf("Render %.2fs, %d dirty tiles rendered again in %.2fs\n", std::chrono::duration<double>(t1 - t0).count(), nTiles,
+           std::chrono::duration<double>(t3 - t2).count());
+}
+
+// Low-resolution direct-lighting passes refined up to the film, then the full-quality render, all written to PREVIEW_OUTPUT
+void previewScene(void (*setter)(Scene &))
+{
+    CameraPtr camera = initCamera();
+    Scene scene;
+    scene.setCamera(camera);
+    setter(scene);
+    PreviewRenderer().render(scene, camera, PREVIEW_OUTPUT, true);
 }
 
-int main()
+// Render nFrames along the camera path in pathFile, or around the scene's center if there is none
+void animateScene(void (*setter)(Scene &), const std::string &pathFile, int nFrames)
 {
-    renderScene(setTestScene_matte_soft);
+    Scene scene;
+    scene.setCamera(initCamera());
+    setter(scene);
+    AssetManager::instance().printMemoryReport();
+
+    CameraPath path;
+    if (!pathFile.empty())
+        path.load(pathFile);
+    else
+        for (int k = 0; k <= 8; k++)
+        {
+            double angle = 2.0 * M_PI * k / 8;
+            Vec3 pos{CAMERA_POS[2] * std::sin(angle), CAMERA_POS[1], CAMERA_POS[2] * std::cos(angle)};
+            path.addKey({double(k), pos, Vec3{0.0, 0.0, 0.0} - pos});
+        }
+    std::filesystem::create_directories(std::filesystem::path(ANIMATION_OUTPUT).parent_path());
+    AnimationRenderer().render(scene, path, nFrames, ANIMATION_OUTPUT);
+    TextureCache::instance().printStats();
+}
+
+// Long thin triangles scattered over a thin layer, like grass or cables on terrain
+// Their bounding boxes overlap heavily, which is where spatial splits pay off
+MeshPtr makeSliverMesh(int n = 20000, double length = 1.0)
+{
+    std::mt19937_64 gen(7);
+    std::uniform_real_distribution<double> distrib(-1.0, 1.0);
+    MeshPtr mesh = std::make_shared<Mesh>();
+    for (int i = 0; i < n; i++)
+    {
+        Vec3 center{5.0 * distrib(gen), 0.2 * distrib(gen), 5.0 * distrib(gen)};
+        Vec3 dir = Vec3{distrib(gen), 0.0, distrib(gen)}.normalized() * length;
+        Vec3 side = dir.cross(Vec3::UnitY()).normalized() * 0.01 + Vec3::UnitY() * 0.01;
+        mesh->appendTriangle(center - dir, center + dir, center - dir + side);
+    }
+    return mesh;
+}
+
+// Rays from a sphere around a box towards random points inside it
+std::vector<Ray> benchmarkRays(const AABB &aabb, int nRays)
+{
+    std::vector<Ray> rays;
+    std::mt19937_64 gen(2023);
+    std::uniform_real_distribution<double> distrib(-1.0, 1.0);
+    Vec3 center = aabb.centroid(), len = aabb.len();
+    for (int i = 0; i < nRays; i++)
+    {
+        Vec3 orig = center + Vec3{distrib(gen), distrib(gen), distrib(gen)}.normalized() * len.norm() * 2.0;
+        Vec3 target = center + Vec3{distrib(gen), distrib(gen), distrib(gen)}.cwiseProduct(len) * 0.5;
+        rays.emplace_back(orig, target - orig);
+    }
+    return rays;
+}
+
+// Trace the same random rays through every BVH layout of a mesh
+// Reports build time, ray throughput, BVH memory and hits differing from the first layout
+void benchmarkBVH(const std::string &name, MeshPtr mesh, int nRays = 500000)
+{
+    struct Layout
+    {
+        int width;
+        int quantBits;
+        BVHBuilder builder;
+        const char *builderName;
+    };
+    const Layout layouts[] = {
+        {2, 0, BVHBuilder::Midpoint, "midpoint"},
+        {4, 0, BVHBuilder::Midpoint, "midpoint"},
+        {8, 0, BVHBuilder::Midpoint, "midpoint"},
+        {4, 8, BVHBuilder::Midpoint, "midpoint"},
+        {8, 8, BVHBuilder::Midpoint, "midpoint"},
+        {4, 16, BVHBuilder::Midpoint, "midpoint"},
+        {8, 16, BVHBuilder::Midpoint, "midpoint"},
+        {2, 0, BVHBuilder::SAH, "SAH"},
+        {8, 0, BVHBuilder::SAH, "SAH"},
+        {2, 0, BVHBuilder::Spatial, "spatial"},
+        {8, 0, BVHBuilder::Spatial, "spatial"},
+        {8, 8, BVHBuilder::Spatial, "spatial"},
+    };
+
+    std::vector<Ray> rays = benchmarkRays(mesh->aabb(), nRays);
+    std::vector<double> reference;
+    for (const Layout &layout : layouts)
+    {
+        mesh->setBVHWidth(layout.width);
+        mesh->setBVHQuantBits(layout.quantBits);
+        mesh->setBVHBuilder(layout.builder);
+        auto t0 = std::chrono::steady_clock::now();
+        mesh->buildBVH();
+        auto t1 = std::chrono::steady_clock::now();
+
+        std::vector<double> t(rays.size());
+        auto t2 = std::chrono::steady_clock::now();
+        for (int i = 0; i < rays.size(); i++)
+            t[i] = mesh->intersect(rays[i]).t;
+        auto t3 = std::chrono::steady_clock::now();
+
+        int mismatch = 0;
+        if (reference.empty())
+            reference = t;
+        for (int i = 0; i < rays.size(); i++)
+            if (t[i] != reference[i] && std::abs(t[i] - reference[i]) > EPS)
+                mismatch++;
+
+        double buildTime = std::chrono::duration<double>(t1 - t0).count();
+        double traceTime = std::chrono::duration<double>(t3 - t2).count();
+        printf("%s %-8s width %d quant %2d: build %.3fs, %.3f Mrays/s, BVH %.1f KB, %d mismatches\n",
+               name.c_str(), layout.builderName, layout.width, layout.quantBits, buildTime, rays.size() / traceTime / 1e6,
+               mesh->bvhMemoryBytes() / 1024.0, mismatch);
+    }
+}
+
+// Page a mesh from disk under shrinking geometry budgets and compare its hits with the in-core mesh
+void benchmarkOutOfCore(const std::string &name, MeshPtr mesh, int nRays = 200000)
+{
+    std::string path = name + ".oocm";
+    mesh->setBVHWidth(8);
+    mesh->setBVHQuantBits(0);
+    mesh->setBVHBuilder(BVHBuilder::SAH);
+    mesh->buildBVH();
+    OutOfCoreMesh::write(*mesh, path, 1024);
+
+    std::vector<Ray> rays = benchmarkRays(mesh->aabb(), nRays);
+    std::vector<double> reference(rays.size());
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < rays.size(); i++)
+        reference[i] = mesh->intersect(rays[i]).t;
+    auto t1 = std::chrono::steady_clock::now();
+    printf("%s in-core: %.3f Mrays/s, BVH %.1f KB\n", name.c_str(),
+           rays.size() / std::chrono::duration<double>(t1 - t0).count() / 1e6, mesh->bvhMemoryBytes() / 1024.0);
+
+    std::size_t total = OutOfCoreMesh(path).totalBytes();
+    for (int fraction : {1, 2, 4})
+    {
+        std::size_t budget = total / fraction;
+        OutOfCoreMesh ooc(path, budget);
+        std::vector<double> t(rays.size());
+        auto t2 = std::chrono::steady_clock::now();
+        for (int i = 0; i < rays.size(); i++)
+            t[i] = ooc.intersect(rays[i]).t;
+        auto t3 = std::chrono::steady_clock::now();
+
+        int mismatch = 0;
+        for (int i = 0; i < rays.size(); i++)
+            if (t[i] != reference[i] && std::abs(t[i] - reference[i]) > EPS)
+                mismatch++;
+        OutOfCoreMesh::Stats stats = ooc.stats();
+        printf("%s out-of-core budget %.1f KB: %.3f Mrays/s, %zu clusters, %llu loads, %llu evictions, peak %.1f KB, %d mismatches\n",
+               name.c_str(), budget / 1024.0, rays.size() / std::chrono::duration<double>(t3 - t2).count() / 1e6, ooc.numClusters(),
+               (unsigned long long)stats.loads, (unsigned long long)stats.evictions, stats.peakBytes / 1024.0, mismatch);
+    }
+    std::remove(path.c_str());
+}
+
+// Diffuse and specular terms of random hits under one light, per hit in double precision with
+// std::pow as PhongShader does for secondary hits, and through the SIMD batch kernel
+// Reports hits per second of both and the largest relative error of the kernel and of fastmath::pow,
+// scalar and through the kernel's SIMD path
+void benchmarkShading(int nHits = 1 << 20, int repeat = 8)
+{
+    std::mt19937_64 gen(2023);
+    std::uniform_real_distribution<double> distrib(-1.0, 1.0), unit(0.0, 1.0);
+    auto randomDir = [&]()
+    { return Vec3{distrib(gen), distrib(gen), distrib(gen)}.normalized(); };
+
+    PhongBatch batch;
+    batch.resize(nHits);
+    std::vector<Vec3> N(nHits), V(nHits), L(nHits), I(nHits), kd(nHits), ks(nHits);
+    std::vector<double> ne(nHits);
+    for (int k = 0; k < nHits; k++)
+    {
+        N[k] = randomDir();
+        // views and lights mostly in the upper hemisphere, bent towards the reflection so highlights show up
+        V[k] = (randomDir() + 1.5 * N[k]).normalized();
+        L[k] = (2.0 * N[k].dot(V[k]) * N[k] - V[k] + 0.3 * randomDir()).normalized();
+        I[k] = Vec3{unit(gen), unit(gen), unit(gen)};
+        kd[k] = Vec3{unit(gen), unit(gen), unit(gen)};
+        ks[k] = Vec3{unit(gen), unit(gen), unit(gen)};
+        ne[k] = std::pow(1000.0, unit(gen));
+        batch.nx[k] = N[k][0], batch.ny[k] = N[k][1], batch.nz[k] = N[k][2];
+        batch.vx[k] = V[k][0], batch.vy[k] = V[k][1], batch.vz[k] = V[k][2];
+        batch.lx[k] = L[k][0], batch.ly[k] = L[k][1], batch.lz[k] = L[k][2];
+        batch.ir[k] = I[k][0], batch.ig[k] = I[k][1], batch.ib[k] = I[k][2];
+        batch.kdr[k] = kd[k][0], batch.kdg[k] = kd[k][1], batch.kdb[k] = kd[k][2];
+        batch.ksr[k] = ks[k][0], batch.ksg[k] = ks[k][1], batch.ksb[k] = ks[k][2];
+        batch.ne[k] = ne[k];
+    }
+
+    std::vector<Vec3> reference(nHits);
+    auto t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeat; r++)
+        for (int k = 0; k < nHits; k++)
+        {
+            double cosTheta = std::max(0.0, N[k].dot(L[k]));
+            double cosAlpha = std::pow(std::max(0.0, N[k].dot((L[k] + V[k]).normalized())), ne[k]);
+            reference[k] = kd[k].cwiseProduct(I[k]) * cosTheta + ks[k].cwiseProduct(I[k]) * cosAlpha;
+        }
+    auto t1 = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeat; r++)
+    {
+        batch.clearOutput();
+        batch.evaluate();
+    }
+    auto t2 = std::chrono::steady_clock::now();
+
+    double maxError = 0.0;
+    for (int k = 0; k < nHits; k++)
+    {
+        Vec3 color{batch.outR[k], batch.outG[k], batch.outB[k]};
+        maxError = std::max(maxError, (color - reference[k]).cwiseAbs().maxCoeff() / std::max(reference[k].maxCoeff(), 1e-3));
+    }
+    double maxPowError = 0.0, maxSIMDPowError = 0.0;
+    for (double p = 1.0; p <= 1000.0; p *= 1.01)
+        for (double x = 1e-6; x <= 1.0; x *= 1.001)
+        {
+            double exact = std::pow(double(float(x)), double(float(p)));
+            if (exact > 1e-30)
+            {
+                maxPowError = std::max(maxPowError, std::abs(fastmath::pow(float(x), float(p)) - exact) / exact);
+                maxSIMDPowError = std::max(maxSIMDPowError, std::abs(fastPowSIMD(float(x), float(p)) - exact) / exact);
+            }
+        }
+
+    double scalarTime = std::chrono::duration<double>(t1 - t0).count(), batchTime = std::chrono::duration<double>(t2 - t1).count();
+    printf("shading %d hits: scalar %.2f Mhits/s, batch(%s) %.2f Mhits/s, max relative error %.2e, "
+           "fastmath::pow max relative error %.2e scalar, %.2e SIMD\n",
+           nHits, nHits * repeat / scalarTime / 1e6, cpuHasAVX2FMA() ? "AVX2" : "SSE", nHits * repeat / batchTime / 1e6, maxError,
+           maxPowError, maxSIMDPowError);
+}
+
+// Time the test scenes' asset loads issued one after another, waiting on each, or all at once on the
+// asset manager's pool, run each mode in a fresh process since loaded assets stay in the manager
+void benchmarkAssetLoading(bool async)
+{
+    AssetManager &assets = AssetManager::instance();
+    auto t0 = std::chrono::steady_clock::now();
+    if (async)
+    {
+        auto mtlsJob = assets.materialsAsync("../res/model/model.mtl");
+        auto texJob = assets.textureAsync("../res/models/rock/rock.png");
+        auto rockJob = assets.meshAsync("../res/models/rock/rock.obj");
+        auto bunnyJob = assets.meshAsync("../res/models/bunny/bunny.obj");
+        mtlsJob.wait(), texJob.wait(), rockJob.wait(), bunnyJob.wait();
+    }
+    else
+    {
+        // Each load on its own, the longest one bounds the async setup given enough cores
+        auto timed = [](const char *name, auto load)
+        {
+            auto start = std::chrono::steady_clock::now();
+            load();
+            printf("  %-8s %.1f ms\n", name, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        };
+        timed("mtl", [&]
+              { assets.materials("../res/model/model.mtl"); });
+        timed("texture", [&]
+              { assets.texture("../res/models/rock/rock.png"); });
+        timed("rock", [&]
+              { assets.mesh("../res/models/rock/rock.obj"); });
+        timed("bunny", [&]
+              { assets.mesh("../res/models/bunny/bunny.obj"); });
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    printf("asset setup(%s, %u hardware threads): %.1f ms\n", async ? "async" : "serial", std::thread::hardware_concurrency(),
+           std::chrono::duration<double, std::milli>(t1 - t0).count());
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && std::string(argv[1]) == "--bench-bvh")
+    {
+        ObjLoader loader;
+        benchmarkBVH("bunny", loader.load("../res/models/bunny/bunny.obj"));
+        benchmarkBVH("spot", loader.load("../res/models/spot/spot_triangulated.obj"));
+        benchmarkBVH("slivers", makeSliverMesh(), 20000);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--bench-ooc")
+    {
+        ObjLoader loader;
+        benchmarkOutOfCore("bunny", loader.load("../res/models/bunny/bunny.obj"));
+        benchmarkOutOfCore("spot", loader.load("../res/models/spot/spot_triangulated.obj"));
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--bench-assets")
+    {
+        // --bench-assets [serial|async]
+        benchmarkAssetLoading(!(argc > 2 && std::string(argv[2]) == "serial"));
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--bench-shading")
+    {
+        benchmarkShading();
+        return 0;
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--relight")
+    {
+        relightScene(setTestScene_matte_soft);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--preview")
+    {
+        previewScene(setTestScene_matte_soft);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--edit")
+    {
+        editScene(setTestScene_matte_soft);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--animate")
+    {
+        // --animate [camera path file] [frames]
+        std::string pathFile = argc > 2 ? argv[2] : "";
+        int nFrames = argc > 3 ? std::stoi(argv[3]) : ANIMATION_FRAMES;
+        animateScene(setTestScene_matte_soft, pathFile == "-" ? "" : pathFile, nFrames);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--serve")
+    {
+        serveScene(setTestScene_matte_soft);
+        return 0;
+    }
+    if (argc > 2 && std::string(argv[1]) == "--workers")
+    {
+        renderSceneDistributed(setTestScene_matte_soft, std::stoi(argv[2]));
+        return 0;
+    }
+
+    renderScene(setTestScene_matte_soft, argc > 1 && std::string(argv[1]) == "--resume");
 
     return 0;
 }
\ No newline at end of file
@@ -3,12 +3,61 @@
 #include <string>
 #include "texture.hpp"
 #include <memory>
+#include <atomic>
+#include <cstdint>
+
+// Shading kernel a material compiles to, see PhongShader::shade
+enum class MaterialType : uint8_t
+{
+    Diffuse,      // local Phong illumination only
+    GlossyMirror, // Phong plus a mirror reflection jittered by g
+    Dielectric,   // Phong plus Fresnel weighted reflection and refraction
+    Emissive,     // pure emitter, no reflectance so no light is gathered
+    Count
+};
+
+// Flat copy of a material's parameters, stored by value in a MaterialTable
+struct MaterialRecord
+{
+    using Vec3 = Eigen::Vector3d;
+
+    MaterialType type;
+    Vec3 ka, kd, ks, ke, km;
+    Vec3 attenuateCoeff;
+    double ne, g, kf;
+};
+
+// Process-unique identity of a material, a copy is a new material
+class MaterialId
+{
+private:
+    uint32_t _value;
+
+    static uint32_t _next()
+    {
+        static std::atomic<uint32_t> next{1}; // 0 stands for the default material
+        return next.fetch_add(1, std::memory_order_relaxed);
+    }
+
+public:
+    MaterialId() : _value(_next()){};
+    MaterialId(const MaterialId &) : _value(_next()){};
+    MaterialId &operator=(const MaterialId &)
+    {
+        return *this;
+    }
+    inline operator uint32_t() const
+    {
+        return _value;
+    }
+};
 
 class Material
 {
     using Vec3 = Eigen::Vector3d;
 
 private:
+    MaterialId _id;
     std::string _name;
     Vec3 _ka = {1.0, 1.0, 1.0};
     Vec3 _kd = {1.0, 1.0, 1.0};
@@ -21,12 +70,50 @@ private:
     Vec3 _attenuateCoeff = {0.1, 0.1, 0.1}; // only for transparent material
     std::shared_ptr<Texture> _texture = nullptr;
 
+private:
+    static std::atomic<uint64_t> &_editCounter()
+    {
+        static std::atomic<uint64_t> edits{0};
+        return edits;
+    }
+
 public:
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW;
     Material(){};
     Material(const std::string &name, const Vec3 &ka, const Vec3 &kd, const Vec3 &ks) : _name(name), _ka(ka), _kd(kd), _ks(ks){};
 
 public:
+    inline uint32_t id() const
+    {
+        return _id;
+    }
+    // Counts edits of every material and material assignment in the process, compiled tables
+    // are up to date while it has not moved
+    static uint64_t edits()
+    {
+        return _editCounter().load(std::memory_order_relaxed);
+    }
+    static void touch()
+    {
+        _editCounter().fetch_add(1, std::memory_order_relaxed);
+    }
+    // Parameters and kernel type as the renderer sees them
+    MaterialRecord record() const
+    {
+        MaterialRecord r;
+        if (_km.maxCoeff() > 0.01)
+            r.type = MaterialType::GlossyMirror;
+        else if (_kf > 0.01)
+            r.type = MaterialType::Dielectric;
+        else if (_ke.maxCoeff() > 0.0 && _ka.isZero() && _kd.isZero() && _ks.isZero())
+            r.type = MaterialType::Emissive;
+        else
+            r.type = MaterialType::Diffuse;
+        r.ka = _ka, r.kd = _kd, r.ks = _ks, r.ke = _ke, r.km = _km;
+        r.attenuateCoeff = _attenuateCoeff;
+        r.ne = _ne, r.g = _g, r.kf = _kf;
+        return r;
+    }
     inline const std::string &name() const
     {
         return _name;
@@ -74,38 +161,47 @@ public:
     void setKa(const Vec3 &ka)
     {
         _ka = ka;
+        touch();
     }
     void setKd(const Vec3 &kd)
     {
         _kd = kd;
+        touch();
     }
     void setKs(const Vec3 &ks)
     {
         _ks = ks;
+        touch();
     }
     void setKe(const Vec3 &ke)
     {
         _ke = ke;
+        touch();
     }
     void setKm(const Vec3 &km)
     {
         _km = km;
+        touch();
     }
     void setAttenuateCoeff(const Vec3 &att)
     {
         _attenuateCoeff = att;
+        touch();
     }
     void setKf(double kf)
     {
         _kf = kf;
+        touch();
     }
     void setNe(double ne)
     {
         _ne = ne;
+        touch();
     }
     void setG(double g)
     {
         _g = g;
+        touch();
     }
     void setTexture(std::shared_ptr<Texture> texture)
     {
@@ -0,0 +1,50 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include "material.hpp"
+#include "memory_tracker.hpp"
+
+// Materials of a scene compiled into a flat array of records
+// Hits carry a material id, shading reads the record by value instead of going through the Material
+class MaterialTable
+{
+    using MtlPtr = std::shared_ptr<const Material>;
+
+private:
+    TrackedVector<MaterialRecord, MemTag::Geometry> _records; // _records[0] is DEFAULT_MATERIAL
+    TrackedVector<uint32_t, MemTag::Geometry> _slots;         // material id to record, 0 for unknown ids
+
+public:
+    MaterialTable()
+    {
+        _records.push_back(DEFAULT_MATERIAL->record());
+    };
+
+public:
+    // Rebuild from the materials reachable in a scene, duplicates are fine
+    void compile(const std::vector<MtlPtr> &materials)
+    {
+        _records.resize(1);
+        _records[0] = DEFAULT_MATERIAL->record();
+        _slots.clear();
+        for (const MtlPtr &mtl : materials)
+        {
+            if (mtl->id() >= _slots.size())
+                _slots.resize(mtl->id() + 1, 0);
+            if (_slots[mtl->id()] || mtl == DEFAULT_MATERIAL)
+                continue;
+            _slots[mtl->id()] = _records.size();
+            _records.push_back(mtl->record());
+        }
+    }
+    inline const MaterialRecord &operator[](uint32_t id) const
+    {
+        return _records[id < _slots.size() ? _slots[id] : 0];
+    }
+    inline std::size_t size() const
+    {
+        return _records.size();
+    }
+};
\ No newline at end of file
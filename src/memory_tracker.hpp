@@ -0,0 +1,140 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <new>
+#include <vector>
+
+// Subsystems heap memory is charged to
+enum class MemTag
+{
+    Geometry,    // triangles and the primitive lists of meshes
+    BVH,         // nodes, leaf references and leaf triangle data of every BVH layout
+    Textures,    // resident texture pages
+    Framebuffer, // accumulated pixel colors
+    Scratch,     // per-thread render scratch
+    Count
+};
+
+// Process-wide byte counters per subsystem, with the high-water mark of each and of their sum
+// Counters are updated where memory is obtained from or returned to the heap, so they
+// report what the renderer holds rather than what its containers currently use
+class MemoryTracker
+{
+private:
+    constexpr static int N_TAGS = int(MemTag::Count);
+    std::atomic<std::size_t> _current[N_TAGS] = {};
+    std::atomic<std::size_t> _peak[N_TAGS] = {};
+    std::atomic<std::size_t> _total{0};
+    std::atomic<std::size_t> _peakTotal{0};
+
+private:
+    MemoryTracker(){};
+
+    static void _raise(std::atomic<std::size_t> &peak, std::size_t value)
+    {
+        std::size_t old = peak.load(std::memory_order_relaxed);
+        while (old < value && !peak.compare_exchange_weak(old, value, std::memory_order_relaxed))
+            ;
+    }
+
+public:
+    static MemoryTracker &instance()
+    {
+        static MemoryTracker tracker;
+        return tracker;
+    }
+    static const char *name(MemTag tag)
+    {
+        static const char *names[N_TAGS] = {"geometry", "BVH", "textures", "framebuffer", "scratch"};
+        return names[int(tag)];
+    }
+
+public:
+    void allocated(MemTag tag, std::size_t bytes)
+    {
+        std::size_t current = _current[int(tag)].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        std::size_t total = _total.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        _raise(_peak[int(tag)], current);
+        _raise(_peakTotal, total);
+    }
+    void freed(MemTag tag, std::size_t bytes)
+    {
+        _current[int(tag)].fetch_sub(bytes, std::memory_order_relaxed);
+        _total.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    inline std::size_t current(MemTag tag) const
+    {
+        return _current[int(tag)].load(std::memory_order_relaxed);
+    }
+    inline std::size_t peak(MemTag tag) const
+    {
+        return _peak[int(tag)].load(std::memory_order_relaxed);
+    }
+    inline std::size_t current() const
+    {
+        return _total.load(std::memory_order_relaxed);
+    }
+    inline std::size_t peak() const
+    {
+        return _peakTotal.load(std::memory_order_relaxed);
+    }
+    // Start a new high-water mark from the current usage, e.g. before rendering
+    void resetPeak()
+    {
+        for (int i = 0; i < N_TAGS; i++)
+            _peak[i].store(_current[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        _peakTotal.store(_total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    void printReport() const
+    {
+        printf("Memory         current        peak\n");
+        for (int i = 0; i < N_TAGS; i++)
+            printf("  %-11s %9.2f MB %9.2f MB\n", name(MemTag(i)), current(MemTag(i)) / 1048576.0, peak(MemTag(i)) / 1048576.0);
+        printf("  %-11s %9.2f MB %9.2f MB\n", "total", current() / 1048576.0, peak() / 1048576.0);
+    }
+};
+
+// Standard allocator charging a subsystem, for containers whose size matters
+template <typename T, MemTag Tag>
+struct TrackedAllocator
+{
+    using value_type = T;
+    template <typename U>
+    struct rebind
+    {
+        using other = TrackedAllocator<U, Tag>;
+    };
+
+    TrackedAllocator() = default;
+    template <typename U>
+    TrackedAllocator(const TrackedAllocator<U, Tag> &) {}
+
+    T *allocate(std::size_t n)
+    {
+        T *p = std::allocator<T>().allocate(n);
+        MemoryTracker::instance().allocated(Tag, n * sizeof(T));
+        return p;
+    }
+    void deallocate(T *p, std::size_t n)
+    {
+        MemoryTracker::instance().freed(Tag, n * sizeof(T));
+        std::allocator<T>().deallocate(p, n);
+    }
+    template <typename U>
+    bool operator==(const TrackedAllocator<U, Tag> &) const
+    {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const TrackedAllocator<U, Tag> &) const
+    {
+        return false;
+    }
+};
+
+template <typename T, MemTag Tag>
+using TrackedVector = std::vector<T, TrackedAllocator<T, Tag>>;
\ No newline at end of file
@@ -0,0 +1,325 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <eigen3/Eigen/Core>
+#include "renderable.hpp"
+#include "bvh.hpp"
+#include "wide_bvh.hpp"
+#include "compressed_bvh.hpp"
+#include "arena.hpp"
+#include <variant>
+#include <mutex>
+
+// Triangles appended by position and the binary BVH nodes live in the mesh's arenas,
+// so loading allocates in bulk and destroying a mesh frees it all at once
+class Mesh final : public Renderable
+{
+    using Vec3 = Eigen::Vector3d;
+    using MtlPtr = std::shared_ptr<const Material>;
+    using TexPtr = std::shared_ptr<const Texture>;
+    using ObjPtr = std::shared_ptr<Renderable>;
+    using TriPtr = std::shared_ptr<Triangle>;
+    using NodePtr = std::shared_ptr<BVHNode>;
+    // Every supported BVH layout, only the one selected by width and quantization is built
+    using BVHPtr = std::variant<NodePtr,
+                                std::shared_ptr<WideBVH<4>>,
+                                std::shared_ptr<WideBVH<8>>,
+                                std::shared_ptr<CompressedWideBVH<4, uint8_t>>,
+                                std::shared_ptr<CompressedWideBVH<8, uint8_t>>,
+                                std::shared_ptr<CompressedWideBVH<4, uint16_t>>,
+                                std::shared_ptr<CompressedWideBVH<8, uint16_t>>>;
+
+    // Triangle in the form intersectTriangle expects, precomputed per leaf reference
+    struct LeafTriangle
+    {
+        Vec3 v0, e1, e2;
+    };
+
+private:
+    // Declared first so they outlive everything pointing into them
+    Arena _arena{MemTag::Geometry}; // triangles
+    Arena _bvhArena{MemTag::BVH};   // binary BVH nodes, cleared on every rebuild
+    TrackedVector<ObjPtr, MemTag::Geometry> _primitives;
+    // Leaf-order triangle data of the wide BVHs, so leaves are tested without virtual calls
+    TrackedVector<LeafTriangle, MemTag::BVH> _leafTris;
+    TrackedVector<const Triangle *, MemTag::BVH> _leafRefs;
+    BVHPtr _bvh = NodePtr(nullptr);
+    int _bvhWidth = 2;
+    int _bvhQuantBits = 0;
+    bool _lazyBVH = false;
+    // Set while a lazy wide BVH waits for the first ray reaching the mesh
+    std::unique_ptr<std::once_flag> _deferredBuild;
+    BVHBuilder _bvhBuilder = BVHBuilder::Midpoint;
+    double _maxDuplication = 0.3;
+
+private:
+    // Working copy the BVH builders reorder
+    inline std::vector<ObjPtr> _primitiveList() const
+    {
+        return std::vector<ObjPtr>(_primitives.begin(), _primitives.end());
+    }
+    template <int N>
+    void _buildWideBVH()
+    {
+        if (_bvhQuantBits == 8)
+            _bvh = CompressedWideBVH<N, uint8_t>::build(_primitiveList(), _bvhBuilder, _maxDuplication);
+        else if (_bvhQuantBits == 16)
+            _bvh = CompressedWideBVH<N, uint16_t>::build(_primitiveList(), _bvhBuilder, _maxDuplication);
+        else
+            _bvh = WideBVH<N>::build(_primitiveList(), _bvhBuilder, _maxDuplication);
+    }
+    void _buildNow()
+    {
+        if (_bvhWidth == 8)
+            _buildWideBVH<8>();
+        else if (_bvhWidth == 4)
+            _buildWideBVH<4>();
+        else if (_lazyBVH)
+            _bvh = BVHNode::buildLazy(_bvhArena, _primitiveList());
+        else
+            _bvh = BVHNode::build(_bvhArena, _primitiveList(), _bvhBuilder, _maxDuplication);
+        std::visit([this](const auto &bvh)
+                   {
+                       if constexpr (!std::is_same_v<std::decay_t<decltype(bvh)>, NodePtr>)
+                           _buildLeafTriangles(bvh->prims());
+                   },
+                   _bvh);
+    }
+    // Every primitive of a mesh is a triangle, see appendTriangle
+    void _buildLeafTriangles(const TrackedVector<ObjPtr, MemTag::BVH> &prims)
+    {
+        _leafTris.clear();
+        _leafRefs.clear();
+        _leafTris.reserve(prims.size());
+        _leafRefs.reserve(prims.size());
+        for (const ObjPtr &prim : prims)
+        {
+            const Triangle *tri = static_cast<const Triangle *>(prim.get());
+            _leafTris.push_back({tri->vertex(0), tri->vertex(1) - tri->vertex(0), tri->vertex(2) - tri->vertex(0)});
+            _leafRefs.push_back(tri);
+        }
+    }
+    // Closest hit through a wide BVH with the triangle kernel inlined into the leaves
+    // Only the winning triangle builds a full Intersection
+    template <typename WideBVHType>
+    Intersection _intersectLeaves(const WideBVHType &bvh, const Ray &ray) const
+    {
+        double tMax = INF, beta = 0.0, gamma = 0.0;
+        int hit = -1;
+        const Vec3 &o = ray.orig(), &d = ray.dir();
+        bvh.traverse(ray, tMax, [&](int first, int count)
+                     {
+                         for (int k = first; k < first + count; k++)
+                         {
+                             const LeafTriangle &tri = _leafTris[k];
+                             double t, b, g;
+                             if (intersectTriangle(tri.v0, tri.e1, tri.e2, o, d, tMax, t, b, g))
+                             {
+                                 tMax = t;
+                                 beta = b;
+                                 gamma = g;
+                                 hit = k;
+                             }
+                         }
+                     });
+        if (hit < 0)
+            return Intersection();
+        return _leafRefs[hit]->hitAt(ray, tMax, beta, gamma);
+    }
+
+public:
+    Mesh()
+    {
+        _aabb.set(Vec3{INF, INF, INF}, Vec3{-INF, -INF, -INF});
+    };
+
+public: // override functions
+    Intersection intersect(const Ray &ray) const override
+    {
+        // Shared meshes are handed out const, the mesh itself was created mutable
+        if (_deferredBuild)
+            std::call_once(*_deferredBuild, [this]()
+                           { const_cast<Mesh *>(this)->_buildNow(); });
+        Intersection inter = std::visit([this, &ray](const auto &bvh)
+                                        {
+                                            if constexpr (std::is_same_v<std::decay_t<decltype(bvh)>, NodePtr>)
+                                                return bvh->intersect(ray);
+                                            else
+                                                return _intersectLeaves(*bvh, ray);
+                                        },
+                                        _bvh);
+        if (_material)
+            inter.materialId = _material->id();
+        return inter;
+    }
+    void transform(const Vec3 &s, const Vec3 &r, const Vec3 &t)
+    {
+        for (const ObjPtr &prim : _primitives)
+            prim->transform(s, r, t);
+        buildBVH();
+    }
+
+public: // parameter setters
+    // The triangle is created in the mesh's arena and lives as long as the mesh
+    TriPtr appendTriangle(const Vec3 &v0, const Vec3 &v1, const Vec3 &v2)
+    {
+        TriPtr triangle = _arena.make<Triangle>(v0, v1, v2);
+        appendTriangle(triangle);
+        return triangle;
+    }
+    void appendTriangle(TriPtr triangle)
+    {
+        _primitives.push_back(triangle);
+        _aabb.expand(triangle->aabb());
+        _bvh = NodePtr(nullptr);
+        _deferredBuild.reset();
+        _leafTris.clear();
+        _leafRefs.clear();
+    }
+    // Frees the previous tree's nodes at once, so it must not run while a render may be traversing them
+    void buildBVH()
+    {
+        if (RenderGuard::rendering())
+            RAISE_ERROR("Mesh BVH rebuilt while a render is running");
+        _bvh = NodePtr(nullptr);
+        _bvhArena.clear();
+        _deferredBuild.reset();
+        if (_lazyBVH && _bvhWidth != 2)
+            _deferredBuild = std::make_unique<std::once_flag>();
+        else
+            _buildNow();
+    }
+    // Lazy binary BVHs build each subtree when a ray first reaches it
+    // Wide BVHs are collapsed from a complete tree, so a lazy one is built whole by the first ray
+    // reaching the mesh, meshes no ray reaches are never built
+    void setLazyBVH(bool lazy)
+    {
+        _lazyBVH = lazy;
+    }
+    // 2 for the binary BVH, 4 or 8 for a collapsed wide BVH with SIMD node tests
+    void setBVHWidth(int width)
+    {
+        if (width != 2 && width != 4 && width != 8)
+            RAISE_ERROR("BVH width must be 2, 4 or 8");
+        _bvhWidth = width;
+    }
+    // Spatial splits may add up to maxDuplication * numTriangles() extra references
+    void setBVHBuilder(BVHBuilder builder, double maxDuplication = 0.3)
+    {
+        _bvhBuilder = builder;
+        _maxDuplication = maxDuplication;
+    }
+    // 0 keeps float child bounds, 8 or 16 quantizes them relative to each node(wide BVH only)
+    void setBVHQuantBits(int bits)
+    {
+        if (bits != 0 && bits != 8 && bits != 16)
+            RAISE_ERROR("BVH quantization must be 0, 8 or 16 bits");
+        _bvhQuantBits = bits;
+    }
+    // Memory held by the triangles and the primitive list
+    std::size_t geometryMemoryBytes() const
+    {
+        return _arena.reservedBytes() + _primitives.capacity() * sizeof(ObjPtr);
+    }
+    // Memory held by the acceleration structure, excluding the primitives themselves
+    std::size_t bvhMemoryBytes() const
+    {
+        std::size_t leaves = _leafTris.size() * (sizeof(LeafTriangle) + sizeof(const Triangle *));
+        return leaves + std::visit([](const auto &bvh)
+                                   { return bvh ? bvh->memoryBytes() : std::size_t(0); },
+                                   _bvh);
+    }
+    inline std::size_t numTriangles() const
+    {
+        return _primitives.size();
+    }
+    inline const TrackedVector<ObjPtr, MemTag::Geometry> &primitives() const
+    {
+        return _primitives;
+    }
+    void setTexture(const TexPtr &tex) override
+    {
+        for (const ObjPtr &prim : _primitives)
+            prim->setTexture(tex);
+    }
+    void collectMaterials(std::vector<MtlPtr> &materials) const override
+    {
+        Renderable::collectMaterials(materials);
+        for (const ObjPtr &prim : _primitives)
+            prim->collectMaterials(materials);
+    }
+};
+
+// A mesh, or any shared geometry such as an out-of-core mesh, placed in the scene by scale and
+// translation without copying its triangles
+// Rays are moved into the geometry's space instead of moving the geometry
+// The geometry is never modified, material and texture set on the instance override its own
+class Instance final : public Renderable
+{
+    using Vec3 = Eigen::Vector3d;
+    using MtlPtr = std::shared_ptr<const Material>;
+    using GeometryPtr = std::shared_ptr<const Renderable>;
+    using TexPtr = std::shared_ptr<const Texture>;
+
+private:
+    GeometryPtr _geometry;
+    Vec3 _scale = {1.0, 1.0, 1.0};
+    Vec3 _translate = {0.0, 0.0, 0.0};
+
+public:
+    Instance(GeometryPtr geometry, const Vec3 &scale = {1.0, 1.0, 1.0}, const Vec3 &translate = {0.0, 0.0, 0.0})
+        : _geometry(geometry), _scale(scale), _translate(translate)
+    {
+        if (!geometry)
+            RAISE_ERROR("Instance of an empty mesh");
+        if ((scale.array() <= 0.0).any())
+            RAISE_ERROR("Instance scale must be positive");
+        const AABB &box = geometry->aabb();
+        _aabb.set(box.min().cwiseProduct(scale) + translate, box.max().cwiseProduct(scale) + translate);
+    }
+
+public: // override functions
+    Intersection intersect(const Ray &ray) const override
+    {
+        if (!_aabb.intersect(ray))
+            return Intersection();
+        Vec3 o = (ray.orig() - _translate).cwiseQuotient(_scale);
+        Vec3 d = ray.dir().cwiseQuotient(_scale);
+        Ray local(o, d);
+        if (ray.hasDifferentials())
+            local.setDifferentials(Ray((ray.rxOrig() - _translate).cwiseQuotient(_scale), ray.rxDir().cwiseQuotient(_scale)),
+                                   Ray((ray.ryOrig() - _translate).cwiseQuotient(_scale), ray.ryDir().cwiseQuotient(_scale)));
+        Intersection inter = _geometry->intersect(local);
+        if (!inter.happen)
+            return inter;
+        // Back to world space, the direction is normalized so t is measured along it again
+        inter.pos = inter.pos.cwiseProduct(_scale) + _translate;
+        inter.normal = inter.normal.cwiseQuotient(_scale).normalized();
+        inter.t = (inter.pos - ray.orig()).dot(ray.dir());
+        inter.viewDir = -ray.dir();
+        if (_material)
+            inter.materialId = _material->id();
+        if (_texture && inter.hasUV)
+        {
+            inter.texColor = _texture->getColor(inter.uv, inter.duvdx, inter.duvdy);
+            inter.hasTexColor = true;
+        }
+        return inter;
+    }
+    // Like the other primitives rotation is not supported
+    void transform(const Vec3 &s, const Vec3 &r, const Vec3 &t) override
+    {
+        _scale = _scale.cwiseProduct(s);
+        _translate = _translate.cwiseProduct(s) + t;
+        _aabb.set(_aabb.min().cwiseProduct(s) + t, _aabb.max().cwiseProduct(s) + t);
+    }
+    void setTexture(const TexPtr &tex) override
+    {
+        _texture = tex;
+    }
+    void collectMaterials(std::vector<MtlPtr> &materials) const override
+    {
+        Renderable::collectMaterials(materials);
+        _geometry->collectMaterials(materials);
+    }
+};
\ No newline at end of file
@@ -1,9 +1,10 @@
+#pragma once
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <string>
 #include "utils.hpp"
-#include "renderable.hpp"
+#include "mesh.hpp"
 #include <sstream>
 
 class ObjLoader
@@ -22,6 +23,11 @@ private:
     std::vector<IVec3> _vi; // faces index
     std::vector<IVec3> _vti; // uv index
     std::vector<IVec3> _vni; // normal index
+    bool _lazyBVH = false;
+    int _bvhWidth = 2;
+    int _bvhQuantBits = 0;
+    BVHBuilder _bvhBuilder = BVHBuilder::Midpoint;
+    double _maxDuplication = 0.3;
 
 public:
     ObjLoader(){};
@@ -108,6 +114,27 @@ private:
 
 
 public:
+    // Meshes loaded afterwards build their BVH subtrees on demand
+    void setLazyBVH(bool lazy)
+    {
+        _lazyBVH = lazy;
+    }
+    // 2 for the binary BVH, 4 or 8 for a collapsed wide BVH
+    void setBVHWidth(int width)
+    {
+        _bvhWidth = width;
+    }
+    void setBVHBuilder(BVHBuilder builder, double maxDuplication = 0.3)
+    {
+        _bvhBuilder = builder;
+        _maxDuplication = maxDuplication;
+    }
+    // 0 keeps float child bounds, 8 or 16 quantizes them(wide BVH only)
+    void setBVHQuantBits(int bits)
+    {
+        _bvhQuantBits = bits;
+    }
+
     std::shared_ptr<Mesh> load(const std::string &filepath)
     {
         _initialize();
@@ -150,7 +177,7 @@ public:
 
         for(int i=0;i<_vi.size();i++)
         {
-            TriPtr tri=std::make_shared<Triangle>(
+            TriPtr tri=ret->appendTriangle(
                 _v[_vi[i][0]],_v[_vi[i][1]],_v[_vi[i][2]]
             );
             if(_vti.size()>0)
@@ -161,9 +188,12 @@ public:
                 tri->setVertexNormal(
                     _vn[_vni[i][0]],_vn[_vni[i][1]],_vn[_vni[i][2]]
                 );
-            ret->appendTriangle(tri);
         }
 
+        ret->setLazyBVH(_lazyBVH);
+        ret->setBVHWidth(_bvhWidth);
+        ret->setBVHQuantBits(_bvhQuantBits);
+        ret->setBVHBuilder(_bvhBuilder, _maxDuplication);
         ret->buildBVH();
 
         return ret;
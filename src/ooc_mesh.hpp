@@ -0,0 +1,400 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+#include <eigen3/Eigen/Core>
+#include "config.h"
+#include "utils.hpp"
+#include "renderable.hpp"
+#include "wide_bvh.hpp"
+#include "mesh.hpp"
+
+// A triangle mesh kept on disk as spatially coherent clusters, each with its own 8-wide BVH
+// Only a top-level BVH over the cluster bounds stays in memory, clusters are read when a ray
+// first reaches them and evicted by a clock sweep once their total size exceeds the budget
+// A thread reaching a cluster that is being read waits for it, other threads keep tracing
+class OutOfCoreMesh final : public Renderable
+{
+    using Vec3 = Eigen::Vector3d;
+    using Vec2 = Eigen::Vector2d;
+    using ObjPtr = std::shared_ptr<Renderable>;
+    using TexPtr = std::shared_ptr<const Texture>;
+    using Node = WideBVHNode<8>;
+
+    // On-disk triangle, enough to rebuild the Triangle for shading
+    struct TriangleRecord
+    {
+        double v[3][3];
+        double n[3][3];
+        double vt[3][2];
+        double faceNormal[3];
+    };
+    // Intersection data of a triangle in leaf order, see intersectTriangle
+    struct LeafTriangle
+    {
+        Vec3 v0, e1, e2;
+    };
+    struct ClusterHeader
+    {
+        uint64_t offset;
+        uint64_t bytes;
+        double bounds[6]; // min xyz, max xyz
+        int32_t nNodes, stackSize, nLeaves, nTriangles;
+    };
+    // A resident cluster, shared so an eviction never frees one a ray is still traversing
+    struct Cluster
+    {
+        TrackedVector<Node, MemTag::BVH> nodes;
+        int stackSize = 1;
+        TrackedVector<LeafTriangle, MemTag::BVH> leafTris;
+        TrackedVector<int32_t, MemTag::BVH> leafRefs; // leaf order to triangle index, spatial splits may repeat one
+        TrackedVector<Triangle, MemTag::Geometry> triangles;
+    };
+    struct ClusterSlot
+    {
+        std::mutex mutex; // held while the cluster is read
+        std::shared_ptr<const Cluster> data; // accessed atomically, readers skip the mutex
+        std::atomic<bool> referenced{false};
+    };
+    // Stand-in for a cluster in the top-level BVH
+    class ClusterProxy final : public Renderable
+    {
+        using Vec3 = Eigen::Vector3d;
+        using TexPtr = std::shared_ptr<const Texture>;
+
+    public:
+        int index;
+        ClusterProxy(int i, const AABB &aabb) : index(i)
+        {
+            _aabb = aabb;
+        }
+        Intersection intersect(const Ray &) const override
+        {
+            return Intersection();
+        }
+        void transform(const Vec3 &, const Vec3 &, const Vec3 &) override {}
+        void setTexture(const TexPtr &) override {}
+    };
+
+public:
+    struct Stats
+    {
+        uint64_t loads = 0;
+        uint64_t evictions = 0;
+        std::size_t residentBytes = 0;
+        std::size_t peakBytes = 0;
+    };
+
+private:
+    std::string _path;
+    std::ifstream _file; // read under _ioMutex
+    std::mutex _ioMutex;
+    std::vector<ClusterHeader> _headers;
+    std::unique_ptr<ClusterSlot[]> _slots;
+    std::shared_ptr<WideBVH<8>> _top;
+    std::vector<int> _topClusters; // cluster index of each top-level leaf primitive
+    static inline const bool _useAVX = cpuHasAVX(); // read on every cluster traversal
+
+    // Residency, guarded by _residentMutex
+    mutable std::mutex _residentMutex;
+    std::size_t _budget;
+    std::vector<int> _resident;
+    std::size_t _hand = 0;
+    Stats _stats;
+
+private:
+    static std::size_t _clusterBytes(const ClusterHeader &h)
+    {
+        return h.nNodes * sizeof(Node) + h.nLeaves * (sizeof(LeafTriangle) + sizeof(int32_t)) + h.nTriangles * sizeof(Triangle);
+    }
+
+    std::shared_ptr<const Cluster> _read(int index)
+    {
+        const ClusterHeader &h = _headers[index];
+        std::vector<TriangleRecord> records(h.nTriangles);
+        auto cluster = std::make_shared<Cluster>();
+        cluster->nodes.resize(h.nNodes);
+        cluster->stackSize = h.stackSize;
+        cluster->leafRefs.resize(h.nLeaves);
+        {
+            std::lock_guard<std::mutex> lock(_ioMutex);
+            _file.seekg(h.offset);
+            _file.read((char *)cluster->nodes.data(), h.nNodes * sizeof(Node));
+            _file.read((char *)cluster->leafRefs.data(), h.nLeaves * sizeof(int32_t));
+            _file.read((char *)records.data(), h.nTriangles * sizeof(TriangleRecord));
+            if (!_file)
+                RAISE_ERROR(("Failed to read geometry cluster from " + _path).c_str());
+        }
+
+        cluster->triangles.reserve(h.nTriangles);
+        for (const TriangleRecord &r : records)
+        {
+            Triangle &tri = cluster->triangles.emplace_back(Vec3(r.v[0]), Vec3(r.v[1]), Vec3(r.v[2]));
+            tri.setVertexNormal(Vec3(r.n[0]), Vec3(r.n[1]), Vec3(r.n[2]));
+            tri.setVertexUV(Vec2(r.vt[0]), Vec2(r.vt[1]), Vec2(r.vt[2]));
+            tri.setFaceNormal(Vec3(r.faceNormal));
+            tri.setTexture(_texture);
+        }
+        cluster->leafTris.reserve(h.nLeaves);
+        for (int32_t ref : cluster->leafRefs)
+        {
+            const Triangle &tri = cluster->triangles[ref];
+            cluster->leafTris.push_back({tri.vertex(0), tri.vertex(1) - tri.vertex(0), tri.vertex(2) - tri.vertex(0)});
+        }
+        return cluster;
+    }
+
+    // Evict by clock until the new cluster fits, slots busy loading are skipped
+    void _makeRoom(std::size_t bytes, int loading)
+    {
+        std::size_t tries = 0;
+        while (_stats.residentBytes + bytes > _budget && !_resident.empty() && tries < 2 * _resident.size() + 2)
+        {
+            tries++;
+            if (_hand >= _resident.size())
+                _hand = 0;
+            int victim = _resident[_hand];
+            ClusterSlot &slot = _slots[victim];
+            if (victim == loading || slot.referenced.exchange(false, std::memory_order_relaxed))
+            {
+                _hand++;
+                continue;
+            }
+            std::unique_lock<std::mutex> slotLock(slot.mutex, std::try_to_lock);
+            if (!slotLock.owns_lock())
+            {
+                _hand++;
+                continue;
+            }
+            std::atomic_store(&slot.data, std::shared_ptr<const Cluster>());
+            _resident[_hand] = _resident.back();
+            _resident.pop_back();
+            _stats.residentBytes -= _clusterBytes(_headers[victim]);
+            _stats.evictions++;
+        }
+    }
+
+    std::shared_ptr<const Cluster> _acquire(int index)
+    {
+        ClusterSlot &slot = _slots[index];
+        if (!slot.referenced.load(std::memory_order_relaxed))
+            slot.referenced.store(true, std::memory_order_relaxed);
+        std::shared_ptr<const Cluster> data = std::atomic_load(&slot.data);
+        if (data)
+            return data;
+
+        std::lock_guard<std::mutex> lock(slot.mutex);
+        data = std::atomic_load(&slot.data);
+        if (data)
+            return data;
+        data = _read(index);
+        std::atomic_store(&slot.data, data);
+        std::size_t bytes = _clusterBytes(_headers[index]);
+        std::lock_guard<std::mutex> residentLock(_residentMutex);
+        _makeRoom(bytes, index);
+        _resident.push_back(index);
+        _stats.residentBytes += bytes;
+        _stats.peakBytes = std::max(_stats.peakBytes, _stats.residentBytes);
+        _stats.loads++;
+        return data;
+    }
+
+    // Split triangles at the median centroid of the longest axis until each group fits a cluster
+    static void _cluster(std::vector<std::shared_ptr<Triangle>> &tris, std::size_t begin, std::size_t end, std::size_t maxSize,
+                         std::vector<std::pair<std::size_t, std::size_t>> &ranges)
+    {
+        if (end - begin <= maxSize)
+        {
+            ranges.push_back({begin, end});
+            return;
+        }
+        AABB bounds;
+        for (std::size_t i = begin; i < end; i++)
+            bounds.expand(tris[i]->aabb().centroid());
+        int axis;
+        bounds.len().maxCoeff(&axis);
+        std::size_t mid = (begin + end) / 2;
+        std::nth_element(tris.begin() + begin, tris.begin() + mid, tris.begin() + end,
+                         [axis](const std::shared_ptr<Triangle> &a, const std::shared_ptr<Triangle> &b)
+                         { return a->aabb().centroid()[axis] < b->aabb().centroid()[axis]; });
+        _cluster(tris, begin, mid, maxSize, ranges);
+        _cluster(tris, mid, end, maxSize, ranges);
+    }
+
+public:
+    OutOfCoreMesh(const std::string &path, std::size_t budgetBytes = std::size_t(OOC_GEOMETRY_BUDGET_MB) << 20)
+        : _path(path), _file(path, std::ios::binary), _budget(budgetBytes)
+    {
+        uint32_t header[3];
+        if (!_file.read((char *)header, sizeof(header)) || header[0] != OOC_MESH_MAGIC || header[1] != OOC_MESH_VERSION)
+            RAISE_ERROR(("Not an out-of-core mesh file: " + path).c_str());
+        _headers.resize(header[2]);
+        _file.read((char *)_headers.data(), _headers.size() * sizeof(ClusterHeader));
+        if (!_file)
+            RAISE_ERROR(("Truncated out-of-core mesh file: " + path).c_str());
+        _slots.reset(new ClusterSlot[_headers.size()]);
+
+        std::vector<ObjPtr> proxies;
+        _aabb.set(Vec3{INF, INF, INF}, Vec3{-INF, -INF, -INF});
+        for (int i = 0; i < _headers.size(); i++)
+        {
+            const double *b = _headers[i].bounds;
+            AABB aabb;
+            aabb.set(Vec3(b[0], b[1], b[2]), Vec3(b[3], b[4], b[5]));
+            _aabb.expand(aabb);
+            proxies.push_back(std::make_shared<ClusterProxy>(i, aabb));
+        }
+        _top = WideBVH<8>::build(proxies, BVHBuilder::SAH);
+        for (const ObjPtr &proxy : _top->prims())
+            _topClusters.push_back(static_cast<const ClusterProxy *>(proxy.get())->index);
+    }
+
+    // Write a mesh's triangles as clusters of at most clusterSize triangles
+    // Conversion holds the mesh in memory once, rendering the result only needs the budget
+    static void write(const Mesh &mesh, const std::string &path, int clusterSize = OOC_CLUSTER_TRIANGLES,
+                      BVHBuilder builder = BVHBuilder::SAH)
+    {
+        std::vector<std::shared_ptr<Triangle>> tris;
+        for (const ObjPtr &prim : mesh.primitives())
+            tris.push_back(std::static_pointer_cast<Triangle>(prim));
+        std::vector<std::pair<std::size_t, std::size_t>> ranges;
+        _cluster(tris, 0, tris.size(), clusterSize, ranges);
+
+        std::ofstream ofs(path, std::ios::binary);
+        if (!ofs.is_open())
+            RAISE_ERROR(("Failed to create out-of-core mesh file " + path).c_str());
+        uint32_t header[3] = {OOC_MESH_MAGIC, OOC_MESH_VERSION, uint32_t(ranges.size())};
+        std::vector<ClusterHeader> headers(ranges.size());
+        ofs.write((const char *)header, sizeof(header));
+        ofs.write((const char *)headers.data(), headers.size() * sizeof(ClusterHeader));
+
+        for (std::size_t c = 0; c < ranges.size(); c++)
+        {
+            std::vector<ObjPtr> objs(tris.begin() + ranges[c].first, tris.begin() + ranges[c].second);
+            std::shared_ptr<WideBVH<8>> bvh = WideBVH<8>::build(objs, builder);
+            std::unordered_map<const Renderable *, int32_t> local;
+            for (std::size_t i = 0; i < objs.size(); i++)
+                local[objs[i].get()] = i;
+            std::vector<int32_t> leafRefs;
+            for (const ObjPtr &prim : bvh->prims())
+                leafRefs.push_back(local[prim.get()]);
+            std::vector<TriangleRecord> records;
+            AABB bounds;
+            for (const ObjPtr &obj : objs)
+            {
+                const Triangle &tri = static_cast<const Triangle &>(*obj);
+                TriangleRecord r;
+                for (int i = 0; i < 3; i++)
+                {
+                    for (int k = 0; k < 3; k++)
+                    {
+                        r.v[i][k] = tri.vertex(i)[k];
+                        r.n[i][k] = tri.vertexNormal(i)[k];
+                    }
+                    r.vt[i][0] = tri.vertexUV(i)[0];
+                    r.vt[i][1] = tri.vertexUV(i)[1];
+                    r.faceNormal[i] = tri.faceNormal()[i];
+                }
+                records.push_back(r);
+                bounds.expand(tri.aabb());
+            }
+
+            ClusterHeader &h = headers[c];
+            h.offset = ofs.tellp();
+            h.nNodes = bvh->numNodes();
+            h.stackSize = bvh->stackSize();
+            h.nLeaves = leafRefs.size();
+            h.nTriangles = records.size();
+            for (int k = 0; k < 3; k++)
+            {
+                h.bounds[k] = bounds.min()[k];
+                h.bounds[k + 3] = bounds.max()[k];
+            }
+            ofs.write((const char *)bvh->nodes().data(), h.nNodes * sizeof(Node));
+            ofs.write((const char *)leafRefs.data(), h.nLeaves * sizeof(int32_t));
+            ofs.write((const char *)records.data(), h.nTriangles * sizeof(TriangleRecord));
+            h.bytes = uint64_t(ofs.tellp()) - h.offset;
+        }
+        ofs.seekp(sizeof(header));
+        ofs.write((const char *)headers.data(), headers.size() * sizeof(ClusterHeader));
+        ofs.close();
+        if (!ofs)
+            RAISE_ERROR(("Failed to write out-of-core mesh file " + path).c_str());
+    }
+
+public: // override functions
+    Intersection intersect(const Ray &ray) const override
+    {
+        OutOfCoreMesh *self = const_cast<OutOfCoreMesh *>(this); // residency is a cache, not state
+        double tMax = INF, beta = 0.0, gamma = 0.0;
+        int hit = -1;
+        std::shared_ptr<const Cluster> hitCluster;
+        const Vec3 &o = ray.orig(), &d = ray.dir();
+        _top->traverse(ray, tMax, [&](int first, int count)
+                       {
+                           for (int c = first; c < first + count; c++)
+                           {
+                               std::shared_ptr<const Cluster> cluster = self->_acquire(_topClusters[c]);
+                               auto fetch = [&cluster](int index, Node &) -> const Node & { return cluster->nodes[index]; };
+                               wideBVHTraverse<8>(ray, cluster->stackSize, _useAVX, tMax, fetch, [&](int first, int count)
+                                                  {
+                                                      for (int k = first; k < first + count; k++)
+                                                      {
+                                                          const LeafTriangle &tri = cluster->leafTris[k];
+                                                          double t, b, g;
+                                                          if (intersectTriangle(tri.v0, tri.e1, tri.e2, o, d, tMax, t, b, g))
+                                                          {
+                                                              tMax = t;
+                                                              beta = b;
+                                                              gamma = g;
+                                                              hit = cluster->leafRefs[k];
+                                                              hitCluster = cluster;
+                                                          }
+                                                      }
+                                                  });
+                           }
+                       });
+        if (hit < 0)
+            return Intersection();
+        Intersection inter = hitCluster->triangles[hit].hitAt(ray, tMax, beta, gamma);
+        if (_material)
+            inter.materialId = _material->id();
+        return inter;
+    }
+    // Geometry on disk is fixed, place it with an Instance instead
+    void transform(const Vec3 &, const Vec3 &, const Vec3 &) override
+    {
+        RAISE_ERROR("Out-of-core meshes cannot be transformed, use an Instance");
+    }
+    // Applies to clusters read from now on, call it before rendering
+    void setTexture(const TexPtr &tex) override
+    {
+        _texture = tex;
+    }
+
+public:
+    Stats stats() const
+    {
+        std::lock_guard<std::mutex> lock(_residentMutex);
+        return _stats;
+    }
+    inline std::size_t numClusters() const
+    {
+        return _headers.size();
+    }
+    // Memory all clusters would take if resident at once
+    std::size_t totalBytes() const
+    {
+        std::size_t bytes = 0;
+        for (const ClusterHeader &h : _headers)
+            bytes += _clusterBytes(h);
+        return bytes;
+    }
+};
\ No newline at end of file
@@ -0,0 +1,289 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include "memory_tracker.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PHONG_BATCH_X86
+#endif
+
+// Fast float log2/exp2/pow for batch shading
+// log2 reduces the mantissa to [sqrt(1/2), sqrt(2)) and sums the atanh series up to t^7,
+// exp2 splits off the integer part and evaluates a degree 7 Taylor polynomial around 1/2
+// Over x in [1e-6, 1] and p in [1, 1000], pow and its SIMD versions are within 2e-5 relative error
+// of std::pow whenever the result is above 1e-30, smaller results may flush to zero
+// The Phong kernel as a whole is only within about 1e-4 of the double precision shader: its cosines
+// are computed in float, and a relative error e of the cosine becomes p * e after raising it to p
+namespace fastmath
+{
+    constexpr float SQRT2 = 1.41421356f;
+    constexpr float LN2 = 0.693147181f;
+    // 2/ln2 * (1, 1/3, 1/5, 1/7)
+    constexpr float LOG_C1 = 2.88539008f, LOG_C3 = 0.961796694f, LOG_C5 = 0.577078016f, LOG_C7 = 0.412198583f;
+    // ln2^k / k! for k = 1..7, times sqrt(2) folded in at the end
+    constexpr float EXP_C1 = 0.693147181f, EXP_C2 = 0.240226507f, EXP_C3 = 0.0555041087f, EXP_C4 = 0.00961812911f,
+                    EXP_C5 = 0.00133335581f, EXP_C6 = 0.000154035304f, EXP_C7 = 1.52527338e-05f;
+
+    inline float log2(float x)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &x, sizeof(float));
+        float e = float(int((bits >> 23) & 0xff) - 127);
+        bits = (bits & 0x007fffff) | 0x3f800000;
+        float m;
+        std::memcpy(&m, &bits, sizeof(float));
+        if (m > SQRT2)
+        {
+            m *= 0.5f;
+            e += 1.0f;
+        }
+        float t = (m - 1.0f) / (m + 1.0f), t2 = t * t;
+        return e + t * (LOG_C1 + t2 * (LOG_C3 + t2 * (LOG_C5 + t2 * LOG_C7)));
+    }
+    inline float exp2(float x)
+    {
+        x = std::clamp(x, -126.0f, 127.0f);
+        float n = std::floor(x), y = x - n - 0.5f;
+        float p = 1.0f + y * (EXP_C1 + y * (EXP_C2 + y * (EXP_C3 + y * (EXP_C4 + y * (EXP_C5 + y * (EXP_C6 + y * EXP_C7))))));
+        uint32_t bits = uint32_t(int(n) + 127) << 23;
+        float scale;
+        std::memcpy(&scale, &bits, sizeof(float));
+        return p * SQRT2 * scale;
+    }
+    // x^p for x >= 0 and p > 0
+    inline float pow(float x, float p)
+    {
+        return x > 0.0f ? exp2(p * log2(x)) : 0.0f;
+    }
+}
+
+// Runtime CPU dispatch, checked once per process
+inline bool cpuHasAVX2FMA()
+{
+#ifdef PHONG_BATCH_X86
+    static const bool has = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return has;
+#else
+    return false;
+#endif
+}
+
+#ifdef PHONG_BATCH_X86
+inline __m128 fastLog2SSE(__m128 x)
+{
+    __m128i bits = _mm_castps_si128(x);
+    __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(bits, 23), _mm_set1_epi32(0xff)), _mm_set1_epi32(127)));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)), _mm_set1_epi32(0x3f800000)));
+    __m128 big = _mm_cmpgt_ps(m, _mm_set1_ps(fastmath::SQRT2));
+    m = _mm_or_ps(_mm_and_ps(big, _mm_mul_ps(m, _mm_set1_ps(0.5f))), _mm_andnot_ps(big, m));
+    e = _mm_add_ps(e, _mm_and_ps(big, _mm_set1_ps(1.0f)));
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 t = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one)), t2 = _mm_mul_ps(t, t);
+    __m128 p = _mm_add_ps(_mm_set1_ps(fastmath::LOG_C5), _mm_mul_ps(t2, _mm_set1_ps(fastmath::LOG_C7)));
+    p = _mm_add_ps(_mm_set1_ps(fastmath::LOG_C3), _mm_mul_ps(t2, p));
+    p = _mm_add_ps(_mm_set1_ps(fastmath::LOG_C1), _mm_mul_ps(t2, p));
+    return _mm_add_ps(e, _mm_mul_ps(t, p));
+}
+inline __m128 fastExp2SSE(__m128 x)
+{
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.0f)), _mm_set1_ps(127.0f));
+    // floor without SSE4.1, truncation rounds negative values up
+    __m128i ni = _mm_cvttps_epi32(x);
+    __m128 n = _mm_cvtepi32_ps(ni);
+    __m128 up = _mm_cmpgt_ps(n, x);
+    ni = _mm_add_epi32(ni, _mm_castps_si128(up)); // -1 where rounded up
+    n = _mm_sub_ps(n, _mm_and_ps(up, _mm_set1_ps(1.0f)));
+    __m128 y = _mm_sub_ps(_mm_sub_ps(x, n), _mm_set1_ps(0.5f));
+    __m128 p = _mm_add_ps(_mm_set1_ps(fastmath::EXP_C6), _mm_mul_ps(y, _mm_set1_ps(fastmath::EXP_C7)));
+    p = _mm_add_ps(_mm_set1_ps(fastmath::EXP_C5), _mm_mul_ps(y, p));
+    p = _mm_add_ps(_mm_set1_ps(fastmath::EXP_C4), _mm_mul_ps(y, p));
+    p = _mm_add_ps(_mm_set1_ps(fastmath::EXP_C3), _mm_mul_ps(y, p));
+    p = _mm_add_ps(_mm_set1_ps(fastmath::EXP_C2), _mm_mul_ps(y, p));
+    p = _mm_add_ps(_mm_set1_ps(fastmath::EXP_C1), _mm_mul_ps(y, p));
+    p = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(y, p));
+    __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(ni, _mm_set1_epi32(127)), 23));
+    return _mm_mul_ps(_mm_mul_ps(p, _mm_set1_ps(fastmath::SQRT2)), scale);
+}
+inline __m128 fastPowSSE(__m128 x, __m128 p)
+{
+    __m128 positive = _mm_cmpgt_ps(x, _mm_setzero_ps());
+    __m128 safe = _mm_or_ps(_mm_and_ps(positive, x), _mm_andnot_ps(positive, _mm_set1_ps(1.0f)));
+    return _mm_and_ps(positive, fastExp2SSE(_mm_mul_ps(p, fastLog2SSE(safe))));
+}
+
+__attribute__((target("avx2,fma"))) inline __m256 fastLog2AVX2(__m256 x)
+{
+    __m256i bits = _mm256_castps_si256(x);
+    __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(0xff)), _mm256_set1_epi32(127)));
+    __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f800000)));
+    __m256 big = _mm256_cmp_ps(m, _mm256_set1_ps(fastmath::SQRT2), _CMP_GT_OQ);
+    m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), big);
+    e = _mm256_add_ps(e, _mm256_and_ps(big, _mm256_set1_ps(1.0f)));
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 t = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one)), t2 = _mm256_mul_ps(t, t);
+    __m256 p = _mm256_fmadd_ps(t2, _mm256_set1_ps(fastmath::LOG_C7), _mm256_set1_ps(fastmath::LOG_C5));
+    p = _mm256_fmadd_ps(t2, p, _mm256_set1_ps(fastmath::LOG_C3));
+    p = _mm256_fmadd_ps(t2, p, _mm256_set1_ps(fastmath::LOG_C1));
+    return _mm256_fmadd_ps(t, p, e);
+}
+__attribute__((target("avx2,fma"))) inline __m256 fastExp2AVX2(__m256 x)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-126.0f)), _mm256_set1_ps(127.0f));
+    __m256 n = _mm256_floor_ps(x);
+    __m256 y = _mm256_sub_ps(_mm256_sub_ps(x, n), _mm256_set1_ps(0.5f));
+    __m256 p = _mm256_fmadd_ps(y, _mm256_set1_ps(fastmath::EXP_C7), _mm256_set1_ps(fastmath::EXP_C6));
+    p = _mm256_fmadd_ps(y, p, _mm256_set1_ps(fastmath::EXP_C5));
+    p = _mm256_fmadd_ps(y, p, _mm256_set1_ps(fastmath::EXP_C4));
+    p = _mm256_fmadd_ps(y, p, _mm256_set1_ps(fastmath::EXP_C3));
+    p = _mm256_fmadd_ps(y, p, _mm256_set1_ps(fastmath::EXP_C2));
+    p = _mm256_fmadd_ps(y, p, _mm256_set1_ps(fastmath::EXP_C1));
+    p = _mm256_fmadd_ps(y, p, _mm256_set1_ps(1.0f));
+    __m256i ni = _mm256_cvtps_epi32(n);
+    __m256 scale = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(ni, _mm256_set1_epi32(127)), 23));
+    return _mm256_mul_ps(_mm256_mul_ps(p, _mm256_set1_ps(fastmath::SQRT2)), scale);
+}
+__attribute__((target("avx2,fma"))) inline __m256 fastPowAVX2(__m256 x, __m256 p)
+{
+    __m256 positive = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ);
+    __m256 safe = _mm256_blendv_ps(_mm256_set1_ps(1.0f), x, positive);
+    return _mm256_and_ps(positive, fastExp2AVX2(_mm256_mul_ps(p, fastLog2AVX2(safe))));
+}
+__attribute__((target("avx2,fma"))) inline float fastPowAVX2(float x, float p)
+{
+    return _mm256_cvtss_f32(fastPowAVX2(_mm256_set1_ps(x), _mm256_set1_ps(p)));
+}
+#endif
+
+// x^p through the SIMD code PhongBatch::evaluate() runs on this CPU, to check its accuracy
+inline float fastPowSIMD(float x, float p)
+{
+#ifdef PHONG_BATCH_X86
+    if (cpuHasAVX2FMA())
+        return fastPowAVX2(x, p);
+    return _mm_cvtss_f32(fastPowSSE(_mm_set1_ps(x), _mm_set1_ps(p)));
+#else
+    return fastmath::pow(x, p);
+#endif
+}
+
+// Hits of one light in SoA layout, every array holds size() floats
+// I is the light's intensity at the hit already scaled by its visibility, zero for shadowed hits
+class PhongBatch
+{
+    using Array = TrackedVector<float, MemTag::Scratch>;
+
+public:
+    Array nx, ny, nz; // unit normal
+    Array vx, vy, vz; // unit direction towards the viewer
+    Array lx, ly, lz; // unit direction towards the light
+    Array ir, ig, ib; // light intensity
+    Array kdr, kdg, kdb;
+    Array ksr, ksg, ksb;
+    Array ne;            // specular exponent
+    Array outR, outG, outB; // diffuse plus specular, accumulated
+
+private:
+    int _size = 0;
+
+    // Arrays are padded to whole AVX2 vectors so every lane goes through the same SIMD code,
+    // a hit shades to the same bits wherever it falls in the batch
+    constexpr static int LANES = 8;
+    constexpr static int N_ARRAYS = 22;
+    std::array<Array *, N_ARRAYS> _arrays()
+    {
+        return {&nx, &ny, &nz, &vx, &vy, &vz, &lx, &ly, &lz, &ir, &ig, &ib,
+                &kdr, &kdg, &kdb, &ksr, &ksg, &ksb, &ne, &outR, &outG, &outB};
+    }
+
+    // Lanes [begin, end) one at a time, without SIMD
+    void _evaluateScalar(int begin, int end)
+    {
+        for (int k = begin; k < end; k++)
+        {
+            float cosTheta = std::max(0.0f, nx[k] * lx[k] + ny[k] * ly[k] + nz[k] * lz[k]);
+            float hx = lx[k] + vx[k], hy = ly[k] + vy[k], hz = lz[k] + vz[k];
+            float invLen = 1.0f / std::sqrt(hx * hx + hy * hy + hz * hz);
+            float cosAlpha = std::max(0.0f, (nx[k] * hx + ny[k] * hy + nz[k] * hz) * invLen);
+            float spec = fastmath::pow(cosAlpha, ne[k]);
+            outR[k] += ir[k] * (kdr[k] * cosTheta + ksr[k] * spec);
+            outG[k] += ig[k] * (kdg[k] * cosTheta + ksg[k] * spec);
+            outB[k] += ib[k] * (kdb[k] * cosTheta + ksb[k] * spec);
+        }
+    }
+#ifdef PHONG_BATCH_X86
+    void _evaluateSSE()
+    {
+        __m128 zero = _mm_setzero_ps();
+        for (int k = 0; k < _size; k += 4)
+        {
+            __m128 NX = _mm_loadu_ps(&nx[k]), NY = _mm_loadu_ps(&ny[k]), NZ = _mm_loadu_ps(&nz[k]);
+            __m128 LX = _mm_loadu_ps(&lx[k]), LY = _mm_loadu_ps(&ly[k]), LZ = _mm_loadu_ps(&lz[k]);
+            __m128 cosTheta = _mm_max_ps(zero, _mm_add_ps(_mm_add_ps(_mm_mul_ps(NX, LX), _mm_mul_ps(NY, LY)), _mm_mul_ps(NZ, LZ)));
+            __m128 HX = _mm_add_ps(LX, _mm_loadu_ps(&vx[k])), HY = _mm_add_ps(LY, _mm_loadu_ps(&vy[k])), HZ = _mm_add_ps(LZ, _mm_loadu_ps(&vz[k]));
+            __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(HX, HX), _mm_mul_ps(HY, HY)), _mm_mul_ps(HZ, HZ)));
+            __m128 cosAlpha = _mm_max_ps(zero, _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(NX, HX), _mm_mul_ps(NY, HY)), _mm_mul_ps(NZ, HZ)), len));
+            __m128 spec = fastPowSSE(cosAlpha, _mm_loadu_ps(&ne[k]));
+            _mm_storeu_ps(&outR[k], _mm_add_ps(_mm_loadu_ps(&outR[k]), _mm_mul_ps(_mm_loadu_ps(&ir[k]), _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&kdr[k]), cosTheta), _mm_mul_ps(_mm_loadu_ps(&ksr[k]), spec)))));
+            _mm_storeu_ps(&outG[k], _mm_add_ps(_mm_loadu_ps(&outG[k]), _mm_mul_ps(_mm_loadu_ps(&ig[k]), _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&kdg[k]), cosTheta), _mm_mul_ps(_mm_loadu_ps(&ksg[k]), spec)))));
+            _mm_storeu_ps(&outB[k], _mm_add_ps(_mm_loadu_ps(&outB[k]), _mm_mul_ps(_mm_loadu_ps(&ib[k]), _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&kdb[k]), cosTheta), _mm_mul_ps(_mm_loadu_ps(&ksb[k]), spec)))));
+        }
+    }
+    __attribute__((target("avx2,fma"))) void _evaluateAVX2()
+    {
+        __m256 zero = _mm256_setzero_ps();
+        for (int k = 0; k < _size; k += 8)
+        {
+            __m256 NX = _mm256_loadu_ps(&nx[k]), NY = _mm256_loadu_ps(&ny[k]), NZ = _mm256_loadu_ps(&nz[k]);
+            __m256 LX = _mm256_loadu_ps(&lx[k]), LY = _mm256_loadu_ps(&ly[k]), LZ = _mm256_loadu_ps(&lz[k]);
+            __m256 cosTheta = _mm256_max_ps(zero, _mm256_fmadd_ps(NZ, LZ, _mm256_fmadd_ps(NY, LY, _mm256_mul_ps(NX, LX))));
+            __m256 HX = _mm256_add_ps(LX, _mm256_loadu_ps(&vx[k])), HY = _mm256_add_ps(LY, _mm256_loadu_ps(&vy[k])), HZ = _mm256_add_ps(LZ, _mm256_loadu_ps(&vz[k]));
+            __m256 len = _mm256_sqrt_ps(_mm256_fmadd_ps(HZ, HZ, _mm256_fmadd_ps(HY, HY, _mm256_mul_ps(HX, HX))));
+            __m256 cosAlpha = _mm256_max_ps(zero, _mm256_div_ps(_mm256_fmadd_ps(NZ, HZ, _mm256_fmadd_ps(NY, HY, _mm256_mul_ps(NX, HX))), len));
+            __m256 spec = fastPowAVX2(cosAlpha, _mm256_loadu_ps(&ne[k]));
+            _mm256_storeu_ps(&outR[k], _mm256_fmadd_ps(_mm256_loadu_ps(&ir[k]), _mm256_fmadd_ps(_mm256_loadu_ps(&ksr[k]), spec, _mm256_mul_ps(_mm256_loadu_ps(&kdr[k]), cosTheta)), _mm256_loadu_ps(&outR[k])));
+            _mm256_storeu_ps(&outG[k], _mm256_fmadd_ps(_mm256_loadu_ps(&ig[k]), _mm256_fmadd_ps(_mm256_loadu_ps(&ksg[k]), spec, _mm256_mul_ps(_mm256_loadu_ps(&kdg[k]), cosTheta)), _mm256_loadu_ps(&outG[k])));
+            _mm256_storeu_ps(&outB[k], _mm256_fmadd_ps(_mm256_loadu_ps(&ib[k]), _mm256_fmadd_ps(_mm256_loadu_ps(&ksb[k]), spec, _mm256_mul_ps(_mm256_loadu_ps(&kdb[k]), cosTheta)), _mm256_loadu_ps(&outB[k])));
+        }
+    }
+#endif
+
+public:
+    PhongBatch(){};
+    PhongBatch(const PhongBatch &) = delete;
+    PhongBatch &operator=(const PhongBatch &) = delete;
+
+public:
+    // Contents are undefined after resizing, outputs included
+    void resize(int n)
+    {
+        _size = n;
+        for (Array *array : _arrays())
+            array->resize((n + LANES - 1) / LANES * LANES);
+    }
+    inline int size() const
+    {
+        return _size;
+    }
+    void clearOutput()
+    {
+        std::fill(outR.begin(), outR.end(), 0.0f);
+        std::fill(outG.begin(), outG.end(), 0.0f);
+        std::fill(outB.begin(), outB.end(), 0.0f);
+    }
+
+    // out += I * (kd * max(0, N.L) + ks * max(0, N.H)^ne), H the half vector of L and V
+    void evaluate()
+    {
+#ifdef PHONG_BATCH_X86
+        if (cpuHasAVX2FMA())
+            _evaluateAVX2();
+        else
+            _evaluateSSE();
+#else
+        _evaluateScalar(0, _size);
+#endif
+    }
+};
\ No newline at end of file
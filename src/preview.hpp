@@ -0,0 +1,107 @@
+#pragma once
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <eigen3/Eigen/Core>
+#include "camera.hpp"
+#include "scene.hpp"
+#include "image_encoder.hpp"
+#include "memory_tracker.hpp"
+#include "utils.hpp"
+#include "config.h"
+
+// Quick turnaround images of a scene whose final render takes long
+// Passes render primary visibility and direct lighting at one sample per pixel, the first one
+// PREVIEW_FIRST_WIDTH pixels wide so it is ready within seconds whatever the film, each following one
+// at twice the width of the last. Every pass is upsampled to the film and written over the same image,
+// with refine the last pass is the full-quality render
+class PreviewRenderer
+{
+    using Vec3 = Eigen::Vector3d;
+
+private:
+    int _width = FILM_WIDTH;
+    int _height = FILM_HEIGHT;
+    int _firstWidth = PREVIEW_FIRST_WIDTH;
+
+    // Bilinear upsampling of a w * h image to the film, pixel centers aligned
+    void _upsample(const Vec3 *image, int w, int h, Vec3 *out) const
+    {
+#ifdef MULTI_THREAD
+#pragma omp parallel for
+#endif
+        for (int i = 0; i < _height; i++)
+        {
+            double y = std::clamp((i + 0.5) * h / _height - 0.5, 0.0, h - 1.0);
+            int y0 = std::min(int(y), std::max(h - 2, 0)), y1 = std::min(y0 + 1, h - 1);
+            double fy = y - y0;
+            for (int j = 0; j < _width; j++)
+            {
+                double x = std::clamp((j + 0.5) * w / _width - 0.5, 0.0, w - 1.0);
+                int x0 = std::min(int(x), std::max(w - 2, 0)), x1 = std::min(x0 + 1, w - 1);
+                double fx = x - x0;
+                const Vec3 *r0 = image + std::size_t(y0) * w, *r1 = image + std::size_t(y1) * w;
+                out[std::size_t(i) * _width + j] = (1.0 - fy) * ((1.0 - fx) * r0[x0] + fx * r0[x1]) + fy * ((1.0 - fx) * r1[x0] + fx * r1[x1]);
+            }
+        }
+    }
+
+public:
+    PreviewRenderer(){};
+
+public: // parameter setters
+    void setFilm(int width, int height)
+    {
+        _width = width;
+        _height = height;
+    }
+    void setFirstWidth(int width)
+    {
+        _firstWidth = width;
+    }
+
+public:
+    // camera is the scene's camera, its film is resized for each pass and set back to the film afterwards
+    // Returns the seconds to the first image
+    double render(Scene &scene, const std::shared_ptr<Camera> &camera, const std::string &output, bool refine)
+    {
+        int samplesSqrt = scene.samplesSqrt();
+        TrackedVector<Vec3, MemTag::Framebuffer> image(std::size_t(_width) * _height);
+        ImageEncoder writer(_width, _height, output);
+        auto start = std::chrono::steady_clock::now();
+        double firstImage = 0.0;
+        scene.setDirectOnly(true);
+        scene.setSamplesSqrt(1);
+        for (int w = std::min(_firstWidth, _width);; w = std::min(2 * w, _width))
+        {
+            int h = std::max(1, int(std::lround(double(w) * _height / _width)));
+            camera->setFilm(w, h);
+            scene.setCamera(camera);
+            auto t0 = std::chrono::steady_clock::now();
+            scene.render();
+            _upsample(scene.frameBuffer(), w, h, image.data());
+            writer.write(image.data());
+            auto t1 = std::chrono::steady_clock::now();
+            if (firstImage == 0.0)
+                firstImage = std::chrono::duration<double>(t1 - start).count();
+            printf("preview %dx%d in %.2fs\n", w, h, std::chrono::duration<double>(t1 - t0).count());
+            if (w == _width)
+                break;
+        }
+        scene.setDirectOnly(false);
+        scene.setSamplesSqrt(samplesSqrt);
+        camera->setFilm(_width, _height);
+        scene.setCamera(camera);
+        if (refine)
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            scene.render();
+            writer.write(scene.frameBuffer());
+            printf("final %dx%d in %.2fs\n", _width, _height, std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+        }
+        printf("first image after %.2fs\n", firstImage);
+        return firstImage;
+    }
+};
\ No newline at end of file
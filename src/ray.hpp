@@ -1,5 +1,6 @@
 #pragma once
 #include <eigen3/Eigen/Core>
+#include <cmath>
 
 class Ray
 {
@@ -8,6 +9,12 @@ class Ray
 private:
     Vec3 _orig;
     Vec3 _dir;
+    Vec3 _invDir; // reciprocal direction for slab tests, zero components are nudged to avoid NaN
+
+    // Offset rays one pixel right(x) and down(y), camera rays only
+    bool _hasDifferentials = false;
+    Vec3 _rxOrig, _rxDir;
+    Vec3 _ryOrig, _ryDir;
 
 public:
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
@@ -15,6 +22,11 @@ public:
     Ray(const Vec3 &orig, const Vec3 &direction) : _orig(orig)
     {
         _dir = direction.normalized();
+        for (int i : {0, 1, 2})
+        {
+            double d = std::abs(_dir[i]) < 1e-12 ? std::copysign(1e-12, _dir[i]) : _dir[i];
+            _invDir[i] = 1.0 / d;
+        }
     }
 
 public:
@@ -32,4 +44,47 @@ public:
     {
         return _dir;
     }
+    inline const Vec3 &invDir() const
+    {
+        return _invDir;
+    }
+
+public:
+    // Ray differentials for texture filtering, see Camera::rayWithDifferentials
+    inline void setDifferentials(const Ray &rx, const Ray &ry)
+    {
+        _hasDifferentials = true;
+        _rxOrig = rx._orig;
+        _rxDir = rx._dir;
+        _ryOrig = ry._orig;
+        _ryDir = ry._dir;
+    }
+    // Shrink the footprint when a pixel is covered by several samples
+    inline void scaleDifferentials(double s)
+    {
+        _rxOrig = _orig + (_rxOrig - _orig) * s;
+        _rxDir = _dir + (_rxDir - _dir) * s;
+        _ryOrig = _orig + (_ryOrig - _orig) * s;
+        _ryDir = _dir + (_ryDir - _dir) * s;
+    }
+    inline bool hasDifferentials() const
+    {
+        return _hasDifferentials;
+    }
+    inline const Vec3 &rxOrig() const
+    {
+        return _rxOrig;
+    }
+    inline const Vec3 &rxDir() const
+    {
+        return _rxDir;
+    }
+    inline const Vec3 &ryOrig() const
+    {
+        return _ryOrig;
+    }
+    inline const Vec3 &ryDir() const
+    {
+        return _ryDir;
+    }
 };
\ No newline at end of file
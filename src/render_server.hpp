@@ -0,0 +1,374 @@
+#pragma once
+#include <string>
+#include <sstream>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <new>
+#include <filesystem>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <poll.h>
+#include <eigen3/Eigen/Core>
+#include "scene.hpp"
+#include "camera.hpp"
+#include "image_encoder.hpp"
+#include "memory_tracker.hpp"
+#include "utils.hpp"
+#include "config.h"
+
+// One image requested from a RenderServer, unset fields keep the defaults of config.h
+struct RenderJob
+{
+    using Vec3 = Eigen::Vector3d;
+
+    int id = 0;
+    int priority = 0; // higher runs first, equal priorities in order of arrival
+    int width = FILM_WIDTH;
+    int height = FILM_HEIGHT;
+    int samplesSqrt = PIXEL_SAMPLES_SQRT;
+    Vec3 pos = CAMERA_POS;
+    Vec3 dir = CAMERA_LOOKAT;
+    Vec3 up = CAMERA_UP;
+    double hfov = CAMERA_HFOV;
+    int cropX = 0, cropY = 0, cropW = -1, cropH = -1; // cropW, cropH < 0 render to the film's edge
+    std::string output = OUTPUT_FILE;
+
+    // Reads "key=value" tokens, returns an error message or an empty string
+    std::string parse(std::istream &is)
+    {
+        std::string token;
+        while (is >> token)
+        {
+            std::size_t eq = token.find('=');
+            if (eq == std::string::npos)
+                return "expected key=value, got " + token;
+            std::string key = token.substr(0, eq);
+            std::istringstream value(token.substr(eq + 1));
+            char comma;
+            bool ok = true;
+            if (key == "priority")
+                ok = bool(value >> priority);
+            else if (key == "width")
+                ok = bool(value >> width);
+            else if (key == "height")
+                ok = bool(value >> height);
+            else if (key == "spp")
+            {
+                int spp;
+                ok = bool(value >> spp);
+                if (ok && spp < 1)
+                    return "spp must be positive";
+                samplesSqrt = int(std::lround(std::sqrt(double(spp))));
+                if (ok && samplesSqrt * samplesSqrt != spp)
+                    return "spp must be a square number";
+            }
+            else if (key == "pos" || key == "dir" || key == "up")
+            {
+                Vec3 &v = key == "pos" ? pos : key == "dir" ? dir
+                                                             : up;
+                ok = bool(value >> v[0] >> comma >> v[1] >> comma >> v[2]);
+            }
+            else if (key == "fov")
+                ok = bool(value >> hfov);
+            else if (key == "crop")
+                ok = bool(value >> cropX >> comma >> cropY >> comma >> cropW >> comma >> cropH);
+            else if (key == "out")
+                ok = bool(value >> output);
+            else
+                return "unknown key " + key;
+            if (!ok)
+                return "bad value for " + key;
+        }
+        if (width < 1 || height < 1 || samplesSqrt < 1)
+            return "width, height and spp must be positive";
+        if (int64_t(width) * height > SERVER_MAX_PIXELS)
+            return "film larger than " + std::to_string(SERVER_MAX_PIXELS) + " pixels";
+        if (cropW < 0)
+            cropW = width - cropX;
+        if (cropH < 0)
+            cropH = height - cropY;
+        if (cropX < 0 || cropY < 0 || cropW < 1 || cropH < 1 || int64_t(cropX) + cropW > width || int64_t(cropY) + cropH > height)
+            return "crop outside the film";
+        if (int64_t(cropW) * cropH * samplesSqrt * samplesSqrt > SERVER_MAX_SAMPLES)
+            return "more than " + std::to_string(SERVER_MAX_SAMPLES) + " samples";
+        if (!camera())
+            return "zero view direction or up parallel to it";
+        return _checkOutput();
+    }
+
+    std::shared_ptr<Camera> camera() const
+    {
+        return makePerspectiveCamera(width, height, pos, dir, up, hfov, CAMERA_FOCAL_LENGTH);
+    }
+
+private:
+    // Catches most bad output paths before rendering, the write itself can still fail
+    std::string _checkOutput() const
+    {
+        std::filesystem::path path(output);
+        std::filesystem::path dir = path.has_parent_path() ? path.parent_path() : std::filesystem::path(".");
+        std::error_code error;
+        if (output.empty() || std::filesystem::is_directory(path, error))
+            return "out is not a file path";
+        if (!std::filesystem::is_directory(dir, error) || access(dir.c_str(), W_OK))
+            return "cannot write to the directory of " + output;
+        return "";
+    }
+};
+
+// Keeps a loaded scene, its BVHs and textures resident and renders jobs sent over a Unix domain socket,
+// so a request pays for tracing only
+// The protocol is line based, a client sends
+//   render [priority=P] [width=W] [height=H] [spp=S] [pos=x,y,z] [dir=x,y,z] [up=x,y,z] [fov=deg] [crop=x,y,w,h] [out=path]
+//   cancel ID
+//   status
+//   shutdown
+// and receives "queued ID", then "started ID" and "done ID seconds path", "cancelled ID" or
+// "error ID message" when the image could not be written or memory ran out for its jobs, "job ID running|queued P" lines
+// ended by "end" for status, and "error message" for bad requests
+// Lines longer than SERVER_MAX_LINE bytes drop the client
+// Jobs over SERVER_MAX_PIXELS or SERVER_MAX_SAMPLES are refused
+// The cropped pixels are written to out, in the format its extension picks
+// Jobs render one at a time on the calling thread with all OpenMP threads, another thread serves the
+// clients, so jobs can be queued and cancelled while one is rendering. A running job stops after its current row
+class RenderServer
+{
+    using Vec3 = Eigen::Vector3d;
+
+private:
+    // Closed once neither the IO thread nor a job refers to it, so replies never reach a reused descriptor
+    struct Client
+    {
+        int fd;
+        std::string pending; // received bytes without a newline yet
+        std::mutex sendMutex;
+
+        explicit Client(int fd) : fd(fd){};
+        ~Client()
+        {
+            close(fd);
+        }
+        void reply(const std::string &line)
+        {
+            std::lock_guard<std::mutex> lock(sendMutex);
+            std::string message = line + "\n";
+            send(fd, message.data(), message.size(), MSG_NOSIGNAL);
+        }
+    };
+    struct QueuedJob
+    {
+        RenderJob job;
+        uint64_t order;
+        std::shared_ptr<Client> client;
+    };
+
+    Scene &_scene;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::vector<QueuedJob> _queue;
+    int _nextId = 1;
+    uint64_t _arrivals = 0;
+    int _runningId = 0; // 0 when idle
+    int _runningPriority = 0;
+    std::atomic<bool> _cancelRunning{false};
+    bool _stop = false;
+    int _listenFd = -1;
+
+private:
+    void _handle(const std::string &line, const std::shared_ptr<Client> &client)
+    {
+        std::istringstream is(line);
+        std::string command;
+        if (!(is >> command))
+            return;
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (command == "render")
+        {
+            QueuedJob queued{RenderJob(), _arrivals++, client};
+            std::string error = queued.job.parse(is);
+            if (!error.empty())
+                return client->reply("error " + error);
+            queued.job.id = _nextId++;
+            _queue.push_back(queued);
+            client->reply("queued " + std::to_string(queued.job.id));
+            _wake.notify_one();
+        }
+        else if (command == "cancel")
+        {
+            int id = 0;
+            is >> id;
+            auto it = std::find_if(_queue.begin(), _queue.end(), [id](const QueuedJob &queued)
+                                   { return queued.job.id == id; });
+            if (it != _queue.end())
+            {
+                it->client->reply("cancelled " + std::to_string(id));
+                if (it->client != client)
+                    client->reply("cancelled " + std::to_string(id));
+                _queue.erase(it);
+            }
+            else if (id != 0 && id == _runningId)
+                _cancelRunning = true; // the render loop replies once it has stopped
+            else
+                client->reply("error no job " + std::to_string(id));
+        }
+        else if (command == "status")
+        {
+            if (_runningId)
+                client->reply("job " + std::to_string(_runningId) + " running " + std::to_string(_runningPriority));
+            for (const QueuedJob &queued : _queue)
+                client->reply("job " + std::to_string(queued.job.id) + " queued " + std::to_string(queued.job.priority));
+            client->reply("end");
+        }
+        else if (command == "shutdown")
+        {
+            _stop = true;
+            _cancelRunning = true;
+            _wake.notify_one();
+            client->reply("bye");
+        }
+        else
+            client->reply("error unknown command " + command);
+    }
+
+    // Accepts clients and reads their commands until one of them sends shutdown
+    void _serveClients()
+    {
+        std::vector<std::shared_ptr<Client>> clients;
+        char buffer[4096];
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (_stop)
+                    break;
+            }
+            std::vector<pollfd> fds = {{_listenFd, POLLIN, 0}};
+            for (const auto &client : clients)
+                fds.push_back({client->fd, POLLIN, 0});
+            if (poll(fds.data(), fds.size(), -1) < 0)
+                continue;
+            if (fds[0].revents & POLLIN)
+            {
+                int fd = accept(_listenFd, nullptr, nullptr);
+                if (fd >= 0)
+                    clients.push_back(std::make_shared<Client>(fd));
+            }
+            for (std::size_t k = 1; k < fds.size(); k++)
+            {
+                if (!fds[k].revents)
+                    continue;
+                std::shared_ptr<Client> client = clients[k - 1];
+                ssize_t n = recv(client->fd, buffer, sizeof(buffer), 0);
+                if (n <= 0)
+                {
+                    // Jobs of a client that left still render, their replies are dropped
+                    clients[k - 1] = nullptr;
+                    continue;
+                }
+                client->pending.append(buffer, n);
+                std::size_t newline;
+                while ((newline = client->pending.find('\n')) != std::string::npos)
+                {
+                    std::string line = client->pending.substr(0, newline);
+                    client->pending.erase(0, newline + 1);
+                    _handle(line, client);
+                }
+                if (client->pending.size() > std::size_t(SERVER_MAX_LINE))
+                {
+                    client->reply("error line too long");
+                    clients[k - 1] = nullptr;
+                }
+            }
+            clients.erase(std::remove(clients.begin(), clients.end(), nullptr), clients.end());
+        }
+    }
+
+    void _render(const QueuedJob &queued)
+    {
+        const RenderJob &job = queued.job;
+        std::string id = std::to_string(job.id);
+        queued.client->reply("started " + id);
+        auto t0 = std::chrono::steady_clock::now();
+        _scene.setCamera(job.camera());
+        _scene.setSamplesSqrt(job.samplesSqrt);
+        TrackedVector<Vec3, MemTag::Framebuffer> image(std::size_t(job.cropW) * job.cropH);
+        if (!_scene.renderTile(job.cropX, job.cropY, job.cropW, job.cropH, image.data(), &_cancelRunning))
+            return queued.client->reply("cancelled " + id);
+        std::string error = ImageEncoder(job.cropW, job.cropH, job.output).tryWrite(image.data());
+        if (!error.empty())
+            return queued.client->reply("error " + id + " " + error);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        char message[64];
+        snprintf(message, sizeof(message), "done %s %.3f ", id.c_str(), seconds);
+        queued.client->reply(message + job.output);
+    }
+
+public:
+    // scene is loaded already and stays owned by the caller
+    explicit RenderServer(Scene &scene) : _scene(scene){};
+    RenderServer(const RenderServer &) = delete;
+    RenderServer &operator=(const RenderServer &) = delete;
+
+public:
+    // Serve on socketPath until a client sends shutdown, a stale socket file there is replaced
+    void run(const std::string &socketPath)
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(addr.sun_path))
+            RAISE_ERROR(("Socket path too long: " + socketPath).c_str());
+        std::copy(socketPath.begin(), socketPath.end(), addr.sun_path);
+        unlink(socketPath.c_str());
+        _listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (_listenFd < 0 || bind(_listenFd, (sockaddr *)&addr, sizeof(addr)) || listen(_listenFd, 16))
+            RAISE_ERROR(("Failed to listen on " + socketPath).c_str());
+        printf("Render server listening on %s\n", socketPath.c_str());
+
+        std::thread io(&RenderServer::_serveClients, this);
+        while (true)
+        {
+            QueuedJob queued;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake.wait(lock, [this]
+                           { return _stop || !_queue.empty(); });
+                if (_stop)
+                    break;
+                auto next = std::min_element(_queue.begin(), _queue.end(), [](const QueuedJob &a, const QueuedJob &b)
+                                             { return a.job.priority != b.job.priority ? a.job.priority > b.job.priority : a.order < b.order; });
+                queued = *next;
+                _queue.erase(next);
+                _runningId = queued.job.id;
+                _runningPriority = queued.job.priority;
+                _cancelRunning = false;
+            }
+            // A job the budgets let through can still run out of memory, it fails alone
+            try
+            {
+                _render(queued);
+            }
+            catch (const std::bad_alloc &)
+            {
+                queued.client->reply("error " + std::to_string(queued.job.id) + " out of memory");
+            }
+            std::lock_guard<std::mutex> lock(_mutex);
+            _runningId = 0;
+        }
+
+        io.join();
+        for (const QueuedJob &queued : _queue)
+            queued.client->reply("cancelled " + std::to_string(queued.job.id));
+        _queue.clear();
+        close(_listenFd);
+        unlink(socketPath.c_str());
+    }
+};
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include "material.hpp"
 #include "texture.hpp"
 #include <cmath>
+#include <atomic>
 #include "utils.hpp"
 
 class AABB
@@ -24,12 +25,12 @@ public:
     bool intersect(const Ray &ray) const
     {
         double tMin = 0.0f, tMax = INF;
-        Vec3 O = ray.orig();
-        Vec3 D = ray.dir();
+        const Vec3 &O = ray.orig();
+        const Vec3 &invD = ray.invDir();
         for (int i : {0, 1, 2})
         {
             double minBound = _min[i], maxBound = _max[i];
-            double tMinBound = (minBound - O[i]) / D[i], tMaxBound = (maxBound - O[i]) / D[i];
+            double tMinBound = (minBound - O[i]) * invD[i], tMaxBound = (maxBound - O[i]) * invD[i];
             if (tMinBound > tMaxBound)
                 std::swap(tMinBound, tMaxBound);
             tMin = std::max(tMin, tMinBound);
@@ -59,6 +60,35 @@ public:
         _min = _min.cwiseMin(aabb.min());
         _max = _max.cwiseMax(aabb.max());
     }
+    inline void expand(const Vec3 &p)
+    {
+        _min = _min.cwiseMin(p);
+        _max = _max.cwiseMax(p);
+    }
+    inline bool empty() const
+    {
+        return (_min.array() > _max.array()).any();
+    }
+    // Half of the surface area, which is all the SAH needs
+    inline double halfArea() const
+    {
+        if (empty())
+            return 0.0;
+        Vec3 l = len();
+        return l[0] * l[1] + l[1] * l[2] + l[2] * l[0];
+    }
+    inline AABB intersection(const AABB &aabb) const
+    {
+        return AABB(_min.cwiseMax(aabb.min()), _max.cwiseMin(aabb.max()));
+    }
+    // Part of the box between lo and hi along axis
+    inline AABB clip(int axis, double lo, double hi) const
+    {
+        AABB ret = *this;
+        ret._min[axis] = std::max(_min[axis], lo);
+        ret._max[axis] = std::min(_max[axis], hi);
+        return ret;
+    }
     inline const Vec3 &min() const
     {
         return _min;
@@ -69,11 +99,34 @@ public:
     }
 };
 
+// Held by every render while it traces rays, geometry must not be rebuilt while one is alive
+class RenderGuard
+{
+private:
+    static inline std::atomic<int> _active{0};
+
+public:
+    RenderGuard()
+    {
+        _active++;
+    }
+    ~RenderGuard()
+    {
+        _active--;
+    }
+    RenderGuard(const RenderGuard &) = delete;
+    RenderGuard &operator=(const RenderGuard &) = delete;
+    static bool rendering()
+    {
+        return _active.load() > 0;
+    }
+};
+
 class Renderable
 {
     using Vec3 = Eigen::Vector3d;
-    using MtlPtr = std::shared_ptr<Material>;
-    using TexPtr = std::shared_ptr<Texture>;
+    using MtlPtr = std::shared_ptr<const Material>;
+    using TexPtr = std::shared_ptr<const Texture>;
 
 protected:
     MtlPtr _material = nullptr;
@@ -87,21 +140,34 @@ public:
     void setMaterial(const MtlPtr &mtl)
     {
         _material = mtl;
+        Material::touch();
     }
     inline const AABB &aabb() const
     {
         return _aabb;
     }
+    // Every material a hit on this object may carry, for MaterialTable::compile
+    virtual void collectMaterials(std::vector<MtlPtr> &materials) const
+    {
+        if (_material)
+            materials.push_back(_material);
+    }
     virtual void setTexture(const TexPtr &tex) = 0;
     virtual Intersection intersect(const Ray &) const = 0;
     virtual void transform(const Vec3 &s, const Vec3 &r, const Vec3 &t) = 0;
+    // Bounds of the part of the object between lo and hi along axis, used by spatial-split BVH
+    // The default clips the bounding box, primitives can return a tighter box
+    virtual AABB clippedAABB(int axis, double lo, double hi) const
+    {
+        return _aabb.clip(axis, lo, hi);
+    }
 };
 
-class Shpere : public Renderable
+class Shpere final : public Renderable
 {
     using Vec3 = Eigen::Vector3d;
-    using MtlPtr = std::shared_ptr<Material>;
-    using TexPtr = std::shared_ptr<Texture>;
+    using MtlPtr = std::shared_ptr<const Material>;
+    using TexPtr = std::shared_ptr<const Texture>;
 
 private:
     Vec3 _c = {0.0f, 0.0f, -5.0f};
@@ -144,9 +210,7 @@ public:
         if (ray.dir().dot(inter.normal) > 0.0f)
             inter.normal = -inter.normal;
         if (_material)
-            inter.mtl = _material;
-        else
-            inter.mtl = DEFAULT_MATERIAL;
+            inter.materialId = _material->id();
         return inter;
     }
 
@@ -163,15 +227,38 @@ public:
     }
 };
 
-class Triangle : public Renderable
+// Moller-Trumbore ray-triangle test against the triangle v0, v0+e1, v0+e2
+// Solves o+td=v0+beta*e1+gamma*e2, accepts hits in [EPS, tMax)
+inline bool intersectTriangle(const Eigen::Vector3d &v0, const Eigen::Vector3d &e1, const Eigen::Vector3d &e2,
+                              const Eigen::Vector3d &o, const Eigen::Vector3d &d, double tMax,
+                              double &t, double &beta, double &gamma)
+{
+    Eigen::Vector3d p = d.cross(e2);
+    double det = e1.dot(p);
+    if (std::abs(det) < EPS)
+        return false;
+    double invDet = 1.0 / det;
+    Eigen::Vector3d s = o - v0;
+    beta = s.dot(p) * invDet;
+    if (beta < 0.0 || beta > 1.0)
+        return false;
+    Eigen::Vector3d q = s.cross(e1);
+    gamma = d.dot(q) * invDet;
+    if (gamma < 0.0 || gamma + beta > 1.0)
+        return false;
+    t = e2.dot(q) * invDet;
+    return t >= EPS && t < tMax;
+}
+
+class Triangle final : public Renderable
 {
     // By default, triangle use (v1-v0).cross(v2-v0) as face normal
     // This can be changed via setFaceNormal()
     using Vec3 = Eigen::Vector3d;
     using Vec2 = Eigen::Vector2d;
     using Mat3 = Eigen::Matrix3d;
-    using MtlPtr = std::shared_ptr<Material>;
-    using TexPtr = std::shared_ptr<Texture>;
+    using MtlPtr = std::shared_ptr<const Material>;
+    using TexPtr = std::shared_ptr<const Texture>;
 
 private:
     Vec3 _v[3];                   // counter-clockwise vertices
@@ -184,55 +271,48 @@ public:
     {
         _v[0] = v0, _v[1] = v1, _v[2] = v2;
         _normal = (v1 - v0).cross(v2 - v0).normalized();
-        Mat3 V;
         Vec3 min = _v[0].cwiseMin(_v[1].cwiseMin(_v[2]));
         Vec3 max = _v[0].cwiseMax(_v[1].cwiseMax(_v[2]));
         _aabb.set(min, max);
     };
 
-public: // override functions
-    // Why so slow?
-    Intersection intersect(const Ray &ray) const override
+private:
+    inline Vec2 _uvAt(double beta, double gamma) const
     {
-        Intersection inter;
-        if (!_aabb.intersect(ray))
-            return inter;
-
-        // SOLVE: o+td=a+beta*e1+gamma*e2
-        // That is, [e1,e2,-d][beta,gamma,t]^T=o-a
-
-        const Vec3 &a_b = _v[0] - _v[1], a_c = _v[0] - _v[2], d = ray.dir(), b = _v[0] - ray.orig();
-        Mat3 A, Beta, Gamma, T;
-        A << a_b, a_c, d;
-        double detA = A.determinant();
-        if (std::abs(detA) < EPS)
-            return inter;
-
-        Beta << b, a_c, d;
-        double beta = Beta.determinant() / detA;
-        if (beta < 0.0 || beta > 1.0f)
-            return inter;
-
-        Gamma << a_b, b, d;
-        double gamma = Gamma.determinant() / detA;
-        if (gamma < 0.0f || gamma + beta > 1.0f)
-            return inter;
-
-        T << a_b, a_c, b;
-        double t = T.determinant() / detA;
-        if (t < EPS)
-            return inter;
-        double alpha = 1.0f - beta - gamma;
+        return (1.0 - beta - gamma) * _vt[0] + beta * _vt[1] + gamma * _vt[2];
+    }
+    // Barycentric coordinates where the ray o+td meets the triangle's plane, may lie outside the triangle
+    bool _planeBarycentric(const Vec3 &o, const Vec3 &d, double &beta, double &gamma) const
+    {
+        Vec3 e1 = _v[1] - _v[0], e2 = _v[2] - _v[0];
+        Vec3 n = e1.cross(e2);
+        double denom = d.dot(n);
+        // Relative to both lengths so the test is the ray's angle to the plane whatever the triangle's size,
+        // degenerate triangles are rejected too
+        if (std::abs(denom) <= EPS * n.norm() * d.norm())
+            return false;
+        Vec3 p = o + d * ((_v[0] - o).dot(n) / denom) - _v[0];
+        double d00 = e1.dot(e1), d01 = e1.dot(e2), d11 = e2.dot(e2);
+        double d20 = p.dot(e1), d21 = p.dot(e2);
+        double invDet = 1.0 / (d00 * d11 - d01 * d01);
+        beta = (d11 * d20 - d01 * d21) * invDet;
+        gamma = (d00 * d21 - d01 * d20) * invDet;
+        return true;
+    }
 
+public:
+    // Fill in the intersection at o+td=v0+beta*(v1-v0)+gamma*(v2-v0)
+    Intersection hitAt(const Ray &ray, double t, double beta, double gamma) const
+    {
+        Intersection inter;
+        double alpha = 1.0 - beta - gamma;
         double hitDir = (ray.dir().dot(_normal) > 0.0f ? -1.0f : 1.0f);
         inter.happen = true;
         inter.pos = ray(t);
 
         // If no material specified, use default material
         if (_material)
-            inter.mtl = _material;
-        else
-            inter.mtl = DEFAULT_MATERIAL;
+            inter.materialId = _material->id();
 
         // If vertex normal specified, use interpolation between vertex normals
         if (_n[0].isZero())
@@ -241,19 +321,63 @@ public: // override functions
             inter.normal = (alpha * _n[0] + beta * _n[1] + gamma * _n[2]) * hitDir;
 
         // If uv and texture specified, use interpolation to get diffuse color
-        if (!_vt[0].isZero() && _texture)
+        // The footprint of the pixel in uv space comes from where the differential rays meet the plane
+        // uv is kept even without a texture, an instance may bring its own
+        if (!_vt[0].isZero())
+        {
+            inter.hasUV = true;
+            inter.uv = _uvAt(beta, gamma);
+            double bx, gx, by, gy;
+            if (ray.hasDifferentials() &&
+                _planeBarycentric(ray.rxOrig(), ray.rxDir(), bx, gx) &&
+                _planeBarycentric(ray.ryOrig(), ray.ryDir(), by, gy))
+            {
+                inter.duvdx = _uvAt(bx, gx) - inter.uv;
+                inter.duvdy = _uvAt(by, gy) - inter.uv;
+            }
+        }
+        if (inter.hasUV && _texture)
         {
-            Vec2 uv = alpha * _vt[0] + beta * _vt[1] + gamma * _vt[2];
-            Vec3 color=_texture->getColor(uv[0],uv[1]);
-            inter.texColor = std::make_shared<Vec3>(color);
+            inter.texColor = _texture->getColor(inter.uv, inter.duvdx, inter.duvdy);
+            inter.hasTexColor = true;
         }
 
         inter.t = t;
         inter.viewDir = -ray.dir();
-
         return inter;
     }
 
+public: // override functions
+    Intersection intersect(const Ray &ray) const override
+    {
+        if (!_aabb.intersect(ray))
+            return Intersection();
+        double t, beta, gamma;
+        if (!intersectTriangle(_v[0], _v[1] - _v[0], _v[2] - _v[0], ray.orig(), ray.dir(), INF, t, beta, gamma))
+            return Intersection();
+        return hitAt(ray, t, beta, gamma);
+    }
+
+    // Clip the triangle against the slab, bound the vertices inside and the edge crossings
+    AABB clippedAABB(int axis, double lo, double hi) const override
+    {
+        AABB ret;
+        for (int i = 0; i < 3; i++)
+        {
+            const Vec3 &a = _v[i], &b = _v[(i + 1) % 3];
+            if (a[axis] >= lo && a[axis] <= hi)
+                ret.expand(a);
+            for (double plane : {lo, hi})
+                if ((a[axis] - plane) * (b[axis] - plane) < 0.0)
+                {
+                    Vec3 p = a + (plane - a[axis]) / (b[axis] - a[axis]) * (b - a);
+                    p[axis] = plane;
+                    ret.expand(p);
+                }
+        }
+        return ret.intersection(_aabb);
+    }
+
     void transform(const Vec3 &s, const Vec3 &r, const Vec3 &t)
     {
         _v[0] = _v[0].cwiseProduct(s);
@@ -281,137 +405,28 @@ public:
         _vt[1] = uv1;
         _vt[2] = uv2;
     }
-    void setFaceNormal(const Vec3 &n)
+    inline const Vec3 &vertex(int i) const
     {
-        _normal = n.normalized();
+        return _v[i];
     }
-    void setTexture(const TexPtr &tex)
+    inline const Vec3 &vertexNormal(int i) const
     {
-        _texture = tex;
+        return _n[i];
     }
-};
-
-class BVHNode
-{
-    using ObjPtr = std::shared_ptr<Renderable>;
-    using NodePtr = std::shared_ptr<BVHNode>;
-    using Vec3 = Eigen::Vector3d;
-
-private:
-    NodePtr _left = nullptr;
-    NodePtr _right = nullptr;
-    AABB _aabb;
-    ObjPtr _obj = nullptr;
-
-public:
-    BVHNode(){};
-
-public:
-    Intersection intersect(const Ray &ray) const
+    inline const Vec2 &vertexUV(int i) const
     {
-        if (!_aabb.intersect(ray))
-            return Intersection();
-        if (!_left)
-            return _obj->intersect(ray);
-        Intersection i1 = _left->intersect(ray);
-        Intersection i2 = _right->intersect(ray);
-        return i1.t < i2.t ? i1 : i2;
+        return _vt[i];
     }
-
-public:
-    static NodePtr build(std::vector<ObjPtr> objs)
+    inline const Vec3 &faceNormal() const
     {
-        NodePtr root = std::make_shared<BVHNode>();
-        assert(objs.size() > 0);
-        std::vector<ObjPtr> leftObj, rightObj;
-        if (objs.size() == 1)
-        {
-            root->_aabb = objs[0]->aabb();
-            root->_obj = objs[0];
-            return root;
-        }
-
-        root->_aabb.set(Vec3{INF, INF, INF}, Vec3{-INF, -INF, -INF});
-        for (const ObjPtr &obj : objs)
-            root->_aabb.expand(obj->aabb());
-
-        int maxDim;
-        root->_aabb.len().maxCoeff(&maxDim);
-        double divisionx2 = root->_aabb.min()[maxDim] + root->_aabb.max()[maxDim];
-
-        for (const ObjPtr &obj : objs)
-        {
-            if (obj->aabb().min()[maxDim] + obj->aabb().max()[maxDim] > divisionx2)
-                rightObj.push_back(obj);
-            else
-                leftObj.push_back(obj);
-        }
-        if (leftObj.size() == 0)
-        {
-            leftObj.push_back(rightObj.back());
-            rightObj.pop_back();
-        }
-        else if (rightObj.size() == 0)
-        {
-            rightObj.push_back(leftObj.back());
-            leftObj.pop_back();
-        }
-        root->_left = build(std::move(leftObj));
-        root->_right = build(std::move(rightObj));
-        return root;
-    }
-};
-
-class Mesh : public Renderable
-{
-    using Vec3 = Eigen::Vector3d;
-    using MtlPtr = std::shared_ptr<Material>;
-    using TexPtr = std::shared_ptr<Texture>;
-    using ObjPtr = std::shared_ptr<Renderable>;
-    using NodePtr = std::shared_ptr<BVHNode>;
-
-private:
-    std::vector<ObjPtr> _primitives;
-    NodePtr _bvh = nullptr;
-
-public:
-    Mesh()
-    {
-        _aabb.set(Vec3{INF, INF, INF}, Vec3{-INF, -INF, -INF});
-    };
-
-public: // override functions
-    Intersection intersect(const Ray &ray) const override
-    {
-        Intersection inter = _bvh->intersect(ray);
-        inter.mtl = _material;
-        return inter;
-    }
-    void transform(const Vec3 &s, const Vec3 &r, const Vec3 &t)
-    {
-        for (const ObjPtr &prim : _primitives)
-            prim->transform(s, r, t);
-        buildBVH();
-    }
-
-public: // parameter setters
-    void appendTriangle(ObjPtr triangle)
-    {
-        _primitives.push_back(triangle);
-        _aabb.expand(triangle->aabb());
-        _bvh = nullptr;
+        return _normal;
     }
-    void buildBVH()
-    {
-        _bvh = BVHNode::build(_primitives);
-    }
-    inline std::size_t numTriangles() const
+    void setFaceNormal(const Vec3 &n)
     {
-        return _primitives.size();
+        _normal = n.normalized();
     }
-    void setTexture(const TexPtr &tex) override
+    void setTexture(const TexPtr &tex)
     {
-        for (const ObjPtr &prim : _primitives)
-            prim->setTexture(tex);
+        _texture = tex;
     }
-};
\ No newline at end of file
+};
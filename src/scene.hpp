@@ -1,6 +1,8 @@
 #pragma once
 #include "camera.hpp"
 #include "renderable.hpp"
+#include "mesh.hpp"
+#include <variant>
 #include <vector>
 #include <eigen3/Eigen/Core>
 #include "config.h"
@@ -10,6 +12,15 @@
 #include "shader.hpp"
 #include "callback_base.hpp"
 #include "easy_random.hpp"
+#include "memory_tracker.hpp"
+#include "material_table.hpp"
+#include "image_encoder.hpp"
+#include "checkpoint.hpp"
+#include "denoiser.hpp"
+#include "gbuffer.hpp"
+#include "tile_tracker.hpp"
+#include <chrono>
+#include <atomic>
 
 class Scene : public SceneBase
 {
@@ -17,12 +28,34 @@ class Scene : public SceneBase
     using ObjPtr = std::shared_ptr<Renderable>;
     using LightPtr = std::shared_ptr<Light>;
     using CameraPtr = std::shared_ptr<Camera>;
+    // Closed set of primitive kinds, the final classes let each arm call intersect directly
+    // Any other Renderable falls back to the virtual call
+    using ObjRef = std::variant<const Mesh *, const Shpere *, const Instance *, const Renderable *>;
 
 private:
     CameraPtr _camera = nullptr;
     std::vector<ObjPtr> _objs;
+    std::vector<ObjRef> _objRefs; // typed view of _objs for dispatch without virtual calls
     std::vector<LightPtr> _lights;
-    Vec3 *_frameBuffer = nullptr;
+    MaterialTable _materials;
+    Vec3 *_frameBuffer = nullptr; // full frame, only allocated when rendering without a stream
+    std::size_t _frameBufferPixels = 0;
+    TrackedVector<uint16_t, MemTag::Framebuffer> _sampleCounts; // samples accumulated per pixel
+    std::string _checkpointPath;
+    double _checkpointInterval = 0.0;
+    bool _resumed = false; // the next render continues the loaded rows
+    bool _renderAOVs = false;
+    bool _cacheGBuffer = false;
+    GBuffer _gbuffer; // primary hits of the last render for relight()
+    TrackedVector<uint32_t, MemTag::Framebuffer> _shadowOccluders; // of the cached hits, see PhongShader::setShadowCache
+    int _cropX = 0, _cropY = 0, _cropW = -1, _cropH = -1; // negative size for the full film
+    bool _trackTiles = false;
+    bool _tracking = false; // rays are being recorded into _tiles
+    TileTracker _tiles;
+    bool _materialsCompiled = false;
+    uint64_t _compiledEdits = 0; // Material::edits() when the table was compiled
+    int _samplesSqrt = PIXEL_SAMPLES_SQRT;
+    AOVBuffers _aovs;
     // Ray-scene intersection callback
     // Can be implemented more efficient
     PhongShader shader;
@@ -34,21 +67,296 @@ public:
     };
     ~Scene()
     {
+        _freeFrameBuffer();
+    }
+
+private:
+    // object is set to the index of the object hit, -1 for a miss
+    Intersection _closestHit(const Ray &ray, int &object) const
+    {
+        Intersection ret;
+        object = -1;
+        for (int k = 0; k < _objRefs.size(); k++)
+        {
+            Intersection intersection = std::visit([&ray](auto obj)
+                                                   { return obj->intersect(ray); },
+                                                   _objRefs[k]);
+            if (intersection.t < ret.t)
+            {
+                ret = intersection;
+                object = k;
+            }
+        }
+        return ret;
+    }
+    void _freeFrameBuffer()
+    {
+        if (_frameBuffer)
+            MemoryTracker::instance().freed(MemTag::Framebuffer, _frameBufferPixels * sizeof(Vec3));
         delete[] _frameBuffer;
+        _frameBuffer = nullptr;
+        _frameBufferPixels = 0;
+    }
+    void _allocFrameBuffer()
+    {
+        std::size_t pixels = std::size_t(_camera->nHorzPix()) * _camera->nVertPix();
+        if (_frameBuffer && _frameBufferPixels == pixels)
+            return;
+        _freeFrameBuffer();
+        _frameBuffer = new Vec3[pixels];
+        _frameBufferPixels = pixels;
+        MemoryTracker::instance().allocated(MemTag::Framebuffer, pixels * sizeof(Vec3));
+        _sampleCounts.assign(pixels, 0);
+    }
+    // The AOVs follow the film, also when they are enabled after the framebuffer was allocated
+    void _allocAOVs()
+    {
+        std::size_t pixels = std::size_t(_camera->nHorzPix()) * _camera->nVertPix();
+        if (_renderAOVs && _aovs.albedo.size() != pixels)
+            _aovs.resize(pixels);
+        _aovs.spp = _samplesSqrt * _samplesSqrt;
+    }
+    // Guide color of a first hit for the denoiser, only diffuse surfaces are demodulated
+    Vec3 _albedo(const Intersection &hit) const
+    {
+        if (!hit.happen)
+            return Vec3::Ones();
+        const MaterialRecord &mtl = _materials[hit.materialId];
+        if (mtl.type != MaterialType::Diffuse)
+            return Vec3::Ones();
+        return hit.hasTexColor ? hit.texColor : mtl.kd;
+    }
+    // Per-sample buffers of one span of a row
+    struct SpanScratch
+    {
+        TrackedVector<Intersection, MemTag::Scratch> hits;
+        TrackedVector<Vec3, MemTag::Scratch> colors;
+        TrackedVector<int, MemTag::Scratch> order;
+
+        SpanScratch(int pixels, int spp)
+        {
+            std::size_t samples = std::size_t(pixels) * spp;
+            hits.resize(samples);
+            colors.resize(samples);
+            order.resize(samples);
+        }
+    };
+    // Trace the primary samples of pixels [j0, j1) of row i into scratch.hits
+    void _traceSpan(int i, int j0, int j1, SpanScratch &scratch)
+    {
+        int w = _camera->nHorzPix();
+        int n = _samplesSqrt, spp = n * n;
+        Intersection *hits = scratch.hits.data();
+#ifdef MULTI_THREAD
+#pragma omp parallel for schedule(dynamic, NUM_THREADS)
+#endif
+        for (int j = j0; j < j1; j++)
+        {
+            if (_tracking)
+                _tiles.enter(i, j);
+            RandomSequence::local().seed(RandomSequence::key(RENDER_SEED, uint64_t(i) * w + j, CameraStream));
+            // Jittered n*n strata, the texture footprint shrinks with the stratum size
+            for (int s = 0; s < spp; s++)
+            {
+                double a = i + (s / n + 0.5) / n - 0.5 + easyUniform() * 0.5 / n;
+                double b = j + (s % n + 0.5) / n - 0.5 + easyUniform() * 0.5 / n;
+                Ray ray = _camera->rayWithDifferentials(a, b);
+                ray.scaleDifferentials(1.0 / n);
+                hits[(j - j0) * spp + s] = intersect(ray);
+            }
+        }
+    }
+    // Shade the hits in scratch grouped by material type, one specialized kernel per group,
+    // and average them into pixels [j0, j1) of row i in out
+    void _shadeSpan(int i, int j0, int j1, Vec3 *out, SpanScratch &scratch)
+    {
+        int w = _camera->nHorzPix();
+        int spp = _samplesSqrt * _samplesSqrt;
+        int samples = (j1 - j0) * spp;
+        const Intersection *hits = scratch.hits.data();
+        Vec3 *colors = scratch.colors.data();
+        int *order = scratch.order.data();
+        constexpr int nTypes = int(MaterialType::Count);
+
+        // Counting sort of the hits by material type, misses get the background
+        int begin[nTypes + 1] = {0};
+        for (int k = 0; k < samples; k++)
+        {
+            if (hits[k].happen)
+                begin[int(_materials[hits[k].materialId].type) + 1]++;
+            else
+                colors[k] = BG_COLOR;
+        }
+        for (int t = 0; t < nTypes; t++)
+            begin[t + 1] += begin[t];
+        int next[nTypes];
+        std::copy(begin, begin + nTypes, next);
+        for (int k = 0; k < samples; k++)
+            if (hits[k].happen)
+                order[next[int(_materials[hits[k].materialId].type)]++] = k;
+        // Sample k of the span is sample (i * w + j0) * spp + k of the image
+        for (int t = 0; t < nTypes; t++)
+            shader.shadeBatch(MaterialType(t), hits, order + begin[t], begin[t + 1] - begin[t], colors,
+                              (uint64_t(i) * w + j0) * spp);
+
+        for (int j = 0; j < j1 - j0; j++)
+        {
+            Vec3 color = Vec3::Zero();
+            for (int s = 0; s < spp; s++)
+                color += colors[j * spp + s];
+            out[j] = color / spp;
+        }
+    }
+    // Pixels [j0, j1) of row i into out, in two passes: all primary samples are traced first and
+    // their hits are then shaded
+    void _renderSpan(int i, int j0, int j1, Vec3 *out, SpanScratch &scratch)
+    {
+        _traceSpan(i, j0, j1, scratch);
+        _shadeSpan(i, j0, j1, out, scratch);
+    }
+    // Average the first hits of pixels [j0, j1) of row i and the moments of their shaded samples into the AOVs
+    void _storeAOVs(const SpanScratch &scratch, int i, int j0, int j1, int spp)
+    {
+        int w = _camera->nHorzPix();
+        const Intersection *hits = scratch.hits.data();
+        const Vec3 *colors = scratch.colors.data();
+        for (int j = j0; j < j1; j++)
+        {
+            Vec3 albedo = Vec3::Zero(), normal = Vec3::Zero();
+            double depth = 0.0;
+            int nHits = 0;
+            for (int s = 0; s < spp; s++)
+            {
+                const Intersection &hit = hits[(j - j0) * spp + s];
+                albedo += _albedo(hit);
+                if (hit.happen)
+                {
+                    normal += hit.normal;
+                    depth += hit.t;
+                    nHits++;
+                }
+            }
+            std::size_t p = std::size_t(i) * w + j;
+            _aovs.albedo[p] = albedo / spp;
+            _aovs.normal[p] = normal.isZero() ? normal : normal.normalized();
+            _aovs.depth[p] = nHits ? depth / nHits : 0.0;
+            // Of the irradiance the denoiser filters, see AtrousDenoiser
+            double m1 = 0.0, m2 = 0.0;
+            for (int s = 0; s < spp; s++)
+            {
+                const Vec3 irradiance = colors[(j - j0) * spp + s].cwiseQuotient(_aovs.albedo[p].cwiseMax(0.01));
+                double l = 0.2126 * irradiance[0] + 0.7152 * irradiance[1] + 0.0722 * irradiance[2];
+                m1 += l;
+                m2 += l * l;
+            }
+            _aovs.moment1[p] = m1 / spp;
+            _aovs.moment2[p] = m2 / spp;
+        }
+    }
+    AABB _bounds() const
+    {
+        AABB bounds;
+        for (const ObjPtr &obj : _objs)
+            bounds.expand(obj->aabb());
+        return bounds;
+    }
+    RenderCheckpoint _checkpointHeader() const
+    {
+        RenderCheckpoint checkpoint;
+        checkpoint.width = _camera->nHorzPix();
+        checkpoint.height = _camera->nVertPix();
+        checkpoint.spp = _samplesSqrt * _samplesSqrt;
+        checkpoint.seed = RENDER_SEED;
+        return checkpoint;
     }
 
 public:
     // TODO: 引用修正
     void setCamera(CameraPtr camera)
     {
+        _freeFrameBuffer();
+        _gbuffer.clear();
+        _shadowOccluders = TrackedVector<uint32_t, MemTag::Framebuffer>();
+        _tiles = TileTracker();
         _camera = camera;
-        delete[] _frameBuffer;
-        int bufferSize = (camera->nHorzPix()) * (camera->nVertPix());
-        _frameBuffer = new Vec3[bufferSize];
+    }
+    // Keep the primary hits of every sample of the next renders so relight() can shade them again
+    // (full-frame rendering from the first row only)
+    void setCacheGBuffer(bool enable)
+    {
+        _cacheGBuffer = enable;
+        if (!enable)
+        {
+            _gbuffer.clear();
+            _shadowOccluders = TrackedVector<uint32_t, MemTag::Framebuffer>();
+        }
+    }
+    // Render only pixels [x, x + w) x [y, y + h) of the film, clearCropWindow() for all of them
+    void setCropWindow(int x, int y, int w, int h)
+    {
+        _cropX = std::max(0, x), _cropY = std::max(0, y);
+        _cropW = std::max(0, w + std::min(0, x)), _cropH = std::max(0, h + std::min(0, y));
+    }
+    void clearCropWindow()
+    {
+        _cropW = _cropH = -1;
+    }
+    // Record per tile of DIRTY_TILE_SIZE pixels which objects the rays of the next renders hit,
+    // for objectChanged() and renderDirty()(full-frame rendering from the first row only)
+    void setTrackTiles(bool enable)
+    {
+        _trackTiles = enable;
+        if (!enable)
+            _tiles = TileTracker();
+    }
+    // n * n jittered samples per pixel, PIXEL_SAMPLES_SQRT by default
+    void setSamplesSqrt(int n)
+    {
+        _samplesSqrt = n;
+    }
+    // Primary visibility and direct lighting only, reflection and refraction are skipped, for previews
+    void setDirectOnly(bool enable)
+    {
+        shader.setDirectOnly(enable);
+    }
+    // Also render albedo, normal and depth of the first hits, see aovs()(full-frame rendering only)
+    void setRenderAOVs(bool enable)
+    {
+        _renderAOVs = enable;
+        if (!enable)
+            _aovs = AOVBuffers();
+    }
+    // Save the finished rows to path every intervalSeconds while rendering, removed once the render completes
+    void setCheckpoint(const std::string &path, double intervalSeconds)
+    {
+        _checkpointPath = path;
+        _checkpointInterval = intervalSeconds;
+    }
+    // Load the rows a previous render of this scene finished, render() then continues after them
+    // Returns false if there is no checkpoint at path
+    bool resume(const std::string &path)
+    {
+        _allocFrameBuffer();
+        _allocAOVs();
+        RenderCheckpoint checkpoint = _checkpointHeader();
+        if (!checkpoint.load(path, _frameBuffer, _sampleCounts.data(), _renderAOVs ? &_aovs : nullptr))
+            return false;
+        _resumed = true;
+        printf("Resuming from %s, %d/%d rows done\n", path.c_str(), checkpoint.rowsDone, checkpoint.height);
+        return true;
     }
     void addObject(ObjPtr renderable)
     {
         _objs.push_back(renderable);
+        _materialsCompiled = false;
+        if (const Mesh *mesh = dynamic_cast<const Mesh *>(renderable.get()))
+            _objRefs.push_back(mesh);
+        else if (const Shpere *sphere = dynamic_cast<const Shpere *>(renderable.get()))
+            _objRefs.push_back(sphere);
+        else if (const Instance *instance = dynamic_cast<const Instance *>(renderable.get()))
+            _objRefs.push_back(instance);
+        else
+            _objRefs.push_back(renderable.get());
     }
     void addLight(LightPtr light)
     {
@@ -57,56 +365,268 @@ public:
 
     Intersection intersect(const Ray &ray) const
     {
-        Intersection ret;
-        for (const auto &obj : _objs)
-        {
-            Intersection intersection = obj->intersect(ray);
-            if (intersection.t < ret.t)
-                ret = intersection;
-        }
+        int object;
+        Intersection ret = _closestHit(ray, object);
+        if (_tracking)
+            _tiles.record(ray, object, ret.t);
         return ret;
     }
+    Intersection intersectShadow(const Ray &ray) const override
+    {
+        int object;
+        Intersection ret = _closestHit(ray, object);
+        if (_tracking)
+            _tiles.record(ray, object, ret.t, true);
+        return ret;
+    }
+    // Rays of a sample the shader traces from now on belong to that sample's pixel
+    void enterSample(uint64_t sample) const override
+    {
+        if (!_tracking)
+            return;
+        uint64_t pixel = sample / (_samplesSqrt * _samplesSqrt);
+        int w = _camera->nHorzPix();
+        _tiles.enter(int(pixel / w), int(pixel % w));
+    }
+
+    // Collect the materials of every object into the flat table hits are shaded from
+    void compileMaterials()
+    {
+        _compiledEdits = Material::edits();
+        std::vector<std::shared_ptr<const Material>> materials;
+        for (const ObjPtr &obj : _objs)
+            obj->collectMaterials(materials);
+        _materials.compile(materials);
+        _materialsCompiled = true;
+    }
+    // Compile again only after objects were added or a material was edited or assigned
+    void updateMaterials()
+    {
+        if (!_materialsCompiled || _compiledEdits != Material::edits())
+            compileMaterials();
+    }
 
-    void render() const
+    // Rows are rendered one after another, see _renderSpan, only the crop window's part of them if one is set
+    // Pixels outside the crop window keep what the framebuffer held
+    // With a stream, finished bands of STREAM_BAND_ROWS rows are written to it and their memory
+    // reused, no full frame is held and frameBuffer() stays empty
+    // Random numbers are drawn from per-pixel and per-sample keys, so rows rendered after resume()
+    // come out exactly as in an uninterrupted render
+    void render(ImageStream *stream = nullptr)
     {
-        double pixXOffset[] = {-0.25, -0.25, 0.25, 0.25};  //perform anti-aliasing
-        double pixYOffset[] = {-0.25, 0.25, -0.25, 0.25};
+        RenderGuard guard;
+        updateMaterials();
         int w = _camera->nHorzPix(), h = _camera->nVertPix();
-        std::uniform_real_distribution<double> distrib(-0.25, 0.25);
-        for (int i = 0; i < h; i++)
+        TrackedVector<Vec3, MemTag::Framebuffer> band;
+        if (stream && !_checkpointPath.empty())
+            RAISE_ERROR("Checkpoints need the full framebuffer, they cannot be combined with streaming");
+        if (stream && _renderAOVs)
+            RAISE_ERROR("AOVs are full-frame buffers, they cannot be combined with streaming");
+        if (stream && _cacheGBuffer)
+            RAISE_ERROR("The G-buffer holds the full frame, it cannot be combined with streaming");
+        bool cropped = _cropW >= 0;
+        int x0 = cropped ? _cropX : 0, y0 = cropped ? _cropY : 0;
+        int x1 = cropped ? std::min(w, _cropX + _cropW) : w, y1 = cropped ? std::min(h, _cropY + _cropH) : h;
+        if (stream && cropped)
+            RAISE_ERROR("Streams take whole rows, a crop window cannot be combined with streaming");
+        if (stream)
+        {
+            _freeFrameBuffer();
+            band.resize(std::size_t(w) * std::min(h, STREAM_BAND_ROWS));
+        }
+        else
+        {
+            _allocFrameBuffer();
+            _allocAOVs();
+        }
+        if (!_resumed)
+            std::fill(_sampleCounts.begin(), _sampleCounts.end(), 0);
+        _resumed = false;
+        int spp = _samplesSqrt * _samplesSqrt;
+        SpanScratch scratch(w, spp);
+        // Rows finish in order, a resumed render starts at the first one missing samples
+        int first = y0;
+        while (!stream && first < y1 && _sampleCounts[std::size_t(first) * w + x1 - 1] == spp)
+            first++;
+        // Rows restored from a checkpoint were traced by another process
+        _gbuffer.clear();
+        if (_cacheGBuffer && first == 0 && !cropped)
+        {
+            _gbuffer.resize(w, h, spp);
+            _shadowOccluders.resize(std::size_t(w) * h * spp * PhongShader::shadowLights(_lights));
+            shader.setShadowCache(_shadowOccluders.data(), false);
+        }
+        // Tiles record the rays of full-frame renders from the first row, for objectChanged()
+        _tracking = _trackTiles && !stream && first == 0 && !cropped;
+        if (_tracking)
+        {
+            AABB bounds = _bounds();
+            bounds.expand(_camera->position());
+            _tiles.reset(w, h, DIRTY_TILE_SIZE, _objs.size(), bounds, DIRTY_GRID_RESOLUTION, DIRTY_SHADOW_GRID_RESOLUTION);
+        }
+        else
+            _tiles = TileTracker();
+        auto lastCheckpoint = std::chrono::steady_clock::now();
+        for (int i = first; i < y1; i++)
         {
             printf("%d/%d\n", i, h);
-            int rowOffset = i * w;
-#ifdef MULTI_THREAD
-#pragma omp parallel for schedule(dynamic, NUM_THREADS)
-#endif
-            for (int j = 0; j < w; j++)
+            Vec3 *row = stream ? band.data() + std::size_t(i % STREAM_BAND_ROWS) * w : _frameBuffer + std::size_t(i) * w;
+            _renderSpan(i, x0, x1, row + x0, scratch);
+            if (_renderAOVs)
+                _storeAOVs(scratch, i, x0, x1, spp);
+            if (_cacheGBuffer && first == 0 && !cropped)
+                _gbuffer.storeRow(i, scratch.hits.data());
+            if (stream && ((i + 1) % STREAM_BAND_ROWS == 0 || i + 1 == h))
+                stream->writeRows(band.data(), i % STREAM_BAND_ROWS + 1);
+            if (!stream)
             {
-                int bufferOffset = rowOffset + j;
-                Vec3 color = Vec3::Zero();
-                for (int s = 0; s < 4; s++)
+                std::fill_n(_sampleCounts.begin() + std::size_t(i) * w + x0, x1 - x0, spp);
+                auto now = std::chrono::steady_clock::now();
+                if (!_checkpointPath.empty() && i + 1 < y1 && std::chrono::duration<double>(now - lastCheckpoint).count() >= _checkpointInterval)
                 {
-                    double a = i + pixXOffset[s] + easyUniform() * 0.25;
-                    double b = j + pixYOffset[s] + easyUniform() * 0.25;
-                    Ray ray = _camera->rayThroughFilm(a, b);
-                    Intersection intersection = intersect(ray);
-                    if (intersection.happen)
-                        color += shader.getColor(intersection);
-                    else
-                        color += BG_COLOR;
+                    RenderCheckpoint checkpoint = _checkpointHeader();
+                    checkpoint.rowsDone = i + 1;
+                    checkpoint.save(_checkpointPath, _frameBuffer, _sampleCounts.data(), _renderAOVs ? &_aovs : nullptr);
+                    lastCheckpoint = now;
                 }
-                _frameBuffer[bufferOffset] = color / 4.0;
             }
         }
+        shader.setShadowCache(nullptr, false);
+        _tracking = false;
+        if (!_checkpointPath.empty())
+            std::filesystem::remove(_checkpointPath);
+    }
+    // Call after changing the transform or material of obj, a renderable of this scene, moved false when
+    // only its material changed
+    // Marks the tiles obj may look different in, renderDirty() then renders only those again
+    // Objects added since the last render count as moved, their bounds decide which tiles they reach
+    // Needs setTrackTiles(true) before the last render
+    void objectChanged(const ObjPtr &obj, bool moved = true)
+    {
+        auto it = std::find(_objs.begin(), _objs.end(), obj);
+        if (it == _objs.end())
+            RAISE_ERROR("objectChanged: the object is not in the scene");
+        if (_tiles.empty())
+            RAISE_ERROR("objectChanged: no tile records, render with setTrackTiles(true) first");
+        int object = int(it - _objs.begin());
+        if (moved || object >= _tiles.nObjects())
+            _tiles.invalidate(object, obj->aabb());
+        else
+            _tiles.invalidate(object);
+    }
+    // Render the tiles marked by objectChanged() into the framebuffer again, the rest keeps its pixels
+    // The frame comes out as a full render of the changed scene would draw it
+    // Returns the number of tiles rendered
+    int renderDirty()
+    {
+        RenderGuard guard;
+        int w = _camera->nHorzPix(), h = _camera->nVertPix();
+        int spp = _samplesSqrt * _samplesSqrt;
+        if (_tiles.empty() || !_frameBuffer)
+            RAISE_ERROR("renderDirty: no tile records, render with setTrackTiles(true) first");
+        updateMaterials();
+        _allocAOVs();
+        // Cached hits no longer match the changed tiles
+        _gbuffer.clear();
+        _shadowOccluders = TrackedVector<uint32_t, MemTag::Framebuffer>();
+        int size = _tiles.tileSize(), nDirty = 0;
+        // Runs of dirty tiles along each row of tiles, in pixels
+        std::vector<std::vector<std::pair<int, int>>> spans(_tiles.tilesY());
+        for (int ty = 0; ty < _tiles.tilesY(); ty++)
+            for (int tx = 0; tx < _tiles.tilesX(); tx++)
+                if (_tiles.dirty(tx, ty))
+                {
+                    nDirty++;
+                    int j0 = tx * size, j1 = std::min(w, j0 + size);
+                    if (!spans[ty].empty() && spans[ty].back().second == j0)
+                        spans[ty].back().second = j1;
+                    else
+                        spans[ty].push_back({j0, j1});
+                }
+        _tiles.clearDirty();
+        _tracking = true;
+        SpanScratch scratch(w, spp);
+        for (int ty = 0; ty < _tiles.tilesY(); ty++)
+            for (int i = ty * size; i < std::min(h, (ty + 1) * size) && !spans[ty].empty(); i++)
+                for (auto [j0, j1] : spans[ty])
+                {
+                    _renderSpan(i, j0, j1, _frameBuffer + std::size_t(i) * w + j0, scratch);
+                    if (_renderAOVs)
+                        _storeAOVs(scratch, i, j0, j1, spp);
+                }
+        _tracking = false;
+        return nDirty;
+    }
+    // Shade the primary hits cached by the last render again, with the lights and materials as they are now,
+    // so look-dev edits of light intensities or material parameters skip tracing the primary rays and,
+    // with reuseShadows, their shadow rays. Reflection and refraction are traced again, so frames with much
+    // mirror and glass save little, the test scene's relight takes about 60% of its render
+    // Needs setCacheGBuffer(true) before that render and the same camera, geometry edits need a new render
+    // and moved lights reuseShadows false. Added or removed shadow-casting lights trace the shadow rays again
+    // The frame and AOVs come out as render() would draw them after the same edits, to float precision
+    void relight(bool reuseShadows = true)
+    {
+        RenderGuard guard;
+        int w = _camera->nHorzPix(), h = _camera->nVertPix();
+        int spp = _samplesSqrt * _samplesSqrt;
+        if (!_gbuffer.matches(w, h, spp))
+            RAISE_ERROR("No cached primary hits for this camera, render with setCacheGBuffer(true) first");
+        updateMaterials();
+        _allocFrameBuffer();
+        _allocAOVs();
+        // Occluders are recorded again whenever they are traced, for the next relight
+        std::size_t occluders = std::size_t(w) * h * spp * PhongShader::shadowLights(_lights);
+        bool replay = reuseShadows && _shadowOccluders.size() == occluders;
+        _shadowOccluders.resize(occluders);
+        shader.setShadowCache(_shadowOccluders.data(), replay);
+        SpanScratch scratch(w, spp);
+        for (int i = 0; i < h; i++)
+        {
+            _gbuffer.loadRow(i, scratch.hits.data());
+            _shadeSpan(i, 0, w, _frameBuffer + std::size_t(i) * w, scratch);
+            if (_renderAOVs)
+                _storeAOVs(scratch, i, 0, w, spp);
+        }
+        shader.setShadowCache(nullptr, false);
+        std::fill(_sampleCounts.begin(), _sampleCounts.end(), spp);
+    }
+    // Render pixels [x0, x0 + tw) x [y0, y0 + th) into out, tw * th pixels in row-major order
+    // Pixels come out exactly as in render(), the frame can be split across processes
+    // Setting cancel, from another thread, stops the tile after the current row and returns false
+    bool renderTile(int x0, int y0, int tw, int th, Vec3 *out, const std::atomic<bool> *cancel = nullptr)
+    {
+        RenderGuard guard;
+        updateMaterials();
+        SpanScratch scratch(tw, _samplesSqrt * _samplesSqrt);
+        for (int i = 0; i < th; i++)
+        {
+            if (cancel && cancel->load())
+                return false;
+            _renderSpan(y0 + i, x0, x0 + tw, out + std::size_t(i) * tw, scratch);
+        }
+        return true;
     }
     Vec3 *frameBuffer() const
     {
         return _frameBuffer;
     }
+    inline int samplesSqrt() const
+    {
+        return _samplesSqrt;
+    }
+    // Empty unless enabled by setRenderAOVs
+    const AOVBuffers &aovs() const
+    {
+        return _aovs;
+    }
 
 public:
     const std::vector<LightPtr> &lights() const
     {
         return _lights;
     }
+    const MaterialTable &materials() const
+    {
+        return _materials;
+    }
 };
\ No newline at end of file
@@ -3,11 +3,15 @@
 #include <eigen3/Eigen/Dense>
 #include "light.hpp"
 #include "material.hpp"
+#include "material_table.hpp"
 #include "intersection.hpp"
 #include "ray.hpp"
 #include "callback_base.hpp"
+#include "phong_batch.hpp"
+#include "easy_random.hpp"
 #include "config.h"
 #include <cmath>
+#include <algorithm>
 
 class Scene;
 
@@ -15,7 +19,7 @@ class Shader
 {
     using Vec3 = Eigen::Vector3d;
     using LightPtr = std::shared_ptr<Light>;
-    using MtlPtr = std::shared_ptr<Material>;
+    using MtlPtr = std::shared_ptr<const Material>;
 
 protected:
     SceneBase *_scene = nullptr;
@@ -34,11 +38,43 @@ class PhongShader : public Shader
 {
     using Vec3 = Eigen::Vector3d;
     using LightPtr = std::shared_ptr<Light>;
-    using MtlPtr = std::shared_ptr<Material>;
+    using MtlPtr = std::shared_ptr<const Material>;
+
+public:
+    constexpr static uint32_t NO_OCCLUDER = UINT32_MAX;
+
+private:
+    // Occluders of the primary samples' shadow rays, one per sample and shadow-casting light, see setShadowCache
+    uint32_t *_shadowCache = nullptr;
+    bool _replayShadows = false;
+    bool _directOnly = false; // skip reflection and refraction, for previews
 
 public:
     PhongShader(){};
 
+public: // parameter setters
+    // Record the occluder of every primary sample's shadow ray towards every light into cache,
+    // indexed by sample * shadowLights(lights) + the light's index among those casting shadows,
+    // or read them back instead of tracing with replay
+    // Occluders stay valid while geometry and light positions do, material edits are picked up
+    // nullptr traces every shadow ray again
+    void setShadowCache(uint32_t *cache, bool replay)
+    {
+        _shadowCache = cache;
+        _replayShadows = replay;
+    }
+    // Lights with shadow rays, the occluder slots per sample setShadowCache needs
+    static int shadowLights(const std::vector<LightPtr> &lights)
+    {
+        return int(std::count_if(lights.begin(), lights.end(), [](const LightPtr &light)
+                                 { return light->castsShadows(); }));
+    }
+    // Shade emission and local illumination only, no reflection or refraction rays are traced
+    void setDirectOnly(bool enable)
+    {
+        _directOnly = enable;
+    }
+
 private:
     inline Vec3 _ambient(const Vec3 &ka, const Vec3 &I) const
     {
@@ -95,8 +131,9 @@ private:
         Intersection inter = _scene->intersect(ray);
         if (!inter.happen)
             return BG_COLOR;
-        double n = inter.mtl->kf();
-        Vec3 attenuate=_attenuate(inter.mtl->attenuateCoeff(),inter.t);
+        const MaterialRecord &mtl = _scene->materials()[inter.materialId];
+        double n = mtl.kf;
+        Vec3 attenuate=_attenuate(mtl.attenuateCoeff,inter.t);
         if (attenuate.maxCoeff() < 0.05)
             return Vec3::Zero();
         Vec3 refractDir = _refractDir(-ray.dir(), inter.normal, n, 1.0);
@@ -118,84 +155,235 @@ private:
             return (BG_COLOR + nReflect * reflection).cwiseProduct(attenuate);
     }
 
-public:
-    Vec3 getColor(const Intersection &intersection, int depth = 0) const override
+    //local illumination model
+    Vec3 _localIllumination(const Intersection &intersection, const MaterialRecord &mtl) const
     {
         const std::vector<LightPtr> &lights = _scene->lights();
-        MtlPtr mtl = intersection.mtl;
-        Vec3 color = mtl->ke();
+        const MaterialTable &materials = _scene->materials();
+        Vec3 color = Vec3::Zero();
         Vec3 N = intersection.normal, V = intersection.viewDir;
-        Vec3 ka = mtl->ka(), kd = mtl->kd(), ks = mtl->ks();
-        if(intersection.texColor)
-            kd=*intersection.texColor;
-        double p = mtl->ne();
-
-        //local illumination model
+        const Vec3 &kd = intersection.hasTexColor ? intersection.texColor : mtl.kd;
         for (const LightPtr &light : lights)
         {
             Vec3 I, L;
             light->idAt(intersection.pos, I, L);
 
             if (L.norm() < 0.01) // ambient
-                color += _ambient(ka, I);
+                color += _ambient(mtl.ka, I);
             else
                 for(int i=0;i<MULTI_SHADOW_RAY;i++)
                 {
                     double at=1.0;
                     Ray shadowRay(intersection.pos, L);
-                    Intersection shadowInter=_scene->intersect(shadowRay);
+                    Intersection shadowInter=_scene->intersectShadow(shadowRay);
                     if (shadowInter.happen)
                     {
-                        if(shadowInter.mtl->kf()>1.0)
-                            at/=pow(shadowInter.mtl->kf(),0.8);
+                        double kf = materials[shadowInter.materialId].kf;
+                        if(kf>1.0)
+                            at/=pow(kf,0.8);
                         else
                             continue;
                     }
 
                     color += at*_diffuse(kd, I, N, L)/MULTI_SHADOW_RAY; // diffuse term
-                    color += at*_specular(ks, I, N, L, V, p)/MULTI_SHADOW_RAY;
+                    color += at*_specular(mtl.ks, I, N, L, V, mtl.ne)/MULTI_SHADOW_RAY;
                 }
-
         }
+        return color;
+    }
 
-        //manage reflection and refraction
-        if (depth < MAX_BOUNCE)
+    // Material of the first hit of the shadow ray towards L, NO_OCCLUDER if it reaches the light
+    uint32_t _occluder(const Vec3 &pos, const Vec3 &L) const
+    {
+        Intersection shadowInter = _scene->intersectShadow(Ray(pos, L));
+        return shadowInter.happen ? shadowInter.materialId : NO_OCCLUDER;
+    }
+    // Shadow ray visibility behind an occluder, the same weighting _localIllumination uses
+    // The MULTI_SHADOW_RAY rays it averages all take the same path, so their average is one ray's
+    double _visibility(uint32_t occluder) const
+    {
+        if (occluder == NO_OCCLUDER)
+            return 1.0;
+        double kf = _scene->materials()[occluder].kf;
+        return kf > 1.0 ? 1.0 / pow(kf, 0.8) : 0.0;
+    }
+    // Local illumination of hits[order[begin..end)] added to their colors
+    // Light samples and shadow rays are taken per hit, diffuse and specular terms of each
+    // light are then evaluated for the whole range by the SIMD kernel
+    void _localIlluminationBatch(const Intersection *hits, const int *order, int begin, int end, Vec3 *colors, uint64_t firstSample) const
+    {
+        thread_local PhongBatch batch;
+        const MaterialTable &materials = _scene->materials();
+        int n = end - begin;
+        batch.resize(n);
+        batch.clearOutput();
+        for (int k = 0; k < n; k++)
+        {
+            const Intersection &hit = hits[order[begin + k]];
+            const MaterialRecord &mtl = materials[hit.materialId];
+            const Vec3 &kd = hit.hasTexColor ? hit.texColor : mtl.kd;
+            batch.nx[k] = hit.normal[0], batch.ny[k] = hit.normal[1], batch.nz[k] = hit.normal[2];
+            batch.vx[k] = hit.viewDir[0], batch.vy[k] = hit.viewDir[1], batch.vz[k] = hit.viewDir[2];
+            batch.kdr[k] = kd[0], batch.kdg[k] = kd[1], batch.kdb[k] = kd[2];
+            batch.ksr[k] = mtl.ks[0], batch.ksg[k] = mtl.ks[1], batch.ksb[k] = mtl.ks[2];
+            batch.ne[k] = mtl.ne;
+        }
+        const std::vector<LightPtr> &lights = _scene->lights();
+        int nShadowLights = _shadowCache ? shadowLights(lights) : 0;
+        for (int l = 0, slot = 0; l < lights.size(); slot += lights[l]->castsShadows(), l++)
         {
-            if (mtl->km().maxCoeff() > 0.01) // ideal mirror reflection material
+            const LightPtr &light = lights[l];
+            for (int k = 0; k < n; k++)
             {
-                Vec3 ref=_reflectDir(V, N);
-                Vec3 dst=intersection.pos+ref;
-                if(mtl->g()>0.0)
+                const Intersection &hit = hits[order[begin + k]];
+                _scene->enterSample(firstSample + order[begin + k]);
+                RandomSequence::local().seed(RandomSequence::key(RENDER_SEED, firstSample + order[begin + k], LightStream + l));
+                Vec3 I, L;
+                light->idAt(hit.pos, I, L);
+                if (L.norm() < 0.01) // ambient, the lane contributes nothing to the kernel
                 {
-                    dst[0]+=easyUniform()*mtl->g();
-                    dst[1]+=easyUniform()*mtl->g();
-                    dst[2]+=easyUniform()*mtl->g();
+                    colors[order[begin + k]] += _ambient(materials[hit.materialId].ka, I);
+                    I.setZero();
                 }
-                Ray reflectRay(intersection.pos, dst-intersection.pos);
-                Intersection reflectIntersection = _scene->intersect(reflectRay);
-                if (reflectIntersection.happen)
-                    color += mtl->km().cwiseProduct(getColor(reflectIntersection, depth + 1));
-            }
-            else if (mtl->kf() > 0.01) // transparent material
-            {
-                double nReflect = _schlickApproxim(V, N, mtl->kf());
-                double nRefract = 1.0 - nReflect;
-
-                // compute reflection
-                Ray reflectRay(intersection.pos, _reflectDir(V, N));
-                Intersection reflectIntersection = _scene->intersect(reflectRay);
-                if (reflectIntersection.happen)
-                    color += nReflect * getColor(reflectIntersection, depth + 1);
                 else
-                    color += nReflect * BG_COLOR;
+                {
+                    uint64_t sample = firstSample + order[begin + k];
+                    uint32_t occluder;
+                    if (_shadowCache && _replayShadows)
+                        occluder = _shadowCache[sample * nShadowLights + slot];
+                    else
+                        occluder = _occluder(hit.pos, L);
+                    if (_shadowCache && !_replayShadows)
+                        _shadowCache[sample * nShadowLights + slot] = occluder;
+                    I *= _visibility(occluder);
+                }
+                batch.lx[k] = L[0], batch.ly[k] = L[1], batch.lz[k] = L[2];
+                batch.ir[k] = I[0], batch.ig[k] = I[1], batch.ib[k] = I[2];
+            }
+            batch.evaluate();
+        }
+        for (int k = 0; k < n; k++)
+            colors[order[begin + k]] += Vec3{batch.outR[k], batch.outG[k], batch.outB[k]};
+    }
 
-                // compute refraction
-                Vec3 refractDir = _refractDir(V, N, 1.0, mtl->kf());
-                Ray refractRay(intersection.pos, refractDir);
-                color += nRefract * _getInternalReflection(refractRay, depth + 1);
+    // Reflection and refraction of one material type
+    template <MaterialType Type>
+    Vec3 _indirect(const Intersection &intersection, const MaterialRecord &mtl, int depth) const
+    {
+        Vec3 color = Vec3::Zero();
+        if (depth >= MAX_BOUNCE)
+            return color;
+
+        //manage reflection and refraction
+        Vec3 N = intersection.normal, V = intersection.viewDir;
+        if constexpr (Type == MaterialType::GlossyMirror) // ideal mirror reflection material
+        {
+            Vec3 ref=_reflectDir(V, N);
+            Vec3 dst=intersection.pos+ref;
+            if(mtl.g>0.0)
+            {
+                dst[0]+=easyUniform()*mtl.g;
+                dst[1]+=easyUniform()*mtl.g;
+                dst[2]+=easyUniform()*mtl.g;
             }
+            Ray reflectRay(intersection.pos, dst-intersection.pos);
+            Intersection reflectIntersection = _scene->intersect(reflectRay);
+            if (reflectIntersection.happen)
+                color += mtl.km.cwiseProduct(getColor(reflectIntersection, depth + 1));
         }
+        else if constexpr (Type == MaterialType::Dielectric) // transparent material
+        {
+            double nReflect = _schlickApproxim(V, N, mtl.kf);
+            double nRefract = 1.0 - nReflect;
+
+            // compute reflection
+            Ray reflectRay(intersection.pos, _reflectDir(V, N));
+            Intersection reflectIntersection = _scene->intersect(reflectRay);
+            if (reflectIntersection.happen)
+                color += nReflect * getColor(reflectIntersection, depth + 1);
+            else
+                color += nReflect * BG_COLOR;
 
+            // compute refraction
+            Vec3 refractDir = _refractDir(V, N, 1.0, mtl.kf);
+            Ray refractRay(intersection.pos, refractDir);
+            color += nRefract * _getInternalReflection(refractRay, depth + 1);
+        }
         return color;
     }
-};
+
+public:
+    // Shading kernel of one material type, the type is fixed at compile time so the kernel
+    // carries no material branches
+    template <MaterialType Type>
+    Vec3 shade(const Intersection &intersection, const MaterialRecord &mtl, int depth = 0) const
+    {
+        Vec3 color = mtl.ke;
+        if constexpr (Type == MaterialType::Emissive)
+            return color;
+        return color + _localIllumination(intersection, mtl) + _indirect<Type>(intersection, mtl, depth);
+    }
+
+    // Shade hits[order[k]] into colors[order[k]], all hits must have materials of type Type
+    // Hits are shaded in chunks of SHADE_BATCH_SIZE, local illumination of a chunk goes
+    // through the SIMD kernel and reflection/refraction follows per hit
+    // hits[k] is sample firstSample + k of the image, random numbers are drawn from keys of it
+    template <MaterialType Type>
+    void shadeBatch(const Intersection *hits, const int *order, int n, Vec3 *colors, uint64_t firstSample = 0) const
+    {
+        const MaterialTable &materials = _scene->materials();
+        int nChunks = (n + SHADE_BATCH_SIZE - 1) / SHADE_BATCH_SIZE;
+#ifdef MULTI_THREAD
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+        for (int chunk = 0; chunk < nChunks; chunk++)
+        {
+            int begin = chunk * SHADE_BATCH_SIZE, end = std::min(n, begin + SHADE_BATCH_SIZE);
+            for (int k = begin; k < end; k++)
+                colors[order[k]] = materials[hits[order[k]].materialId].ke;
+            if constexpr (Type == MaterialType::Emissive)
+                continue;
+            _localIlluminationBatch(hits, order, begin, end, colors, firstSample);
+            if constexpr (Type != MaterialType::Diffuse)
+                if (!_directOnly)
+                    for (int k = begin; k < end; k++)
+                    {
+                        const Intersection &hit = hits[order[k]];
+                        _scene->enterSample(firstSample + order[k]);
+                        RandomSequence::local().seed(RandomSequence::key(RENDER_SEED, firstSample + order[k], IndirectStream));
+                        colors[order[k]] += _indirect<Type>(hit, materials[hit.materialId], 0);
+                    }
+        }
+    }
+    void shadeBatch(MaterialType type, const Intersection *hits, const int *order, int n, Vec3 *colors, uint64_t firstSample = 0) const
+    {
+        switch (type)
+        {
+        case MaterialType::Diffuse:
+            return shadeBatch<MaterialType::Diffuse>(hits, order, n, colors, firstSample);
+        case MaterialType::GlossyMirror:
+            return shadeBatch<MaterialType::GlossyMirror>(hits, order, n, colors, firstSample);
+        case MaterialType::Dielectric:
+            return shadeBatch<MaterialType::Dielectric>(hits, order, n, colors, firstSample);
+        default:
+            return shadeBatch<MaterialType::Emissive>(hits, order, n, colors, firstSample);
+        }
+    }
+
+    // Secondary hits come one at a time, dispatch once on the record's type
+    Vec3 getColor(const Intersection &intersection, int depth = 0) const override
+    {
+        const MaterialRecord &mtl = _scene->materials()[intersection.materialId];
+        switch (mtl.type)
+        {
+        case MaterialType::Diffuse:
+            return shade<MaterialType::Diffuse>(intersection, mtl, depth);
+        case MaterialType::GlossyMirror:
+            return shade<MaterialType::GlossyMirror>(intersection, mtl, depth);
+        case MaterialType::Dielectric:
+            return shade<MaterialType::Dielectric>(intersection, mtl, depth);
+        default:
+            return shade<MaterialType::Emissive>(intersection, mtl, depth);
+        }
+    }
+};
\ No newline at end of file
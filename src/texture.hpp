@@ -1,59 +1,127 @@
 #pragma once
 #include <eigen3/Eigen/Core>
 #include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <memory>
+#include "config.h"
 #include "image_encoder.hpp"
-#include "../dep/lodepng/lodepng.h"
+#include "texture_cache.hpp"
 
 class Texture
 {
     using Vec3 = Eigen::Vector3d;
+    using Vec2 = Eigen::Vector2d;
+    using FilePtr = std::shared_ptr<TextureFile>;
+    using Level = TextureFile::Level;
+    constexpr static int PAGE = TextureFile::PAGE;
 
 private:
-    unsigned char *_buffer = nullptr;
-    Vec3 *_image = nullptr;
-    double _w;
-    double _h;
+    FilePtr _file; // pyramid paged in through the process-wide TextureCache
+    int _maxAnisotropy = TEXTURE_MAX_ANISOTROPY;
 
-public:
-    Texture(const std::string &filename)
+private:
+    // Texture coordinates repeat outside [0,1]
+    static inline int _wrap(int x, int n)
     {
-        unsigned w, h;
-        if (lodepng_decode24_file(&_buffer, &w, &h, filename.c_str()))
-            RAISE_ERROR("Failed to open png file");
-        _w = w;
-        _h = h;
-        _image = new Vec3[w * h];
-        unsigned long offset = 0;
-        for (int i = 0; i < h; i++)
-            for (int j = 0; j < w; j++)
-                for (int k = 0; k < 3; k++)
-                    ((double *)_image)[offset++] = _buffer[offset] / 255.0;
-
-        delete[] _buffer;
-    };
-    ~Texture()
+        x %= n;
+        return x < 0 ? x + n : x;
+    }
+    inline const uint8_t *_texel(const Level &level, unsigned x, unsigned y) const
     {
-        delete[] _image;
+        const uint8_t *page = _file->page(level.firstPage + (y / PAGE) * level.pagesX + x / PAGE);
+        return page + TextureFile::texelOffset(x, y);
     }
-
-private:
-    inline double _arrCoordX(double u) const
+    // v runs bottom to top, image rows run top to bottom
+    Vec3 _bilinear(int levelIndex, double u, double v) const
     {
-        //[0,1] => [0,w]
-        return u * (_w - 1.0);
+        const Level &level = _file->levels()[levelIndex];
+        double x = u * level.w - 0.5, y = (1.0 - v) * level.h - 0.5;
+        double fx = std::floor(x), fy = std::floor(y);
+        int x0 = _wrap(fx, level.w), y0 = _wrap(fy, level.h);
+        int x1 = x0 + 1 < level.w ? x0 + 1 : 0, y1 = y0 + 1 < level.h ? y0 + 1 : 0;
+        fx = x - fx;
+        fy = y - fy;
+
+        const uint8_t *t00 = _texel(level, x0, y0), *t10 = _texel(level, x1, y0);
+        const uint8_t *t01 = _texel(level, x0, y1), *t11 = _texel(level, x1, y1);
+        const float *decode = srgbDecodeTable();
+        double w00 = (1.0 - fx) * (1.0 - fy), w10 = fx * (1.0 - fy), w01 = (1.0 - fx) * fy, w11 = fx * fy;
+        Vec3 ret;
+        for (int k = 0; k < 3; k++)
+            ret[k] = w00 * decode[t00[k]] + w10 * decode[t10[k]] + w01 * decode[t01[k]] + w11 * decode[t11[k]];
+        return ret;
     }
-    inline double _arrCoordY(double v) const
+    // Blend the two levels around a filter width given in full resolution texels
+    Vec3 _trilinear(double u, double v, double width) const
     {
-        //[0,1] =>[h,0]
-        return (1.0 - v) * (_h - 1.0);
+        int last = _file->levels().size() - 1;
+        double lod = std::log2(std::max(width, 1e-8));
+        if (lod <= 0.0)
+            return _bilinear(0, u, v);
+        if (lod >= last)
+            return _bilinear(last, u, v);
+        int l0 = lod;
+        double f = lod - l0;
+        return (1.0 - f) * _bilinear(l0, u, v) + f * _bilinear(l0 + 1, u, v);
     }
 
 public:
-    const Vec3 &getColor(double u, double v) const
+    // Converted to the tiled on-disk format once, pages are loaded on first touch
+    Texture(const std::string &filename) : _file(TextureCache::instance().open(filename)){};
+
+public:
+    // Bilinear lookup of the full resolution image, for rays without differentials
+    Vec3 getColor(double u, double v) const
+    {
+        TextureCache::ReadGuard guard;
+        return _bilinear(0, u, v);
+    }
+    // Filtered lookup over the pixel footprint spanned by duvdx and duvdy
+    // Trilinear along the minor axis, with up to maxAnisotropy probes along the major axis
+    Vec3 getColor(const Vec2 &uv, const Vec2 &duvdx, const Vec2 &duvdy) const
+    {
+        TextureCache::ReadGuard guard;
+        Vec2 size(_file->levels()[0].w, _file->levels()[0].h);
+        double lx = duvdx.cwiseProduct(size).norm(), ly = duvdy.cwiseProduct(size).norm();
+        const Vec2 &major = lx >= ly ? duvdx : duvdy;
+        double majorLen = std::max(lx, ly), minorLen = std::min(lx, ly);
+        if (majorLen <= 0.0)
+            return _bilinear(0, uv[0], uv[1]);
+        // Clamp the eccentricity, a wider minor axis keeps the probes covering the footprint
+        minorLen = std::max(minorLen, majorLen / _maxAnisotropy);
+        int n = std::clamp<int>(std::ceil(majorLen / minorLen - 1e-6), 1, _maxAnisotropy);
+        if (n == 1)
+            return _trilinear(uv[0], uv[1], majorLen);
+        Vec3 color = Vec3::Zero();
+        for (int k = 0; k < n; k++)
+        {
+            Vec2 p = uv + major * ((k + 0.5) / n - 0.5);
+            color += _trilinear(p[0], p[1], minorLen);
+        }
+        return color / n;
+    }
+    // 1 disables anisotropic filtering
+    void setMaxAnisotropy(int n)
+    {
+        if (n < 1)
+            RAISE_ERROR("Max anisotropy must be at least 1");
+        _maxAnisotropy = n;
+    }
+    inline int numLevels() const
+    {
+        return _file->levels().size();
+    }
+    // Bytes of the whole pyramid, only the touched pages are resident
+    std::size_t sizeBytes() const
+    {
+        return std::size_t(_file->numPages()) * TextureFile::PAGE_BYTES;
+    }
+    // Bytes of the pages currently in the texture cache
+    std::size_t residentBytes() const
     {
-        int row = std::round(_arrCoordY(v));
-        int col = std::round(_arrCoordY(u));
-        return _image[row * int(_w) + col];
+        return _file->residentBytes();
     }
 
 public:
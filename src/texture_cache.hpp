@@ -0,0 +1,503 @@
+#pragma once
+#include <eigen3/Eigen/Core>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <fstream>
+#include <filesystem>
+#include <functional>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <unistd.h>
+#include "config.h"
+#include "utils.hpp"
+#include "memory_tracker.hpp"
+#include "../dep/lodepng/lodepng.h"
+
+// sRGB transfer functions, decoding goes through a table in the lookup path
+inline double srgbToLinear(double c)
+{
+    return c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+}
+inline uint8_t linearToSRGB(double c)
+{
+    c = std::clamp(c, 0.0, 1.0);
+    c = c <= 0.0031308 ? c * 12.92 : 1.055 * std::pow(c, 1.0 / 2.4) - 0.055;
+    return std::lround(c * 255.0);
+}
+inline const float *srgbDecodeTable()
+{
+    static const std::array<float, 256> table = []
+    {
+        std::array<float, 256> t;
+        for (int i = 0; i < 256; i++)
+            t[i] = srgbToLinear(i / 255.0);
+        return t;
+    }();
+    return table.data();
+}
+
+class TextureCache;
+
+// A mipmapped texture converted to the on-disk tiled format, its pages are read on first touch
+// Each level is split into TEXTURE_PAGE x TEXTURE_PAGE pages of 8-bit sRGB texels, and each page
+// into TEXTURE_TILE x TEXTURE_TILE tiles so the taps of a bilinear lookup share cache lines
+class TextureFile
+{
+    friend class TextureCache;
+
+public:
+    constexpr static int PAGE = TEXTURE_PAGE;
+    constexpr static int TILE = TEXTURE_TILE;
+    constexpr static std::size_t PAGE_BYTES = 3 * PAGE * PAGE;
+    static_assert(PAGE % TILE == 0, "Texture pages must hold whole tiles");
+
+    struct Level
+    {
+        int w, h;
+        int pagesX, pagesY;
+        int firstPage; // index of the level's first page in the page table
+    };
+
+private:
+    // Pages are published through an atomic pointer so hits need no lock
+    struct PageSlot
+    {
+        std::atomic<uint8_t *> data{nullptr};
+        std::atomic<bool> referenced{false}; // second chance bit of the clock replacement
+    };
+
+    std::string _path;
+    std::ifstream _file; // read under the cache lock only
+    std::size_t _dataOffset = 0;
+    std::vector<Level> _levels;
+    std::unique_ptr<PageSlot[]> _pages;
+    int _nPages = 0;
+    std::atomic<int> _residentPages{0}; // published pages, updated under the cache lock
+
+public:
+    TextureFile(const std::string &path);
+    ~TextureFile();
+
+public:
+    // Page of texels, loaded on a miss, the caller must hold a TextureCache::ReadGuard
+    inline const uint8_t *page(int index);
+
+    inline const std::vector<Level> &levels() const
+    {
+        return _levels;
+    }
+    inline int numPages() const
+    {
+        return _nPages;
+    }
+    inline std::size_t residentBytes() const
+    {
+        return std::size_t(_residentPages.load(std::memory_order_relaxed)) * PAGE_BYTES;
+    }
+    // Offset of texel (x, y) inside its page
+    static inline std::size_t texelOffset(unsigned x, unsigned y)
+    {
+        x %= PAGE;
+        y %= PAGE;
+        std::size_t tile = (y / TILE) * (PAGE / TILE) + x / TILE;
+        return 3 * (tile * TILE * TILE + (y % TILE) * TILE + x % TILE);
+    }
+};
+
+// Process-wide cache of texture pages under a memory budget
+// Hits are lock-free, misses and evictions take one lock, pages are replaced by the clock
+// approximation of LRU, and evicted pages are freed only once no reader can still hold them
+class TextureCache
+{
+    friend class TextureFile;
+    using Vec3 = Eigen::Vector3d;
+
+public:
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        std::size_t residentBytes = 0;
+        std::size_t peakBytes = 0;
+    };
+
+private:
+    // Per-thread reader state, only its own thread writes it
+    struct alignas(64) ThreadSlot
+    {
+        std::atomic<uint64_t> epoch{0}; // epoch entered by the current reader, 0 when idle
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+    };
+    struct Resident
+    {
+        TextureFile *file;
+        int page;
+    };
+    struct Retired
+    {
+        uint8_t *data;
+        uint64_t epoch;
+    };
+
+    std::mutex _mutex;
+    std::size_t _budget = std::size_t(TEXTURE_CACHE_BUDGET_MB) << 20;
+    std::string _dir = TEXTURE_CACHE_DIR;
+    std::unordered_map<std::string, std::weak_ptr<TextureFile>> _files;
+    std::vector<Resident> _resident;
+    std::size_t _hand = 0;
+    std::vector<Retired> _retired;
+    std::atomic<uint64_t> _epoch{1};
+    std::deque<ThreadSlot> _slots; // never shrinks so slot addresses stay valid
+    uint64_t _evictions = 0;
+    std::size_t _residentBytes = 0;
+    std::size_t _peakBytes = 0;
+
+private:
+    // The tracker must outlive the cache, which frees pages on destruction
+    TextureCache()
+    {
+        MemoryTracker::instance();
+    };
+    ~TextureCache()
+    {
+        for (const Retired &r : _retired)
+        {
+            delete[] r.data;
+            MemoryTracker::instance().freed(MemTag::Textures, TextureFile::PAGE_BYTES);
+        }
+    }
+
+    ThreadSlot &_threadSlot()
+    {
+        thread_local ThreadSlot *slot = nullptr;
+        if (!slot)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            slot = &_slots.emplace_back();
+        }
+        return *slot;
+    }
+
+    // Free retired pages no reader entered before their eviction can still see
+    void _reclaim()
+    {
+        uint64_t oldest = UINT64_MAX;
+        for (const ThreadSlot &slot : _slots)
+        {
+            uint64_t e = slot.epoch.load(std::memory_order_seq_cst);
+            if (e)
+                oldest = std::min(oldest, e);
+        }
+        auto end = std::remove_if(_retired.begin(), _retired.end(), [oldest](const Retired &r)
+                                  {
+                                      if (r.epoch >= oldest)
+                                          return false;
+                                      delete[] r.data;
+                                      MemoryTracker::instance().freed(MemTag::Textures, TextureFile::PAGE_BYTES);
+                                      return true;
+                                  });
+        _retired.erase(end, _retired.end());
+    }
+    // Unpublish one page, readers that loaded it before keep it alive until _reclaim
+    void _evict(std::size_t index)
+    {
+        Resident r = _resident[index];
+        uint8_t *data = r.file->_pages[r.page].data.exchange(nullptr, std::memory_order_seq_cst);
+        _retired.push_back({data, _epoch.fetch_add(1, std::memory_order_seq_cst)});
+        r.file->_residentPages--;
+        _resident[index] = _resident.back();
+        _resident.pop_back();
+        _residentBytes -= TextureFile::PAGE_BYTES;
+        _evictions++;
+    }
+    // Clock sweep, pages touched since the last pass get a second chance
+    void _evictOne()
+    {
+        while (true)
+        {
+            if (_hand >= _resident.size())
+                _hand = 0;
+            TextureFile::PageSlot &slot = _resident[_hand].file->_pages[_resident[_hand].page];
+            if (slot.referenced.exchange(false, std::memory_order_relaxed))
+            {
+                _hand++;
+                continue;
+            }
+            _evict(_hand);
+            return;
+        }
+    }
+
+    uint8_t *_pageIn(TextureFile &file, int index)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        TextureFile::PageSlot &slot = file._pages[index];
+        // Another thread may have loaded it meanwhile
+        if (uint8_t *data = slot.data.load(std::memory_order_acquire))
+            return data;
+
+        while (!_resident.empty() && _residentBytes + TextureFile::PAGE_BYTES > _budget)
+            _evictOne();
+        _reclaim();
+
+        uint8_t *data = new uint8_t[TextureFile::PAGE_BYTES];
+        file._file.seekg(file._dataOffset + std::size_t(index) * TextureFile::PAGE_BYTES);
+        if (!file._file.read((char *)data, TextureFile::PAGE_BYTES))
+        {
+            delete[] data;
+            RAISE_ERROR(("Failed to read texture page from " + file._path).c_str());
+        }
+        MemoryTracker::instance().allocated(MemTag::Textures, TextureFile::PAGE_BYTES);
+        slot.referenced.store(true, std::memory_order_relaxed);
+        slot.data.store(data, std::memory_order_release);
+        file._residentPages++;
+        _resident.push_back({&file, index});
+        _residentBytes += TextureFile::PAGE_BYTES;
+        _peakBytes = std::max(_peakBytes, _residentBytes);
+        return data;
+    }
+
+    // Drop every page of a file that is going away, no reader can reach it anymore
+    void _release(TextureFile &file)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (std::size_t i = 0; i < _resident.size();)
+        {
+            if (_resident[i].file != &file)
+            {
+                i++;
+                continue;
+            }
+            delete[] file._pages[_resident[i].page].data.exchange(nullptr);
+            MemoryTracker::instance().freed(MemTag::Textures, TextureFile::PAGE_BYTES);
+            file._residentPages--;
+            _resident[i] = _resident.back();
+            _resident.pop_back();
+            _residentBytes -= TextureFile::PAGE_BYTES;
+        }
+    }
+
+    // Decode the PNG, build the mip pyramid in linear space and write it paged and tiled
+    static void _convert(const std::string &src, const std::string &dst)
+    {
+        unsigned char *buffer = nullptr;
+        unsigned w, h;
+        if (lodepng_decode24_file(&buffer, &w, &h, src.c_str()))
+            RAISE_ERROR(("Failed to open png file " + src).c_str());
+        // PNG texels are sRGB encoded
+        const float *decode = srgbDecodeTable();
+        std::vector<Vec3> linear(w * h);
+        for (unsigned i = 0; i < w * h; i++)
+            linear[i] = Vec3(decode[buffer[3 * i]], decode[buffer[3 * i + 1]], decode[buffer[3 * i + 2]]);
+        free(buffer);
+
+        std::vector<std::pair<int, int>> dims = {{int(w), int(h)}};
+        std::vector<std::vector<uint8_t>> levels;
+        while (true)
+        {
+            auto [lw, lh] = dims.back();
+            int pagesX = (lw + TextureFile::PAGE - 1) / TextureFile::PAGE, pagesY = (lh + TextureFile::PAGE - 1) / TextureFile::PAGE;
+            std::vector<uint8_t> pages(std::size_t(pagesX) * pagesY * TextureFile::PAGE_BYTES, 0);
+            for (int y = 0; y < lh; y++)
+                for (int x = 0; x < lw; x++)
+                {
+                    std::size_t offset = (std::size_t(y / TextureFile::PAGE) * pagesX + x / TextureFile::PAGE) * TextureFile::PAGE_BYTES +
+                                         TextureFile::texelOffset(x, y);
+                    for (int k = 0; k < 3; k++)
+                        pages[offset + k] = linearToSRGB(linear[y * lw + x][k]);
+                }
+            levels.push_back(std::move(pages));
+            if (lw == 1 && lh == 1)
+                break;
+
+            // Each level averages 2x2 texels of the previous one, odd edges repeat the last texel
+            int dw = std::max(1, lw / 2), dh = std::max(1, lh / 2);
+            std::vector<Vec3> down(dw * dh);
+            for (int y = 0; y < dh; y++)
+                for (int x = 0; x < dw; x++)
+                {
+                    int x0 = std::min(2 * x, lw - 1), x1 = std::min(2 * x + 1, lw - 1);
+                    int y0 = std::min(2 * y, lh - 1), y1 = std::min(2 * y + 1, lh - 1);
+                    down[y * dw + x] = 0.25 * (linear[y0 * lw + x0] + linear[y0 * lw + x1] +
+                                               linear[y1 * lw + x0] + linear[y1 * lw + x1]);
+                }
+            linear.swap(down);
+            dims.push_back({dw, dh});
+        }
+
+        // Unique per process and thread, so concurrent converters of the same texture never share a tmp
+        std::string tmp = dst + "." + std::to_string(getpid()) + "." +
+                          std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+        std::ofstream ofs(tmp, std::ios::binary);
+        if (!ofs.is_open())
+            RAISE_ERROR(("Failed to create texture cache file " + tmp).c_str());
+        uint32_t header[5] = {TEXTURE_FILE_MAGIC, TEXTURE_FILE_VERSION, TextureFile::PAGE, TextureFile::TILE, uint32_t(dims.size())};
+        ofs.write((const char *)header, sizeof(header));
+        for (auto [lw, lh] : dims)
+        {
+            int32_t d[2] = {lw, lh};
+            ofs.write((const char *)d, sizeof(d));
+        }
+        for (const std::vector<uint8_t> &pages : levels)
+            ofs.write((const char *)pages.data(), pages.size());
+        ofs.close();
+        if (!ofs)
+            RAISE_ERROR(("Failed to write texture cache file " + tmp).c_str());
+        // The rename is atomic, the last converter's identical file wins
+        std::filesystem::rename(tmp, dst);
+    }
+
+    std::string _cachedPath(const std::string &src) const
+    {
+        std::string canonical = std::filesystem::weakly_canonical(src).string();
+        char hash[17];
+        snprintf(hash, sizeof(hash), "%016zx", std::hash<std::string>()(canonical));
+        return (std::filesystem::path(_dir) / (std::filesystem::path(src).stem().string() + "_" + hash + ".srtx")).string();
+    }
+
+public:
+    static TextureCache &instance()
+    {
+        static TextureCache cache;
+        return cache;
+    }
+
+    // Shared tiled file of a PNG, converted on first use or when the PNG is newer than the cached copy
+    std::shared_ptr<TextureFile> open(const std::string &src)
+    {
+        std::string dst = _cachedPath(src);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _files.find(dst);
+            if (it != _files.end())
+                if (std::shared_ptr<TextureFile> file = it->second.lock())
+                    return file;
+        }
+        if (!std::filesystem::exists(src))
+            RAISE_ERROR(("Texture not found: " + src).c_str());
+        std::filesystem::create_directories(_dir);
+        if (!std::filesystem::exists(dst) || std::filesystem::last_write_time(dst) < std::filesystem::last_write_time(src))
+            _convert(src, dst);
+
+        std::shared_ptr<TextureFile> file = std::make_shared<TextureFile>(dst);
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::weak_ptr<TextureFile> &entry = _files[dst];
+        if (std::shared_ptr<TextureFile> existing = entry.lock())
+            return existing;
+        entry = file;
+        return file;
+    }
+
+    // Pages may be accessed only inside a guard, it delays freeing the pages evicted meanwhile
+    class ReadGuard
+    {
+        ThreadSlot &_slot;
+
+    public:
+        ReadGuard(TextureCache &cache = instance()) : _slot(cache._threadSlot())
+        {
+            _slot.epoch.store(cache._epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+        }
+        ~ReadGuard()
+        {
+            _slot.epoch.store(0, std::memory_order_release);
+        }
+        ReadGuard(const ReadGuard &) = delete;
+        ReadGuard &operator=(const ReadGuard &) = delete;
+    };
+
+public:
+    void setBudget(std::size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _budget = std::max(bytes, TextureFile::PAGE_BYTES);
+        while (!_resident.empty() && _residentBytes > _budget)
+            _evictOne();
+        _reclaim();
+    }
+    // Where converted textures are stored
+    void setDirectory(const std::string &dir)
+    {
+        _dir = dir;
+    }
+    Stats stats()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        Stats ret;
+        for (const ThreadSlot &slot : _slots)
+        {
+            ret.hits += slot.hits.load(std::memory_order_relaxed);
+            ret.misses += slot.misses.load(std::memory_order_relaxed);
+        }
+        ret.evictions = _evictions;
+        ret.residentBytes = _residentBytes;
+        ret.peakBytes = _peakBytes;
+        return ret;
+    }
+    void printStats()
+    {
+        Stats s = stats();
+        uint64_t total = std::max<uint64_t>(s.hits + s.misses, 1);
+        printf("Texture cache: %llu hits, %llu misses(%.3f%%), %llu evictions, %.1f MB resident, %.1f MB peak\n",
+               (unsigned long long)s.hits, (unsigned long long)s.misses, 100.0 * s.misses / total,
+               (unsigned long long)s.evictions, s.residentBytes / 1048576.0, s.peakBytes / 1048576.0);
+    }
+
+    // Count one page access of the calling thread, only the owner writes its slot
+    inline void countAccess(bool hit)
+    {
+        std::atomic<uint64_t> &counter = hit ? _threadSlot().hits : _threadSlot().misses;
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+};
+
+inline TextureFile::TextureFile(const std::string &path) : _path(path), _file(path, std::ios::binary)
+{
+    uint32_t header[5];
+    if (!_file.read((char *)header, sizeof(header)) || header[0] != TEXTURE_FILE_MAGIC)
+        RAISE_ERROR(("Not a tiled texture file: " + path).c_str());
+    if (header[1] != TEXTURE_FILE_VERSION || header[2] != PAGE || header[3] != TILE)
+        RAISE_ERROR(("Tiled texture file was written with another layout, delete it to convert again: " + path).c_str());
+    for (uint32_t i = 0; i < header[4]; i++)
+    {
+        int32_t d[2];
+        _file.read((char *)d, sizeof(d));
+        Level level{d[0], d[1], (d[0] + PAGE - 1) / PAGE, (d[1] + PAGE - 1) / PAGE, _nPages};
+        _nPages += level.pagesX * level.pagesY;
+        _levels.push_back(level);
+    }
+    if (!_file)
+        RAISE_ERROR(("Truncated tiled texture file: " + path).c_str());
+    _dataOffset = sizeof(header) + header[4] * 2 * sizeof(int32_t);
+    _pages.reset(new PageSlot[_nPages]);
+}
+
+inline TextureFile::~TextureFile()
+{
+    TextureCache::instance()._release(*this);
+}
+
+inline const uint8_t *TextureFile::page(int index)
+{
+    PageSlot &slot = _pages[index];
+    uint8_t *data = slot.data.load(std::memory_order_acquire);
+    TextureCache &cache = TextureCache::instance();
+    cache.countAccess(data != nullptr);
+    if (!data)
+        return cache._pageIn(*this, index);
+    // Avoid dirtying the cache line when the bit is already set
+    if (!slot.referenced.load(std::memory_order_relaxed))
+        slot.referenced.store(true, std::memory_order_relaxed);
+    return data;
+}
\ No newline at end of file
@@ -0,0 +1,86 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <type_traits>
+#include <algorithm>
+
+// Fixed set of worker threads running jobs in submission order
+// A job may wait on the future of a job submitted before it, never on a later one
+class ThreadPool
+{
+private:
+    std::vector<std::thread> _workers;
+    std::deque<std::function<void()>> _jobs;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _stop = false;
+
+private:
+    void _run()
+    {
+        while (true)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cv.wait(lock, [this]
+                         { return _stop || !_jobs.empty(); });
+                if (_jobs.empty())
+                    return;
+                job = std::move(_jobs.front());
+                _jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+public:
+    // 0 uses one thread per hardware thread
+    explicit ThreadPool(int nThreads = 0)
+    {
+        if (nThreads <= 0)
+            nThreads = std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 0; i < nThreads; i++)
+            _workers.emplace_back([this]
+                                  { _run(); });
+    }
+    // Pending jobs still run before the workers exit
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cv.notify_all();
+        for (std::thread &worker : _workers)
+            worker.join();
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+public:
+    template <typename F>
+    std::future<std::invoke_result_t<F>> submit(F &&f)
+    {
+        using R = std::invoke_result_t<F>;
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+        std::future<R> ret = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _jobs.push_back([task]
+                            { (*task)(); });
+        }
+        _cv.notify_one();
+        return ret;
+    }
+    inline int numThreads() const
+    {
+        return _workers.size();
+    }
+};
\ No newline at end of file
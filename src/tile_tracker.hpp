@@ -0,0 +1,320 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <eigen3/Eigen/Core>
+#include "renderable.hpp"
+#include "ray.hpp"
+#include "memory_tracker.hpp"
+#include "utils.hpp"
+
+// What the rays of each square screen tile touched during a render: the objects their closest hits
+// were on, primary, shadow and secondary rays alike, and the cells of a grid over the scene their
+// segments crossed
+// Shadow rays outnumber the others by the number of lights, their segments are walked through a
+// coarser grid over the same bounds
+// A changed object can only change a tile if one of the tile's rays hit it before, or if its new
+// bounds reach into a cell the tile's rays crossed, so only those tiles need rendering again, see Scene::objectChanged
+// Segments are cut where they leave the grid, the tile is then marked as escaped
+// Every tile has one bitmask over the objects and one over the cells of each grid, which all threads set bits in
+// atomically, a bit is only written the first time it is set so threads sharing a tile mostly read
+class TileTracker
+{
+    using Vec3 = Eigen::Vector3d;
+    using Masks = TrackedVector<std::atomic<uint64_t>, MemTag::Framebuffer>;
+
+    // resolution^3 cells over _bounds, tile t's mask starts at word t * words
+    struct Grid
+    {
+        int id = 0; // index into the thread's boxes
+        int resolution = 0;
+        Vec3 cellSize = Vec3::Zero(), cellsPerUnit = Vec3::Zero();
+        std::size_t words = 0;
+        mutable Masks cells;
+    };
+
+private:
+    int _tileSize = 0;
+    int _tilesX = 0, _tilesY = 0;
+    int _nObjects = 0;
+    AABB _bounds;
+    Grid _grid;       // primary and secondary rays
+    Grid _shadowGrid; // shadow rays
+    std::size_t _objectWords = 0; // per tile
+    mutable Masks _objects;       // tile t's mask starts at word t * _objectWords
+    mutable TrackedVector<std::atomic<bool>, MemTag::Framebuffer> _escaped; // some ray of the tile left the grid
+    std::vector<bool> _dirty;
+    uint64_t _generation = 0; // changes whenever marked cells are cleared, unique over all trackers
+
+    // Tile of the sample the thread is tracing or shading
+    static int &_current()
+    {
+        thread_local int current = -1;
+        return current;
+    }
+    // Box of cells the thread last marked whole in a tile, per grid
+    struct MarkedBox
+    {
+        uint64_t generation = 0;
+        int tile = -1;
+        int lo[3], hi[3];
+    };
+    static MarkedBox *_markedBoxes()
+    {
+        thread_local MarkedBox boxes[2];
+        return boxes;
+    }
+    static uint64_t _nextGeneration()
+    {
+        static std::atomic<uint64_t> generation{0};
+        return ++generation;
+    }
+    inline static void _setBit(std::atomic<uint64_t> *mask, std::size_t bit)
+    {
+        std::atomic<uint64_t> &word = mask[bit / 64];
+        uint64_t flag = uint64_t(1) << (bit % 64);
+        if (!(word.load(std::memory_order_relaxed) & flag))
+            word.fetch_or(flag, std::memory_order_relaxed);
+    }
+    inline static bool _testBit(const std::atomic<uint64_t> *mask, std::size_t bit)
+    {
+        return mask[bit / 64].load(std::memory_order_relaxed) >> (bit % 64) & 1;
+    }
+    inline static std::size_t _cellIndex(const Grid &grid, int x, int y, int z)
+    {
+        return (std::size_t(z) * grid.resolution + y) * grid.resolution + x;
+    }
+    inline static int _clampCell(const Grid &grid, double c)
+    {
+        return std::clamp(int(std::floor(c)), 0, grid.resolution - 1);
+    }
+    void _resetGrid(Grid &grid, int id, int resolution, std::size_t nTiles)
+    {
+        grid.id = id;
+        grid.resolution = resolution;
+        grid.cellSize = _bounds.len() / resolution;
+        grid.cellsPerUnit = grid.cellSize.cwiseInverse();
+        grid.words = (std::size_t(resolution) * resolution * resolution + 63) / 64;
+        grid.cells = Masks(nTiles * grid.words); // constructed zeroed
+    }
+    // Mark the cells of tile t the ray o + t * d, in cells of grid, crosses from cell to end, walking them cell
+    // by cell, invD is the reciprocal of d
+    // The steps along each axis are counted from the end cells up front, so the walk needs no bounds checks
+    // and an axis is never stepped past the end cell whatever the rounding
+    void _markSegment(const Grid &grid, int t, const Vec3 &o, const Vec3 &invD, const int cell[3], const int end[3]) const
+    {
+        std::atomic<uint64_t> *cells = grid.cells.data() + t * grid.words;
+        int c[3] = {cell[0], cell[1], cell[2]}, step[3], left[3];
+        double tNext[3], tDelta[3];
+        for (int a : {0, 1, 2})
+        {
+            step[a] = end[a] >= cell[a] ? 1 : -1;
+            left[a] = std::abs(end[a] - cell[a]);
+            tDelta[a] = std::abs(invD[a]);
+            tNext[a] = left[a] == 0 ? INF : (cell[a] + (end[a] > cell[a]) - o[a]) * invD[a];
+        }
+        _setBit(cells, _cellIndex(grid, c[0], c[1], c[2]));
+        for (int n = left[0] + left[1] + left[2]; n > 0; n--)
+        {
+            int a = tNext[1] < tNext[0];
+            a = tNext[2] < tNext[a] ? 2 : a;
+            c[a] += step[a];
+            tNext[a] = --left[a] > 0 ? tNext[a] + tDelta[a] : INF;
+            _setBit(cells, _cellIndex(grid, c[0], c[1], c[2]));
+        }
+    }
+    void _markBox(const Grid &grid, int t, const int lo[3], const int hi[3]) const
+    {
+        std::atomic<uint64_t> *cells = grid.cells.data() + t * grid.words;
+        for (int z = lo[2]; z <= hi[2]; z++)
+            for (int y = lo[1]; y <= hi[1]; y++)
+                for (int x = lo[0]; x <= hi[0]; x++)
+                    _setBit(cells, _cellIndex(grid, x, y, z));
+    }
+    // Cells of grid the box, within the bounds, reaches into, grown a little as segments are walked in floating point
+    std::vector<uint64_t> _boxCells(const Grid &grid, const AABB &box) const
+    {
+        std::vector<uint64_t> cells(grid.words, 0);
+        Vec3 lo = (box.min() - _bounds.min()).cwiseProduct(grid.cellsPerUnit), hi = (box.max() - _bounds.min()).cwiseProduct(grid.cellsPerUnit);
+        for (int z = _clampCell(grid, lo[2] - 1e-3); z <= _clampCell(grid, hi[2] + 1e-3); z++)
+            for (int y = _clampCell(grid, lo[1] - 1e-3); y <= _clampCell(grid, hi[1] + 1e-3); y++)
+                for (int x = _clampCell(grid, lo[0] - 1e-3); x <= _clampCell(grid, hi[0] + 1e-3); x++)
+                {
+                    std::size_t c = _cellIndex(grid, x, y, z);
+                    cells[c / 64] |= uint64_t(1) << (c % 64);
+                }
+        return cells;
+    }
+    inline static bool _crossed(const Grid &grid, std::size_t t, const std::vector<uint64_t> &cells)
+    {
+        const std::atomic<uint64_t> *tileCells = grid.cells.data() + t * grid.words;
+        for (std::size_t w = 0; w < cells.size(); w++)
+            if (tileCells[w].load(std::memory_order_relaxed) & cells[w])
+                return true;
+        return false;
+    }
+
+public:
+    TileTracker(){};
+
+public:
+    // Forget every record and track a width * height film for nObjects objects, the grids of resolution^3
+    // and shadowResolution^3 cells span bounds
+    void reset(int width, int height, int tileSize, int nObjects, const AABB &bounds, int resolution, int shadowResolution)
+    {
+        _tileSize = tileSize;
+        _tilesX = (width + tileSize - 1) / tileSize;
+        _tilesY = (height + tileSize - 1) / tileSize;
+        _nObjects = nObjects;
+        // Padded so flat scenes get cells of non-zero size
+        Vec3 pad = Vec3::Constant(1e-3 * bounds.len().norm() + 1e-6);
+        _bounds.set(bounds.min() - pad, bounds.max() + pad);
+        std::size_t nTiles = std::size_t(_tilesX) * _tilesY;
+        _resetGrid(_grid, 0, resolution, nTiles);
+        _resetGrid(_shadowGrid, 1, shadowResolution, nTiles);
+        _objectWords = (std::size_t(nObjects) + 63) / 64;
+        // Constructed zeroed
+        _objects = Masks(nTiles * _objectWords);
+        _escaped = TrackedVector<std::atomic<bool>, MemTag::Framebuffer>(nTiles);
+        _dirty.assign(nTiles, false);
+        _generation = _nextGeneration();
+    }
+    inline bool empty() const
+    {
+        return _dirty.empty();
+    }
+    inline int nObjects() const
+    {
+        return _nObjects;
+    }
+    inline int tileSize() const
+    {
+        return _tileSize;
+    }
+    inline int tilesX() const
+    {
+        return _tilesX;
+    }
+    inline int tilesY() const
+    {
+        return _tilesY;
+    }
+
+    // Rays the calling thread records from now on belong to pixel (i, j)
+    inline void enter(int i, int j) const
+    {
+        _current() = (i / _tileSize) * _tilesX + j / _tileSize;
+    }
+    // object is the index of the object the closest hit is on, -1 for a miss, tHit the hit's distance along the ray
+    void record(const Ray &ray, int object, double tHit, bool shadow = false) const
+    {
+        int t = _current();
+        if (t < 0)
+            return;
+        if (object >= 0)
+            _setBit(_objects.data() + t * _objectWords, object);
+        // The ray in cells of the grid, the ray's nudged reciprocal direction keeps the slabs of axis-parallel rays finite
+        const Grid &grid = shadow ? _shadowGrid : _grid;
+        Vec3 o = (ray.orig() - _bounds.min()).cwiseProduct(grid.cellsPerUnit), d = ray.dir().cwiseProduct(grid.cellsPerUnit);
+        Vec3 invD = ray.invDir().cwiseProduct(grid.cellSize);
+        // The part of the segment within the grid
+        double tEnd = object >= 0 ? tHit : INF;
+        double tMin = 0.0, tMax = tEnd;
+        for (int a : {0, 1, 2})
+        {
+            double t0 = -o[a] * invD[a], t1 = (grid.resolution - o[a]) * invD[a];
+            tMin = std::max(tMin, std::min(t0, t1));
+            tMax = std::min(tMax, std::max(t0, t1));
+        }
+        if ((tMin > 0.0 || tMax < tEnd) && !_escaped[t].load(std::memory_order_relaxed))
+            _escaped[t].store(true, std::memory_order_relaxed);
+        if (tMin > tMax)
+            return;
+        int cell[3], end[3];
+        for (int a : {0, 1, 2})
+        {
+            cell[a] = _clampCell(grid, o[a] + tMin * d[a]);
+            end[a] = _clampCell(grid, o[a] + tMax * d[a]);
+        }
+        // Rays of a tile mostly run between the same few cells, a segment is within a box of cells if both its
+        // end cells are, so a segment inside the box the thread last marked whole in this tile is skipped
+        // Short segments mark the whole box of cells between their end cells, a few more cells than their walk
+        MarkedBox &box = _markedBoxes()[grid.id];
+        bool marked = box.generation == _generation && box.tile == t;
+        for (int a : {0, 1, 2})
+            marked = marked && std::min(cell[a], end[a]) >= box.lo[a] && std::max(cell[a], end[a]) <= box.hi[a];
+        if (marked)
+            return;
+        if (std::abs(end[0] - cell[0]) <= 1 && std::abs(end[1] - cell[1]) <= 1 && std::abs(end[2] - cell[2]) <= 1)
+        {
+            box.generation = _generation;
+            box.tile = t;
+            for (int a : {0, 1, 2})
+            {
+                box.lo[a] = std::min(cell[a], end[a]);
+                box.hi[a] = std::max(cell[a], end[a]);
+            }
+            _markBox(grid, t, box.lo, box.hi);
+        }
+        else
+            _markSegment(grid, t, o, invD, cell, end);
+    }
+
+    // Mark the tiles whose rays hit object, enough when only its material changed
+    // Objects added after the render were not tracked, nothing hit them then
+    void invalidate(int object)
+    {
+        if (object >= _nObjects)
+            return;
+        for (std::size_t t = 0; t < _dirty.size(); t++)
+            if (_testBit(_objects.data() + t * _objectWords, object))
+                _dirty[t] = true;
+    }
+    // Mark the tiles object, now within bounds, may look different in
+    void invalidate(int object, const AABB &bounds)
+    {
+        invalidate(object);
+        // Segments were only followed within the bounds
+        bool outside = (bounds.min().array() < _bounds.min().array()).any() || (bounds.max().array() > _bounds.max().array()).any();
+        AABB inside = bounds.intersection(_bounds);
+        if (inside.empty())
+        {
+            if (outside)
+                for (std::size_t t = 0; t < _dirty.size(); t++)
+                    if (_escaped[t].load(std::memory_order_relaxed))
+                        _dirty[t] = true;
+            return;
+        }
+        std::vector<uint64_t> cells = _boxCells(_grid, inside), shadowCells = _boxCells(_shadowGrid, inside);
+        for (std::size_t t = 0; t < _dirty.size(); t++)
+            if (_crossed(_grid, t, cells) || _crossed(_shadowGrid, t, shadowCells) ||
+                (outside && _escaped[t].load(std::memory_order_relaxed)))
+                _dirty[t] = true;
+    }
+    inline bool dirty(int tx, int ty) const
+    {
+        return _dirty[std::size_t(ty) * _tilesX + tx];
+    }
+    int nDirty() const
+    {
+        return std::count(_dirty.begin(), _dirty.end(), true);
+    }
+    // Drop the records of the dirty tiles before they are rendered again and mark them clean
+    void clearDirty()
+    {
+        for (std::size_t t = 0; t < _dirty.size(); t++)
+            if (_dirty[t])
+            {
+                for (std::size_t w = 0; w < _objectWords; w++)
+                    _objects[t * _objectWords + w].store(0, std::memory_order_relaxed);
+                for (const Grid *grid : {&_grid, &_shadowGrid})
+                    for (std::size_t w = 0; w < grid->words; w++)
+                        grid->cells[t * grid->words + w].store(0, std::memory_order_relaxed);
+                _escaped[t].store(false, std::memory_order_relaxed);
+                _dirty[t] = false;
+            }
+        _generation = _nextGeneration();
+    }
+};
\ No newline at end of file
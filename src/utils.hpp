@@ -1,9 +1,20 @@
 #pragma once
 #include <iostream>
+#include <string>
+
+// Messages may be string literals or std::string, both are printed through a C string
+inline const char *errorText(const char *msg)
+{
+    return msg;
+}
+inline const char *errorText(const std::string &msg)
+{
+    return msg.c_str();
+}
 
 #define RAISE_ERROR(x)                                 \
     {                                                  \
-        printf("%s\n", x);                             \
+        printf("%s\n", errorText(x));                  \
         printf("%s:line %d: x\n", __FILE__, __LINE__); \
         exit(-1);                                      \
     }
@@ -0,0 +1,348 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <limits>
+#include <eigen3/Eigen/Core>
+#include "bvh.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WIDE_BVH_X86
+#endif
+
+// Runtime CPU dispatch, checked once per process
+inline bool cpuHasAVX()
+{
+#ifdef WIDE_BVH_X86
+    static const bool hasAVX = __builtin_cpu_supports("avx");
+    return hasAVX;
+#else
+    return false;
+#endif
+}
+
+// A node of a collapsed N-ary BVH
+// Child bounds are stored as SoA so one SIMD slab test covers all children
+template <int N>
+struct alignas(32) WideBVHNode
+{
+    float bounds[6][N]; // minX, maxX, minY, maxY, minZ, maxZ of each child
+    int child[N];       // inner child: node index, leaf child: first primitive
+    int count[N];       // 0: inner child, >0: number of primitives in leaf, -1: empty slot
+};
+
+// Ray in single precision with the near/far plane of each axis picked by direction sign
+struct WideRay
+{
+    float org[3];
+    float invDir[3];
+    int near[3];
+    int far[3];
+
+    WideRay(const Ray &ray)
+    {
+        for (int i : {0, 1, 2})
+        {
+            org[i] = ray.orig()[i];
+            invDir[i] = ray.invDir()[i];
+            near[i] = 2 * i + (invDir[i] < 0.0f);
+            far[i] = 2 * i + 1 - (invDir[i] < 0.0f);
+        }
+    }
+};
+
+// Slab tests of one ray against N boxes stored as SoA
+// Return a bitmask of the boxes hit before tMax, and their entry distances in tNear
+// Float bounds are widened so rounding can never cull a box the double test would hit
+constexpr float WIDE_BVH_ROBUST_SCALE = 1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+
+template <int N>
+inline int wideSlabTestScalar(const float (*bounds)[N], const WideRay &r, float tMax, float *tNear)
+{
+    int mask = 0;
+    for (int i = 0; i < N; i++)
+    {
+        float t0 = 0.0f, t1 = tMax;
+        for (int k = 0; k < 3; k++)
+        {
+            t0 = std::max(t0, (bounds[r.near[k]][i] - r.org[k]) * r.invDir[k]);
+            t1 = std::min(t1, (bounds[r.far[k]][i] - r.org[k]) * r.invDir[k]);
+        }
+        tNear[i] = t0;
+        mask |= int(t0 <= t1 * WIDE_BVH_ROBUST_SCALE) << i;
+    }
+    return mask;
+}
+
+#ifdef WIDE_BVH_X86
+template <int N>
+inline int wideSlabTestSSE(const float (*bounds)[N], int offset, const WideRay &r, float tMax, float *tNear)
+{
+    __m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(tMax);
+    for (int k = 0; k < 3; k++)
+    {
+        __m128 o = _mm_set1_ps(r.org[k]), inv = _mm_set1_ps(r.invDir[k]);
+        __m128 tn = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[r.near[k]] + offset), o), inv);
+        __m128 tf = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[r.far[k]] + offset), o), inv);
+        t0 = _mm_max_ps(t0, tn);
+        t1 = _mm_min_ps(t1, tf);
+    }
+    _mm_storeu_ps(tNear + offset, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(WIDE_BVH_ROBUST_SCALE))));
+}
+
+__attribute__((target("avx"))) inline int wideSlabTestAVX(const float (*bounds)[8], const WideRay &r, float tMax, float *tNear)
+{
+    __m256 t0 = _mm256_setzero_ps(), t1 = _mm256_set1_ps(tMax);
+    for (int k = 0; k < 3; k++)
+    {
+        __m256 o = _mm256_set1_ps(r.org[k]), inv = _mm256_set1_ps(r.invDir[k]);
+        __m256 tn = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[r.near[k]]), o), inv);
+        __m256 tf = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[r.far[k]]), o), inv);
+        t0 = _mm256_max_ps(t0, tn);
+        t1 = _mm256_min_ps(t1, tf);
+    }
+    _mm256_storeu_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, _mm256_mul_ps(t1, _mm256_set1_ps(WIDE_BVH_ROBUST_SCALE)), _CMP_LE_OQ));
+}
+#endif
+
+// bounds must be 16-byte aligned, and 32-byte aligned for N == 8
+template <int N>
+inline int wideSlabTest(const float (*bounds)[N], const WideRay &r, float tMax, float *tNear, bool useAVX)
+{
+#ifdef WIDE_BVH_X86
+    if constexpr (N == 4)
+        return wideSlabTestSSE<N>(bounds, 0, r, tMax, tNear);
+    else if constexpr (N == 8)
+    {
+        if (useAVX)
+            return wideSlabTestAVX(bounds, r, tMax, tNear);
+        return wideSlabTestSSE<N>(bounds, 0, r, tMax, tNear) | (wideSlabTestSSE<N>(bounds, 4, r, tMax, tNear) << 4);
+    }
+#endif
+    return wideSlabTestScalar<N>(bounds, r, tMax, tNear);
+}
+
+// Closest-hit traversal shared by all wide layouts
+// fetch(index, scratch) returns the node at index, compressed layouts decode it into scratch
+// leaf(first, count) intersects a leaf's primitives and lowers tMax on a closer hit
+template <int N, typename Fetch, typename Leaf>
+void wideBVHTraverse(const Ray &ray, int stackSize, bool useAVX, double &tMax, Fetch fetch, Leaf leaf)
+{
+    struct StackEntry
+    {
+        int node;
+        float tNear;
+    };
+
+    WideRay r(ray);
+
+    StackEntry localStack[256];
+    std::vector<StackEntry> heapStack;
+    StackEntry *stack = localStack;
+    if (stackSize > 256)
+    {
+        heapStack.resize(stackSize);
+        stack = heapStack.data();
+    }
+
+    WideBVHNode<N> scratch;
+    int sp = 0;
+    stack[sp++] = {0, 0.0f};
+    while (sp > 0)
+    {
+        StackEntry entry = stack[--sp];
+        if (entry.tNear > tMax)
+            continue;
+        const WideBVHNode<N> &node = fetch(entry.node, scratch);
+        alignas(32) float tNear[N];
+        int mask = wideSlabTest<N>(node.bounds, r, tMax, tNear, useAVX);
+
+        // Leaves are intersected right away, inner children are pushed far to near
+        StackEntry inner[N];
+        int nInner = 0;
+        while (mask)
+        {
+            int i = __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (node.count[i] > 0)
+                leaf(node.child[i], node.count[i]);
+            else if (node.count[i] == 0)
+            {
+                int j = nInner++;
+                for (; j > 0 && inner[j - 1].tNear < tNear[i]; j--)
+                    inner[j] = inner[j - 1];
+                inner[j] = {node.child[i], tNear[i]};
+            }
+        }
+        for (int j = 0; j < nInner; j++)
+            stack[sp++] = inner[j];
+    }
+}
+
+// Generic closest hit through the primitives' virtual intersect
+template <int N, typename Prims, typename Fetch>
+Intersection wideBVHIntersect(const Ray &ray, const Prims &prims, int stackSize, bool useAVX, Fetch fetch)
+{
+    Intersection ret;
+    wideBVHTraverse<N>(ray, stackSize, useAVX, ret.t, fetch, [&](int first, int count) {
+        for (int k = first; k < first + count; k++)
+        {
+            Intersection inter = prims[k]->intersect(ray);
+            if (inter.t < ret.t)
+                ret = inter;
+        }
+    });
+    return ret;
+}
+
+template <int N>
+class WideBVH
+{
+    using ObjPtr = std::shared_ptr<Renderable>;
+    using NodePtr = std::shared_ptr<BVHNode>;
+    using Node = WideBVHNode<N>;
+    using Vec3 = Eigen::Vector3d;
+
+private:
+    TrackedVector<Node, MemTag::BVH> _nodes;   // _nodes[0] is the root
+    TrackedVector<ObjPtr, MemTag::BVH> _prims; // primitives in leaf order
+    int _stackSize = 1;          // upper bound of the traversal stack
+    bool _useAVX = false;
+
+private:
+    static void _setEmpty(Node &node, int i)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            node.bounds[2 * k][i] = INF;
+            node.bounds[2 * k + 1][i] = -INF;
+        }
+        node.child[i] = 0;
+        node.count[i] = -1;
+    }
+    static void _setBounds(Node &node, int i, const AABB &aabb)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            float lo = aabb.min()[k], hi = aabb.max()[k];
+            node.bounds[2 * k][i] = std::nextafter(lo, -std::numeric_limits<float>::infinity());
+            node.bounds[2 * k + 1][i] = std::nextafter(hi, std::numeric_limits<float>::infinity());
+        }
+    }
+    static double _area(const AABB &aabb)
+    {
+        Vec3 l = aabb.len();
+        return l[0] * l[1] + l[1] * l[2] + l[2] * l[0];
+    }
+
+    // Pull up to N descendants of a binary node into one wide node, always opening the largest child
+    int _collapse(const BVHNode *bnode, int depth)
+    {
+        std::vector<const BVHNode *> slots;
+        if (bnode->left())
+            slots = {bnode->left().get(), bnode->right().get()};
+        else
+            slots = {bnode};
+        while (slots.size() < N)
+        {
+            int best = -1;
+            double bestArea = -1.0;
+            for (int i = 0; i < slots.size(); i++)
+                if (slots[i]->left() && _area(slots[i]->aabb()) > bestArea)
+                {
+                    best = i;
+                    bestArea = _area(slots[i]->aabb());
+                }
+            if (best < 0)
+                break;
+            const BVHNode *opened = slots[best];
+            slots[best] = opened->left().get();
+            slots.push_back(opened->right().get());
+        }
+
+        int index = _nodes.size();
+        _nodes.emplace_back();
+        _stackSize = std::max(_stackSize, depth * (N - 1) + 1);
+        for (int i = 0; i < N; i++)
+            _setEmpty(_nodes[index], i);
+        for (int i = 0; i < slots.size(); i++)
+        {
+            const BVHNode *slot = slots[i];
+            int child, count;
+            if (slot->left())
+            {
+                child = _collapse(slot, depth + 1);
+                count = 0;
+            }
+            else
+            {
+                child = _prims.size();
+                count = 1;
+                _prims.push_back(slot->obj());
+            }
+            // _nodes may have grown, index again
+            _setBounds(_nodes[index], i, slot->aabb());
+            _nodes[index].child[i] = child;
+            _nodes[index].count[i] = count;
+        }
+        return index;
+    }
+
+public:
+    WideBVH(){};
+
+public:
+    static std::shared_ptr<WideBVH> build(std::vector<ObjPtr> objs, BVHBuilder builder = BVHBuilder::Midpoint, double maxDuplication = 0.3)
+    {
+        static_assert(N == 4 || N == 8, "Only 4-wide and 8-wide BVH are supported");
+        std::shared_ptr<WideBVH> ret = std::make_shared<WideBVH>();
+        ret->_useAVX = cpuHasAVX();
+        // The binary tree is only needed while collapsing
+        Arena arena(MemTag::BVH);
+        NodePtr root = BVHNode::build(arena, std::move(objs), builder, maxDuplication);
+        ret->_collapse(root.get(), 1);
+        ret->_nodes.shrink_to_fit();
+        ret->_prims.shrink_to_fit();
+        return ret;
+    }
+
+    Intersection intersect(const Ray &ray) const
+    {
+        return wideBVHIntersect<N>(ray, _prims, _stackSize, _useAVX, [this](int index, Node &) -> const Node & { return _nodes[index]; });
+    }
+
+    // Traverse with a caller supplied leaf kernel, see wideBVHTraverse
+    template <typename Leaf>
+    void traverse(const Ray &ray, double &tMax, Leaf leaf) const
+    {
+        wideBVHTraverse<N>(ray, _stackSize, _useAVX, tMax, [this](int index, Node &) -> const Node & { return _nodes[index]; }, leaf);
+    }
+
+public:
+    inline std::size_t numNodes() const
+    {
+        return _nodes.size();
+    }
+    inline const TrackedVector<Node, MemTag::BVH> &nodes() const
+    {
+        return _nodes;
+    }
+    inline const TrackedVector<ObjPtr, MemTag::BVH> &prims() const
+    {
+        return _prims;
+    }
+    inline int stackSize() const
+    {
+        return _stackSize;
+    }
+    inline std::size_t nodeBytes() const
+    {
+        return _nodes.size() * sizeof(Node);
+    }
+    inline std::size_t memoryBytes() const
+    {
+        return nodeBytes() + _prims.size() * sizeof(ObjPtr);
+    }
+};
\ No newline at end of file